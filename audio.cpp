@@ -1,68 +1,20 @@
-#include "audio.h"
-
-SDL_AudioDeviceID Audio::device;
-SDL_AudioSpec Audio::spec;
-
-double Audio::frequency;
-double Audio::volume;
-
-int Audio::pos;
-
-int (*Audio::calcOffset)(int sample, int channel);
-void (*Audio::writeData)(uint8_t* ptr, double data);
-
-int calcOffsets16(int sample, int channel) {
-    return (sample * sizeof(int16_t) * Audio::spec.channels) + (channel * sizeof(int16_t));
-}
-
-int calcOffsetf32(int sample, int channel) {
-    return (sample * sizeof(float) * Audio::spec.channels) + (channel * sizeof(float));
-}
-
-void writeDatas16(uint8_t* ptr, double data) {
-    int16_t* ptrTyped = (int16_t*) ptr;
-
-    double range = (double) INT16_MAX - (double) INT16_MIN;
-    double dataScaled = data * range / 2.0;
-
-    *ptrTyped = data;
-}
-
-void writeDataf32(uint8_t* ptr, double data) {
-    float* ptrTyped = (float*) ptr;
-    *ptrTyped = data;
-}
-
-double Audio::getData() {
-    double sampleRate = (double) spec.freq;
-
-    double period = sampleRate / frequency;
-
-    if (pos % (int) period == 0) {
-        pos = 0;
-    }
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <math.h>
 
-    double angularFreq = (1.0 / period) * 2.0 * M_PI;
-    double amplitude = volume;
-
-    return sin((double) pos * angularFreq) * amplitude;
-}
-
-void Audio::callback(void* userdata, uint8_t* stream, int len) {
-    for (int sample = 0; sample < spec.samples; ++sample) {
-        double data = getData();
-        pos++;
-
-        for (int channel = 0; channel < spec.channels; ++channel) {
-            int offset = calcOffset(sample, channel);
-            uint8_t* ptrData = stream + offset;
-            writeData(ptrData, data);
-        }
-    }
+#include "audio.h"
 
-}
+// length of the fade in and out around a beep, long enough to avoid clicks
+static const int RAMP_SAMPLES = 64;
+// events stamped further ahead than this many buffers mean the emulation ran
+// ahead of real time (fast-forward, a stall), the tick mapping is rebuilt
+static const int MAX_LEAD_BUFFERS = 8;
 
 void Audio::open() {
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) { throw std::runtime_error("SDL AUDIO INITALIZATION FAILED."); }
+
     SDL_AudioSpec desired;
     SDL_zero(desired);
 
@@ -71,6 +23,7 @@ void Audio::open() {
     desired.samples = 512;
     desired.channels = 1;
     desired.callback = Audio::callback;
+    desired.userdata = this;
 
     device = SDL_OpenAudioDevice(NULL, 0, &desired, &spec, 0);
 
@@ -80,16 +33,13 @@ void Audio::open() {
         std::string formatName;
         switch (spec.format) {
             case AUDIO_S16:
-                writeData = writeDatas16;
-                calcOffset = calcOffsets16;
                 formatName = "AUDIO_S16";
                 break;
             case AUDIO_F32:
-                writeData = writeDataf32;
-                calcOffset = calcOffsetf32;
                 formatName = "AUDIO_F32";
                 break;
             default:
+                SDL_CloseAudioDevice(device);
                 throw std::runtime_error("UNSUPPORTED AUDIO FORMAT.");
         }
 
@@ -105,24 +55,193 @@ void Audio::open() {
         std::cout << "[Beeper] padding: " << spec.padding << std::endl;
         std::cout << "[Beeper] size: " << spec.size << std::endl;
     }
+
+    mix.resize(spec.samples);
+
+    // runs for good, silence is just a closed gate
+    SDL_PauseAudioDevice(device, 0);
 }
 
 void Audio::close() {
-    SDL_CloseAudioDevice(device);
+    if (device != 0) {
+        SDL_CloseAudioDevice(device);
+        device = 0;
+    }
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
+
+void Audio::post(Event::Type type, uint64_t tick, float value) {
+    Event event = { type, tick, value };
+    // a full queue means the audio thread is stuck, dropping is all we can do
+    events.push(event);
 }
 
 void Audio::setFreq(double freq) {
-    frequency = freq;
+    post(Event::FREQUENCY, lastTick, (float) freq);
 }
 
 void Audio::setVol(double vol) {
-    volume = vol;
+    post(Event::VOLUME, lastTick, (float) vol);
 }
 
-void Audio::play() {
-    SDL_PauseAudioDevice(device, 0);
+void Audio::play(uint64_t tick) {
+    lastTick = tick;
+    playing = true;
+    if (!muted) {
+        post(Event::PLAY, tick, 0);
+    }
+}
+
+void Audio::stop(uint64_t tick) {
+    lastTick = tick;
+    playing = false;
+    if (!muted) {
+        post(Event::STOP, tick, 0);
+    }
+}
+
+// Muted, play and stop only track the beeper, so running far ahead of real
+// time neither floods the queue nor chirps; unmuting picks up where it is.
+void Audio::setMuted(bool mute) {
+    if (mute == muted) {
+        return;
+    }
+    muted = mute;
+    if (muted) {
+        post(Event::STOP, lastTick, 0);
+    } else if (playing) {
+        post(Event::PLAY, lastTick, 0);
+    }
 }
 
-void Audio::stop() {
-    SDL_PauseAudioDevice(device, 1);
-}
\ No newline at end of file
+// Maps a 60 Hz timer tick to a position in the output stream. The first event
+// anchors the mapping one buffer ahead of the stream; after that events keep
+// their exact spacing in samples.
+uint64_t Audio::sampleOf(uint64_t tick) {
+    if (anchored && tick >= anchorTick) {
+        uint64_t sample = anchorSample + ((tick - anchorTick) * spec.freq) / 60;
+        if (sample < streamPos + (uint64_t) MAX_LEAD_BUFFERS * spec.samples) {
+            return sample;
+        }
+    }
+
+    anchored = true;
+    anchorTick = tick;
+    anchorSample = streamPos + spec.samples;
+    return anchorSample;
+}
+
+void Audio::apply(const Event& event) {
+    switch (event.type) {
+        case Event::PLAY: gate = true; break;
+        case Event::STOP: gate = false; break;
+        case Event::FREQUENCY: frequency = event.value; break;
+        case Event::VOLUME: volume = event.value; break;
+    }
+}
+
+// Residual that smooths the step at phase 0. Both sides are always computed and
+// selected so the render loop stays free of branches.
+static inline float polyBlep(float t, float dt) {
+    float a = t / dt;
+    float b = (t - 1.0f) / dt;
+    float rise = (t < dt) ? a + a - a * a - 1.0f : 0.0f;
+    float fall = (t > 1.0f - dt) ? b * b + b + b + 1.0f : 0.0f;
+    return rise + fall;
+}
+
+// Synthesizes `count` samples with the current parameters. Every sample only
+// depends on its index, so the loop has no carried state and vectorizes (GCC
+// wants -O3 -fno-trapping-math before it turns the selects into blends).
+void Audio::render(float* out, int count) {
+    float target = gate ? volume : 0.0f;
+
+    if (gain == 0.0f && target == 0.0f) {
+        for (int i = 0; i < count; i++) {
+            out[i] = 0.0f;
+        }
+        return;
+    }
+
+    const float dt = frequency / (float) spec.freq;
+    const float slope = (target > gain ? 1.0f : -1.0f) / RAMP_SAMPLES;
+    const float low = fminf(gain, target);
+    const float high = fmaxf(gain, target);
+    const float start = phase;
+    const float startGain = gain;
+
+    for (int i = 0; i < count; i++) {
+        // phases are never negative, truncation is floor
+        float t = start + i * dt;
+        t -= (float) (int) t;
+        float half = t + 0.5f;
+        half -= (float) (int) half;
+
+        float square = (t < 0.5f) ? 1.0f : -1.0f;
+        square += polyBlep(t, dt);
+        square -= polyBlep(half, dt);
+
+        float g = startGain + slope * (i + 1);
+        g = g < low ? low : g;
+        g = g > high ? high : g;
+        out[i] = square * g;
+    }
+
+    phase = start + count * dt;
+    phase -= floorf(phase);
+    gain = fminf(fmaxf(startGain + slope * count, low), high);
+}
+
+void Audio::callback(void* userdata, uint8_t* stream, int len) {
+    Audio& audio = *(Audio*) userdata;
+    const SDL_AudioSpec& spec = audio.spec;
+
+    memset(stream, 0, len);
+
+    int frameSize = (spec.format == AUDIO_S16 ? sizeof(int16_t) : sizeof(float)) * spec.channels;
+    int samples = len / frameSize;
+    if ((int) audio.mix.size() < samples) {
+        samples = audio.mix.size();
+    }
+
+    // split the buffer at every event that lands inside it
+    int done = 0;
+    while (done < samples) {
+        int segment = samples - done;
+
+        const Event* event = audio.events.front();
+        if (event != nullptr) {
+            uint64_t at = audio.sampleOf(event->tick);
+            uint64_t now = audio.streamPos + done;
+            if (at <= now) {
+                audio.apply(*event);
+                audio.events.pop();
+                continue;
+            }
+            if (at - now < (uint64_t) segment) {
+                segment = at - now;
+            }
+        }
+
+        audio.render(audio.mix.data() + done, segment);
+        done += segment;
+    }
+    audio.streamPos += samples;
+
+    if (spec.format == AUDIO_S16) {
+        int16_t* out = (int16_t*) stream;
+        for (int i = 0; i < samples; i++) {
+            int16_t value = (int16_t) (audio.mix[i] * INT16_MAX);
+            for (int channel = 0; channel < spec.channels; channel++) {
+                out[i * spec.channels + channel] = value;
+            }
+        }
+    } else {
+        float* out = (float*) stream;
+        for (int i = 0; i < samples; i++) {
+            for (int channel = 0; channel < spec.channels; channel++) {
+                out[i * spec.channels + channel] = audio.mix[i];
+            }
+        }
+    }
+}
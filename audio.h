@@ -1,33 +1,67 @@
+#pragma once
+
 #include <SDL2/SDL.h>
-#include <iostream>
-#include <string>
-#include <math.h>
+#include <vector>
+
+#include "sinks.h"
+#include "spsc_queue.h"
 
-class Audio {
+// SDL beeper. The device runs continuously; the emulation thread only posts
+// timestamped events (play, stop, frequency, volume) through a lock-free
+// queue and the audio thread applies each one at the sample its timer tick
+// maps to, synthesizing a band-limited (PolyBLEP) square wave.
+class Audio : public AudioSink {
     private:
-        static SDL_AudioDeviceID device;
+        struct Event {
+            enum Type : uint8_t { PLAY, STOP, FREQUENCY, VOLUME };
 
-        static double frequency;
-        static double volume;
+            Type type;
+            uint64_t tick;
+            float value;
+        };
 
-        static int pos;
-        
-        static int (*calcOffset)(int sample, int channel);
-        static void (*writeData)(uint8_t* ptr, double data);
+        SDL_AudioDeviceID device = 0;
+        SDL_AudioSpec spec;
 
-        static double getData();
+        SpscQueue<Event, 256> events;
 
-        static void callback(void *userdata, Uint8 *stream, int len);
+        // emulation thread: tick of the last event, frequency and volume
+        // changes are stamped with it
+        uint64_t lastTick = 0;
+        // emulation thread: the beeper as the machine last set it, and
+        // whether that is held back from the audio thread
+        bool playing = false;
+        bool muted = false;
 
-    public:
-        static void open();
-        static void close();
+        // audio thread only from here on
+        uint64_t streamPos = 0;     // samples rendered since open
+        bool anchored = false;      // whether anchorSample/anchorTick are set
+        uint64_t anchorSample = 0;
+        uint64_t anchorTick = 0;
+
+        float frequency = 392.0f;
+        float volume = 0.25f;
+        float phase = 0.0f;
+        float gain = 0.0f;          // current amplitude, ramps towards volume or 0
+        bool gate = false;
 
-        static void setFreq(double freq);
-        static void setVol(double vol);
+        std::vector<float> mix;
+
+        static void callback(void* userdata, Uint8* stream, int len);
+
+        void post(Event::Type type, uint64_t tick, float value);
+        uint64_t sampleOf(uint64_t tick);
+        void apply(const Event& event);
+        void render(float* out, int count);
+
+    public:
+        void open();
+        void close();
 
-        static void play();
-        static void stop();
+        void setFreq(double freq);
+        void setVol(double vol);
 
-        static SDL_AudioSpec spec;
-};
\ No newline at end of file
+        void play(uint64_t tick) override;
+        void stop(uint64_t tick) override;
+        void setMuted(bool mute) override;
+};
@@ -0,0 +1,320 @@
+// Runs many emulator jobs in parallel, one machine per worker thread, and
+// prints the results as JSON in job order:
+//
+//   batch [--threads n] [--hz n] [--engine interpreter|cache|jit]
+//         [--quirks default|chip8|schip|xochip] [--romdb file] [--romindex file]
+//         [--framebuffer] [--framelogs directory] jobs
+//
+// The job list is a text file, one job per line:
+//
+//   # rom seed log cycles
+//   game.ch8 1 - 5000000
+//   game.ch8 7 run.e8i 0
+//
+// A job runs with no keys pressed until it has executed `cycles`
+// instructions, or replays an input log (`-` for none), which then also
+// decides the seed, speed and quirk profile. With a log, cycles 0 runs to
+// its end. Otherwise a ROM runs with the profile and speed the ROM index
+// (or without one the ROM database) lists for it, unless --quirks or --hz
+// force them. --framelogs records what every job showed (see framelog.h) to
+// directory/<job>.e8f, job being its line number among the jobs.
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "scheduler.h"
+#include "inputlog.h"
+#include "framelog.h"
+#include "json.h"
+#include "romdb.h"
+#include "romfile.h"
+#include "romindex.h"
+#include "workpool.h"
+
+struct Job {
+    std::string rom;
+    uint64_t seed;
+    // empty for none
+    std::string log;
+    // instruction budget, 0 for none
+    uint64_t cycles;
+};
+
+struct Result {
+    uint64_t frames = 0;
+    uint64_t instructions = 0;
+    double seconds = 0;
+    uint64_t hash = 0;
+    uint8_t hires = 0;
+    uint64_t graphics[PLANES][MAX_HEIGHT][ROW_WORDS];
+    // set when the job failed, the rest is then meaningless
+    std::string error;
+};
+
+// a ROM image mapped once before the workers start, and its settings
+struct Rom {
+    RomFile file;
+    Profile profile = Profile::Default;
+    uint32_t hz = 0;
+};
+
+// settings shared by every job
+struct Batch {
+    uint32_t hz = 700;
+    bool hzForced = false;
+    Engine engine = Engine::Jit;
+    bool profileForced = false;
+    Profile profile = Profile::Default;
+    // ROMs by path
+    std::map<std::string, Rom> roms;
+    // empty for no frame logs
+    std::string framelogs;
+};
+
+static std::vector<Job> readJobs(const char* path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error(std::string("JOB LIST OPEN FAILED: ") + path);
+    }
+
+    std::vector<Job> jobs;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        Job job;
+        if (!(fields >> job.rom) || job.rom[0] == '#') {
+            continue;
+        }
+        if (!(fields >> job.seed >> job.log >> job.cycles)) {
+            throw std::runtime_error("INVALID JOB LINE: " + line);
+        }
+        if (job.log == "-") {
+            job.log.clear();
+        }
+        if (job.log.empty() && job.cycles == 0) {
+            throw std::runtime_error("JOB NEEDS A LOG OR A CYCLE BUDGET: " + line);
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+// maps the ROM and settles its profile and speed
+static void loadRom(Batch& batch, const std::string& path, const RomIndex& index, const RomDatabase& database) {
+    Rom& rom = batch.roms[path];
+    rom.file.open(path.c_str());
+    uint64_t hash = RomDatabase::hashRom(rom.file.data(), rom.file.size());
+
+    Profile listed = Profile::Default;
+    uint32_t listedHz = batch.hz;
+    settingsFor(hash, index, database, listed, listedHz);
+    rom.profile = batch.profileForced ? batch.profile : listed;
+    rom.hz = batch.hzForced ? batch.hz : listedHz;
+}
+
+static void runJob(Cpu& cpu, const Batch& batch, size_t number, const Job& job, Result& result) {
+    const Rom& rom = batch.roms.at(job.rom);
+
+    cpu.init();
+    cpu.loadProgram(rom.file.data(), rom.file.size());
+
+    Profile profile = rom.profile;
+    uint64_t seed = job.seed;
+    uint32_t hz = rom.hz;
+
+    NullInputSource none;
+    InputReplay replay;
+    InputSource* input = &none;
+    if (!job.log.empty()) {
+        replay.open(job.log.c_str());
+        seed = replay.seed;
+        hz = replay.hz;
+        profile = replay.profile;
+        input = &replay;
+    }
+
+    cpu.setProfile(profile);
+    cpu.engine = batch.engine;
+    cpu.seed(seed);
+
+    NullVideoSink noVideo;
+    FrameRecorder video(noVideo);
+    bool recording = !batch.framelogs.empty();
+    if (recording) {
+        video.open((batch.framelogs + "/" + std::to_string(number) + ".e8f").c_str());
+    }
+
+    Scheduler scheduler(cpu, hz);
+    Clock::time_point start = Clock::now();
+
+    bool keepOpen = true;
+    while (keepOpen && (job.cycles == 0 || scheduler.instructions < job.cycles)) {
+        keepOpen = input->poll(cpu.keys);
+        uint64_t limit = (job.cycles == 0) ? 0 : job.cycles - scheduler.instructions;
+        scheduler.runFrame(Clock::time_point::max(), limit);
+        if (recording && cpu.frameDirty()) {
+            video.present(cpu, cpu.dirtyRows);
+        }
+        cpu.dirtyRows = 0;
+    }
+    video.close(cpu);
+
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    result.frames = scheduler.frames;
+    result.instructions = scheduler.instructions;
+    result.seconds = elapsed.count();
+    result.hash = cpu.hash();
+    result.hires = cpu.hires;
+    memcpy(result.graphics, cpu.graphics, sizeof(result.graphics));
+
+    cpu.deinit();
+}
+
+// one hex string per plane, rows of the current resolution top to bottom;
+// planes past the last drawn one are left out
+static void printFramebuffer(const Result& result) {
+    int height = result.hires ? MAX_HEIGHT : MAX_HEIGHT / 2;
+    int words = result.hires ? ROW_WORDS : 1;
+
+    int used = 1;
+    for (int plane = 1; plane < PLANES; plane++) {
+        for (int y = 0; y < height; y++) {
+            for (int w = 0; w < words; w++) {
+                if (result.graphics[plane][y][w] != 0) {
+                    used = plane + 1;
+                }
+            }
+        }
+    }
+
+    printf(", \"width\": %d, \"height\": %d, \"framebuffer\": [", result.hires ? MAX_WIDTH : MAX_WIDTH / 2, height);
+    for (int plane = 0; plane < used; plane++) {
+        printf("%s\"", plane == 0 ? "" : ", ");
+        for (int y = 0; y < height; y++) {
+            for (int w = 0; w < words; w++) {
+                printf("%.16" PRIX64, result.graphics[plane][y][w]);
+            }
+        }
+        printf("\"");
+    }
+    printf("]");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned threads = 0;
+    const char* romdbPath = "roms.txt";
+    const char* romindexPath = NULL;
+    const char* jobsPath = NULL;
+    bool framebuffer = false;
+    Batch batch;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                threads = std::stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+                batch.hz = std::stoul(argv[++i]);
+                batch.hzForced = true;
+            } else if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc) {
+                romdbPath = argv[++i];
+            } else if (strcmp(argv[i], "--romindex") == 0 && i + 1 < argc) {
+                romindexPath = argv[++i];
+            } else if (strcmp(argv[i], "--framelogs") == 0 && i + 1 < argc) {
+                batch.framelogs = argv[++i];
+            } else if (strcmp(argv[i], "--framebuffer") == 0) {
+                framebuffer = true;
+            } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+                i++;
+                if (!parseProfile(argv[i], batch.profile)) {
+                    throw std::runtime_error(std::string("UNKNOWN QUIRKS: ") + argv[i]);
+                }
+                batch.profileForced = true;
+            } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+                i++;
+                if (!parseEngine(argv[i], batch.engine)) {
+                    throw std::runtime_error(std::string("UNKNOWN ENGINE: ") + argv[i]);
+                }
+            } else {
+                jobsPath = argv[i];
+            }
+        }
+
+        if (jobsPath == NULL) {
+            printf("usage: %s [--threads n] [--hz n] [--engine interpreter|cache|jit] [--quirks default|chip8|schip|xochip] [--romdb file] [--romindex file] [--framebuffer] [--framelogs directory] jobs\n", argv[0]);
+            return -1;
+        }
+        if (batch.hz == 0) {
+            // unlimited speed depends on the host clock, runs wouldn't repeat
+            throw std::runtime_error("BATCH RUNS NEED A FIXED SPEED.");
+        }
+
+        std::vector<Job> jobs = readJobs(jobsPath);
+        RomIndex index;
+        RomDatabase database;
+        openLibrary(romindexPath, romdbPath, index, database);
+        for (const Job& job: jobs) {
+            if (batch.roms.count(job.rom) == 0) {
+                loadRom(batch, job.rom, index, database);
+            }
+        }
+
+        WorkPool pool(threads);
+        // one machine per worker, reused from job to job
+        std::vector<std::unique_ptr<Cpu>> cpus;
+        for (unsigned w = 0; w < pool.threads(); w++) {
+            cpus.emplace_back(new Cpu());
+        }
+        std::vector<Result> results(jobs.size());
+
+        Clock::time_point start = Clock::now();
+        pool.run(jobs.size(), [&](size_t job, unsigned worker) {
+            try {
+                runJob(*cpus[worker], batch, job, jobs[job], results[job]);
+            } catch (const std::exception& error) {
+                results[job].error = error.what();
+                cpus[worker]->deinit();
+            }
+        });
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+
+        uint64_t instructions = 0;
+        for (const Result& result: results) {
+            instructions += result.instructions;
+        }
+
+        printf("{\n  \"threads\": %u,\n  \"jobs\": %zu,\n  \"seconds\": %.6f,\n  \"instructions_per_second\": %.0f,\n  \"results\": [",
+            pool.threads(), jobs.size(), elapsed.count(), instructions / elapsed.count());
+        for (size_t i = 0; i < jobs.size(); i++) {
+            const Job& job = jobs[i];
+            const Result& result = results[i];
+
+            printf("%s\n    {\"job\": %zu, \"rom\": \"%s\", \"seed\": %" PRIu64 ", \"log\": \"%s\", ", i == 0 ? "" : ",", i, jsonEscape(job.rom).c_str(), job.seed, jsonEscape(job.log).c_str());
+            if (!result.error.empty()) {
+                printf("\"error\": \"%s\"}", jsonEscape(result.error).c_str());
+                continue;
+            }
+            printf("\"frames\": %" PRIu64 ", \"instructions\": %" PRIu64 ", \"seconds\": %.6f, \"state\": \"%.16" PRIX64 "\"",
+                result.frames, result.instructions, result.seconds, result.hash);
+            if (framebuffer) {
+                printFramebuffer(result);
+            }
+            printf("}");
+        }
+        printf("\n  ]\n}\n");
+    } catch (const std::runtime_error& error) {
+        fprintf(stderr, "%s\n", error.what());
+        return -1;
+    }
+
+    return 0;
+}
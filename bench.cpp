@@ -0,0 +1,297 @@
+// Throughput benchmark for the emulation core. Runs synthetic ROMs that
+// each stress one class of opcodes, plus any real ROMs given on the command
+// line, on every engine (the decode cache with and without fusion), and
+// prints the results as JSON:
+//
+//   bench [--frames n] [--hz n] [--repeat n] [rom[:log] ...]
+//
+// A real ROM runs with no keys pressed for --frames frames, or, given an
+// input log (see inputlog.h), replays it at the speed it was recorded with.
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "scheduler.h"
+#include "inputlog.h"
+#include "json.h"
+
+// every allocation made while a workload runs is counted, the core is meant
+// to make none once it is warmed up
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size != 0 ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t size) noexcept {
+    free(p);
+}
+
+// presses key 5 every fourth frame, so Fx0A waits spin for three frames
+class PulseInput : public InputSource {
+    private:
+        uint64_t frame = 0;
+
+    public:
+        bool poll(uint8_t keys[16]) override {
+            keys[5] = (frame++ % 4 == 3);
+            return true;
+        }
+};
+
+struct Workload {
+    std::string name;
+    std::vector<uint8_t> rom;
+    // input log for real ROMs, empty for none
+    std::string log;
+    // synthetic: key presses for Fx0A
+    bool pulse = false;
+    // synthetic: off where the idle loop is what is measured
+    bool idleSkipping = true;
+};
+
+struct Result {
+    uint64_t frames;
+    uint64_t instructions;
+    double seconds;
+    uint64_t allocations;
+    uint64_t hash;
+    uint64_t fusions[FUSIONS];
+};
+
+// an engine to measure; the decode cache runs with and without fusion
+struct Config {
+    const char* name;
+    Engine engine;
+    bool fusion;
+};
+
+static std::vector<uint8_t> assemble(const std::vector<uint16_t>& opcodes) {
+    std::vector<uint8_t> rom;
+    for (uint16_t opcode: opcodes) {
+        rom.push_back(opcode >> 8);
+        rom.push_back(opcode & 0xFF);
+    }
+    return rom;
+}
+
+// 8xyN chains between register pairs, looping forever
+static Workload aluWorkload() {
+    std::vector<uint16_t> code = { 0x6001, 0x6103, 0x6207, 0x630F };
+    for (int i = 0; i < 16; i++) {
+        code.insert(code.end(), { 0x8014, 0x8125, 0x8231, 0x8302, 0x8013, 0x8106, 0x820E, 0x8317, 0x7001 });
+    }
+    code.push_back(0x1208);
+    return Workload{ "alu", assemble(code) };
+}
+
+// font sprites drawn all over the screen, wrapping and colliding
+static Workload drawWorkload() {
+    std::vector<uint16_t> code = { 0x6000, 0x6100 };
+    for (int i = 0; i < 16; i++) {
+        code.insert(code.end(), { (uint16_t) (0x6200 | i), 0xF229, 0xD015, 0x7005, 0x7103 });
+    }
+    code.push_back(0x1204);
+    return Workload{ "draw", assemble(code) };
+}
+
+// Fx55/Fx65 block copies over a data area away from the code
+static Workload memoryWorkload() {
+    std::vector<uint16_t> code;
+    for (int i = 0; i < 8; i++) {
+        code.insert(code.end(), { (uint16_t) (0xA800 + i * 0x20), 0xFF65, 0x7F01, (uint16_t) (0xA900 + i * 0x20), 0xFF55 });
+    }
+    code.push_back(0x1200);
+    return Workload{ "memory", assemble(code) };
+}
+
+// 2nnn/00EE nested 15 deep, every level adds to V0 on the way back
+static Workload callWorkload() {
+    std::vector<uint16_t> code = { 0x2300, 0x1200 };
+    code.resize((0x300 - 0x200) / 2, 0x0000);
+    for (int depth = 0; depth < 15; depth++) {
+        uint16_t next = 0x300 + (depth + 1) * 6;
+        code.insert(code.end(), { (uint16_t) (0x2000 | next), 0x7001, 0x00EE });
+    }
+    code.insert(code.end(), { 0x7101, 0x00EE });
+    return Workload{ "call", assemble(code) };
+}
+
+// the sequences the decode cache fuses: 6xkk runs, Annn Dxyn, counters, and
+// every 256th pass a delay timer poll; skipped, the poll would be gone
+static Workload fusedWorkload() {
+    std::vector<uint16_t> code = {
+        0x6000, 0x6100, 0x6205,
+        0xA000, 0xD015, 0x7001, 0x3020, 0x1206,
+        0x7101, 0x6000, 0x6300, 0x3100, 0x1206,
+        0x6401, 0xF415, 0xF407, 0x3400, 0x121E, 0x1206
+    };
+    Workload workload = { "fused", assemble(code) };
+    workload.idleSkipping = false;
+    return workload;
+}
+
+// Fx0A spinning until the next pulse of key 5; skipped, the wait would cost
+// next to nothing and the workload would measure skipIdle instead
+static Workload keyWaitWorkload() {
+    Workload workload = { "keywait", assemble({ 0xF00A, 0x7101, 0x1200 }) };
+    workload.pulse = true;
+    workload.idleSkipping = false;
+    return workload;
+}
+
+static std::vector<uint8_t> readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("ROM OPEN FAILED: " + path);
+    }
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+static Result runWorkload(Cpu& cpu, const Workload& workload, const Config& config, uint32_t hz, uint64_t frames) {
+    cpu.init();
+    cpu.loadProgram(workload.rom.data(), workload.rom.size());
+    cpu.engine = config.engine;
+    cpu.setFusion(config.fusion);
+    cpu.idleSkipping = workload.idleSkipping;
+    cpu.seed(1);
+
+    NullInputSource none;
+    PulseInput pulse;
+    InputReplay replay;
+    InputSource* input = workload.pulse ? (InputSource*) &pulse : &none;
+    if (!workload.log.empty()) {
+        replay.open(workload.log.c_str());
+        cpu.seed(replay.seed);
+        cpu.setProfile(replay.profile);
+        hz = replay.hz;
+        frames = UINT64_MAX;
+        input = &replay;
+    }
+
+    Scheduler scheduler(cpu, hz);
+
+    uint64_t allocated = allocations;
+    Clock::time_point start = Clock::now();
+
+    bool keepOpen = true;
+    while (keepOpen && scheduler.frames < frames) {
+        keepOpen = input->poll(cpu.keys);
+        scheduler.runFrame(Clock::time_point::max());
+        cpu.dirtyRows = 0;
+    }
+
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    Result result = { scheduler.frames, scheduler.instructions, elapsed.count(), allocations - allocated, cpu.hash(), {} };
+    memcpy(result.fusions, cpu.fusionCounts, sizeof(result.fusions));
+
+    cpu.deinit();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t frames = 600;
+    uint32_t hz = 1000000;
+    int repeat = 3;
+
+    std::vector<Workload> workloads = {
+        aluWorkload(), drawWorkload(), memoryWorkload(), callWorkload(), fusedWorkload(), keyWaitWorkload()
+    };
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+                frames = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+                hz = std::stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+                repeat = std::stoi(argv[++i]);
+            } else {
+                std::string arg = argv[i];
+                size_t colon = arg.find(':');
+                Workload workload;
+                workload.name = arg.substr(0, colon);
+                workload.rom = readFile(workload.name);
+                if (colon != std::string::npos) {
+                    workload.log = arg.substr(colon + 1);
+                }
+                workloads.push_back(workload);
+            }
+        }
+
+        if (hz == 0) {
+            throw std::runtime_error("BENCHMARKS NEED A FIXED SPEED.");
+        }
+
+        static Cpu cpu;
+        const Config configs[] = {
+            { "interpreter", Engine::Interpreter, false },
+            { "cache-unfused", Engine::DecodeCache, false },
+            { "cache", Engine::DecodeCache, true },
+            { "jit", Engine::Jit, false }
+        };
+
+        printf("{\n  \"hz\": %" PRIu32 ",\n  \"frames\": %" PRIu64 ",\n  \"repeat\": %d,\n  \"results\": [", hz, frames, repeat);
+
+        bool firstResult = true;
+        for (const Workload& workload: workloads) {
+            uint64_t reference = 0;
+            for (const Config& config: configs) {
+                // best of the repetitions, the others were disturbed
+                Result best = runWorkload(cpu, workload, config, hz, frames);
+                for (int r = 1; r < repeat; r++) {
+                    Result result = runWorkload(cpu, workload, config, hz, frames);
+                    if (result.seconds < best.seconds) {
+                        best = result;
+                    }
+                }
+                if (config.engine == Engine::Interpreter) {
+                    reference = best.hash;
+                }
+
+                printf("%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", ", firstResult ? "" : ",", jsonEscape(workload.name).c_str(), config.name);
+                printf("\"frames\": %" PRIu64 ", \"instructions\": %" PRIu64 ", \"seconds\": %.6f, ", best.frames, best.instructions, best.seconds);
+                printf("\"instructions_per_second\": %.0f, \"frames_per_second\": %.1f, \"ns_per_instruction\": %.3f, ",
+                    best.instructions / best.seconds, best.frames / best.seconds, best.seconds * 1e9 / best.instructions);
+                printf("\"allocations\": %" PRIu64 ", \"state\": \"%.16" PRIX64 "\", \"matches_interpreter\": %s",
+                    best.allocations, best.hash, best.hash == reference ? "true" : "false");
+                if (config.fusion) {
+                    printf(", \"fusions\": {");
+                    for (int f = 0; f < FUSIONS; f++) {
+                        printf("%s\"%s\": %" PRIu64, f == 0 ? "" : ", ", fusionName((Fusion) f), best.fusions[f]);
+                    }
+                    printf("}");
+                }
+                printf("}");
+                firstResult = false;
+            }
+        }
+
+        printf("\n  ]\n}\n");
+    } catch (const std::runtime_error& error) {
+        fprintf(stderr, "%s\n", error.what());
+        return -1;
+    }
+
+    return 0;
+}
@@ -1,32 +1,48 @@
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
 #include "cpu.h"
+#include "ops.h"
+#include "jit.h"
+#include "trace.h"
+#include "profiler.h"
+#include "hash.h"
+
+static NullAudioSink nullAudio;
+
+bool parseEngine(const char* name, Engine& engine) {
+    if (strcmp(name, "interpreter") == 0) {
+        engine = Engine::Interpreter;
+    } else if (strcmp(name, "cache") == 0) {
+        engine = Engine::DecodeCache;
+    } else if (strcmp(name, "jit") == 0) {
+        engine = Engine::Jit;
+    } else {
+        return false;
+    }
+    return true;
+}
 
-void Cpu::init(bool print) {
-    srand((uint32_t) time(0));
+void Cpu::init(AudioSink* audioSink) {
+    // the whole state, padding included, so equal machines are equal bytes
+    memset(static_cast<MachineState*>(this), 0, sizeof(MachineState));
 
     // start of program memory 0x000 to 0x1FF reserved for interpreter mem
     programCounter = 0x200;
 
     opcode = 0;
-    index = 0;
-    stackPointer = 0;
-    delayTimer = 0;
-    soundTimer = 0;
+    idle = false;
+    memset(fusionCounts, 0, sizeof(fusionCounts));
+    // the blank screen still has to be shown once
+    dirtyRows = ~(uint64_t) 0;
 
-    for (uint8_t x: memory) {
-        x = 0;
-    }
-    for (uint8_t x: graphics) {
-        x = 0;
-    }
-    for (uint8_t x: registers) {
-        x = 0;
-    }
-    for (uint8_t x: stack) {
-        x = 0;
-    }
-    for (uint8_t x: keys) {
-        x = 0;
-    }
+    // SUPER-CHIP programs switch to hires themselves, drawing starts on plane 1
+    planes = 1;
+
+    // runs only repeat when the host seeds explicitly
+    seed((uint64_t) time(0));
 
     uint8_t i = 0;
     for (uint8_t c: fontset) {
@@ -34,265 +50,171 @@ void Cpu::init(bool print) {
         i++;
     }
 
-    printInfo = print;
+    engine = Engine::Interpreter;
+    profile = Profile::Default;
+    invalidateAll();
 
     audioPlaying = false;
-    SDL_Init(SDL_INIT_AUDIO);
-    audio.open();
-    audio.setVol(0.25);
-    audio.setFreq(392.00);
+    audio = (audioSink != nullptr) ? audioSink : &nullAudio;
 }
 
-void Cpu::deinit() {
-    audio.close();
+void Cpu::seed(uint64_t value) {
+    // splitmix64 finalizer: nearby seeds give unrelated streams
+    value += 0x9E3779B97F4A7C15ull;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+    value ^= value >> 31;
+    // xorshift never leaves 0
+    rng = (value != 0) ? value : 1;
 }
 
-void Cpu::incrementProgramCounter() {
-    // incrementing by 2 cause every instruction is 2 bytes
-    programCounter += 2;
+void Cpu::loadProgram(const uint8_t* program, size_t size) {
+    if (size > MAX_PROGRAM) {
+        throw std::runtime_error("ROM TOO LARGE.");
+    }
+    memcpy(memory + 0x200, program, size);
+    invalidate(0x200, size);
 }
 
-void Cpu::cycle() {
-    // read whole instruction from memory
-    opcode = (memory[programCounter] << 8) | memory[programCounter+1];
+void Cpu::deinit() {
+    if (audioPlaying) {
+        audioPlaying = false;
+        audio->stop(ticks);
+    }
 
-    // get first nibble X000
-    uint first = opcode >> 12;
-
-    uint16_t sum;
-    uint8_t Vx;
-    uint8_t Vy;
-    uint8_t kk; 
-    uint8_t height;
-    uint8_t regX;
-    uint8_t regY;
-    uint8_t mode;
-    uint8_t pixel;
+    delete jit;
+    jit = nullptr;
+}
+
+void Cpu::saveState(MachineState& state) const {
+    memcpy(&state, static_cast<const MachineState*>(this), sizeof(MachineState));
+}
 
-    if (printInfo) {
-        printf("pc: %.4X opcode: %.4X sp: %.2X regs: ", programCounter, opcode, stackPointer);
-        for (int i = 0; i < 15; i++) {
-            printf("%.2X ", registers[i]);
+void Cpu::loadState(const MachineState& state) {
+    // re-decode only the bytes that differ, a rewind step usually touches a
+    // handful of them and keeps every compiled block elsewhere
+    int address = 0;
+    while (address < 4096) {
+        if (memory[address] == state.memory[address]) {
+            address++;
+            continue;
+        }
+        int first = address;
+        while (address < 4096 && memory[address] != state.memory[address]) {
+            address++;
         }
-        printf("keys: ");
-        for (int i = 0; i < 15; i++) {
-            printf("%.2X ", keys[i]);
+        invalidate(first, address - first);
+    }
+
+    if (hires != state.hires) {
+        dirtyRows = ~(uint64_t) 0;
+    }
+    for (int y = 0; y < MAX_HEIGHT; y++) {
+        for (int plane = 0; plane < PLANES; plane++) {
+            if (memcmp(graphics[plane][y], state.graphics[plane][y], sizeof(graphics[plane][y])) != 0) {
+                dirtyRows |= (uint64_t) 1 << y;
+            }
         }
-        printf("delay: %X sound: %X", delayTimer, soundTimer);
-        printf("\n");
     }
-    
+
+    memcpy(static_cast<MachineState*>(this), &state, sizeof(MachineState));
+}
+
+uint64_t Cpu::hash() const {
+    return fnv1a((const uint8_t*) static_cast<const MachineState*>(this), sizeof(MachineState));
+}
+
+template <typename Quirks>
+void Cpu::interpret() {
+    // read whole instruction from memory
+    opcode = (memory[programCounter & 0xFFF] << 8) | memory[(programCounter + 1) & 0xFFF];
+
+    // get first nibble X000
+    unsigned first = opcode >> 12;
+
+    uint8_t Vx = (opcode & 0x0F00) >> 8;
+    uint8_t Vy = (opcode & 0x00F0) >> 4;
+    uint8_t kk = opcode & 0x00FF;
+    uint16_t nnn = opcode & 0x0FFF;
+    uint8_t mode;
 
     switch(first) {
         case 0x0:
-            if (opcode == 0x00E0) { // 00E0 - CLS; clear screen
-                for(uint8_t g: graphics) {
-                    g = 0;
-                }
-            } else if(opcode == 0x00EE) { // 00EE - RET; return from subrutine
-                stackPointer--;
-                programCounter = stack[stackPointer];
-            } //else { } // 0nnn - SYS addr; system instruction, should be ignored
-            incrementProgramCounter();
-            break;
-        case 0x1: // 1nnn - JP addr; Jump to location nnn
-            programCounter = opcode & 0x0FFF;
-            break;
-        case 0x2: // 2nnn - CALL addr; Call subroutine at nnn
-            stack[stackPointer] = programCounter;
-            stackPointer++;
-            programCounter = opcode & 0x0FFF;
-            break;
-        case 0x3: // 3xkk - SE Vx, byte; Skip next instruction if Vx == kkk
-            Vx = (opcode & 0x0F00) >> 8;
-            if (registers[Vx] == (opcode & 0x00FF)) {
-                incrementProgramCounter();
-            }
-            incrementProgramCounter();
-            break;
-        case 0x4: // 4xkk - SNE Vx, byte; Skip next intruction if Vx != kk
-            Vx = (opcode & 0x0F00) >> 8;
-            if (registers[Vx] != (opcode & 0x00FF)) {
-                incrementProgramCounter();
-            }
-            incrementProgramCounter();
-            break;
-        case 0x5: // 5xy0 - SE Vx, Vy; Skip next instruction if Vx == Vy
-            Vx = (opcode & 0x0F00) >> 8;
-            Vy = (opcode & 0x00F0) >> 4;
-            if (registers[Vx] == registers[Vy]) {
+            if (opcode == 0x00E0) {
+                clearScreen();
+            } else if(opcode == 0x00EE) {
+                returnFromSubroutine();
+            } else if ((opcode & 0xFFF0) == 0x00C0) {
+                scrollDown(opcode & 0x000F);
+            } else if ((opcode & 0xFFF0) == 0x00D0) {
+                scrollUp(opcode & 0x000F);
+            } else if (opcode == 0x00FB) {
+                scrollRight();
+            } else if (opcode == 0x00FC) {
+                scrollLeft();
+            } else if (opcode == 0x00FE) {
+                lowRes();
+            } else if (opcode == 0x00FF) {
+                highRes();
+            } else { // 0nnn - SYS addr; system instruction, should be ignored
                 incrementProgramCounter();
             }
-            incrementProgramCounter();
-            break;
-        case 0x6: // 6xkk - LD Vx, byte; Set Vx = kk
-            Vx = (opcode & 0x0F00) >> 8;
-            registers[Vx] = (opcode & 0x00FF);
-            incrementProgramCounter();
-            break;
-        case 0x7: // 7xkk - ADD Vx, byte; Set Vx = Vx + kk
-            Vx = (opcode & 0x0F00) >> 8;
-            registers[Vx] += opcode & 0x00FF;
-            incrementProgramCounter();
             break;
+        case 0x1: jump(nnn); break;
+        case 0x2: call(nnn); break;
+        case 0x3: skipIfEqual(Vx, kk); break;
+        case 0x4: skipIfNotEqual(Vx, kk); break;
+        case 0x5: skipIfRegistersEqual(Vx, Vy); break;
+        case 0x6: loadByte(Vx, kk); break;
+        case 0x7: addByte(Vx, kk); break;
         case 0x8: // ALU instructions
-            Vx = (opcode & 0x0F00) >> 8;
-            Vy = (opcode & 0x00F0) >> 4;
             //get last nibble to check the mode of operation
             mode = opcode & 0x000F;
             switch(mode) {
-                case 0x0: // 8xy0 - LD Vx, Vy; Set Vx = Vy
-                    registers[Vx] = registers[Vy];
-                    break;
-                case 0x1: // 8xy1 - OR Vx, Vy; Set Vx = Vx | Vy
-                    registers[Vx] |= registers[Vy];
-                    break;
-                case 0x2: // 8xy2 - AND Vx, Vy; Set Vx = Vx & Vy
-                    registers[Vx] &= registers[Vy];
-                    break;
-                case 0x3: // 8xy3 - XOR Vx, Vy; Set Vx = Vx ^ Vy
-                    registers[Vx] ^= registers[Vy];
-                    break;
-                case 0x4: // 8xy4 - ADD Vx, Vy; Set Vx = Vx + Vy, Set Vf = carry
-                    // type promotion to catch overflows
-                    sum = registers[Vx];
-                    sum += registers[Vy];
-
-                    registers[0xF] = (sum > 255) ? 1 : 0;
-                    registers[Vx] = sum & 0x00FF;
-                    break;
-                case 0x5: // 8xy5 - SUB Vx, Vy; Set Vx = Vx - Vy, set VF = NOT borrow
-                    registers[0xF] = (registers[Vx] > registers[Vy]) ? 1 : 0;
-                    registers[Vx] -= registers[Vy];
-                    break;
-                case 0x6: // 8xy6 - SHR Vx {, Vy}; Set Vx = Vx SHR 1
-                    registers[0xF] = registers[Vx] & 1;
-                    registers[Vx] >>= 1;
-                    break;
-                case 0x7: // 8xy7 - SUBN Vx, Vy; Set Vx = Vy - Vx, set VF = NOT borrow
-                    registers[0xF] = (registers[Vy] > registers[Vx]) ? 1 : 0;
-                    registers[Vx] = registers[Vy] - registers[Vx];
-                    break;
-                case 0xE: // 8xyE - SHL Vx {, Vy}; Set Vx = Vx SHL 1
-                    registers[0xF] = ((registers[Vx] & 0x80) != 0) ? 1 : 0;
-                    registers[Vx] <<= 1;
-            }
-            incrementProgramCounter();
-            break;
-        case 0x9: // 9xy0 - SE Vx, Vy; Skip next instruction if Vx != Vy
-            Vx = (opcode & 0x0F00) >> 8;
-            Vy = (opcode & 0x00F0) >> 4;
-            if ((uint8_t) registers[Vx] != (uint8_t) registers[Vy]) {
-                printf("%X, %X, Equal.\n", registers[Vx], registers[Vy]);
-                incrementProgramCounter();
-            } else {
-                printf("%X, %X, Not equal.\n", registers[Vx], registers[Vy]);
-            }
-            incrementProgramCounter();
-            break;
-        case 0xA: // Annn - LD I, addr; Set I = nnn
-            index = opcode & 0x0FFF;
-            incrementProgramCounter();
-            break;
-        case 0xB: // Bnnn - JP V0, addr; Jump to nnn + V0
-            programCounter = (opcode & 0x0FFF) + (uint16_t) registers[0x0];
-            break;
-        case 0xC: // Cxkk - RND Vx, byte; Set Vx = random byte & kk
-            Vx = (opcode & 0x0F00) >> 8;
-            kk = opcode & 0x00FF;
-
-            registers[Vx] = rand() & kk;
-            incrementProgramCounter();
-            break;
-        case 0xD: // Dxyn - DRW Vx, Vy, nibble; Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
-            registers[0xF] = 0;
-            regX = registers[(opcode & 0x0F00) >> 8];
-            regY = registers[(opcode & 0x00F0) >> 4];
-            height = opcode & 0x000F;
-
-            for (int i = 0; i < height; i++) {
-                pixel = memory[index + i];
-
-                for (int j = 0; j < 8; j++) {
-                        const uint8_t msb = 0x80;
-                        if ((pixel & (msb >> j)) != 0) {
-                            uint8_t tx = (regX + j) % 64;
-                            uint8_t ty = (regY + i) % 32;
-
-                            uint16_t idx = tx + ty * 64;
-
-                            graphics[idx] ^= 1;
-
-                            if (graphics[idx] == 0) {
-                                registers[0xF] = 1;
-                            }
-                        }
-                }
+                case 0x0: loadRegister(Vx, Vy); break;
+                case 0x1: orRegister(Vx, Vy); break;
+                case 0x2: andRegister(Vx, Vy); break;
+                case 0x3: xorRegister(Vx, Vy); break;
+                case 0x4: addRegister(Vx, Vy); break;
+                case 0x5: subRegister(Vx, Vy); break;
+                case 0x6: shiftRight<Quirks>(Vx, Vy); break;
+                case 0x7: subnRegister(Vx, Vy); break;
+                case 0xE: shiftLeft<Quirks>(Vx, Vy); break;
+                default: incrementProgramCounter();
             }
-            incrementProgramCounter();
             break;
+        case 0x9: skipIfRegistersNotEqual(Vx, Vy); break;
+        case 0xA: loadIndex(nnn); break;
+        case 0xB: jumpOffset<Quirks>(nnn); break;
+        case 0xC: random(Vx, kk); break;
+        case 0xD: draw<Quirks>(Vx, Vy, opcode & 0x000F); break;
         case 0xE:
-            Vx = (opcode & 0x0F00) >> 8;
-            mode = opcode & 0x00FF;
-
-            if(mode == 0x9E) { // Ex9E - SKP Vx; Skip next instruction if key with the value of Vx is pressed
-                if(keys[registers[Vx]] == 1) {
-                    incrementProgramCounter();
-                }
-            } else if (mode == 0xA1) { // ExA1 - SKNP Vx; Skip next instruction if key with the value of Vx is not pressed
-                if(keys[registers[Vx]] != 1) {
-                    incrementProgramCounter();
-                }
+            if(kk == 0x9E) {
+                skipIfKey(Vx);
+            } else if (kk == 0xA1) {
+                skipIfNotKey(Vx);
+            } else {
+                incrementProgramCounter();
             }
-            incrementProgramCounter();
             break;
         case 0xF:
-            Vx = (opcode & 0x0F00) >> 8;
-            mode = opcode & 0x00FF;
-            if (mode == 0x07) { // Fx07 - LD Vx, DT; Set Vx = delay timer value
-                registers[Vx] = delayTimer;
-            } else if (mode == 0x0A) { // Fx0A - LD Vx, K; Wait for a key press, store the value of the key in Vx
-                bool keyPressed = false;
-                
-                uint8_t i = 0;
-                for (uint8_t key: keys) {
-                    if(key != 0) {
-                        registers[Vx] = i;
-                        keyPressed = true;
-                        break;
-                    }
-                    i++;
-                }
-
-                if (!keyPressed) {
-                    return;
-                }
-                incrementProgramCounter();
-                break;
-            } else if (mode == 0x15) { // Fx15 - LD DT, Vx; Set delay timer = Vx
-                delayTimer = registers[Vx];
-            } else if (mode == 0x18) { // Fx18 - LD ST, Vx; Set sound timer = Vx
-                soundTimer = registers[Vx];
-            } else if (mode == 0x1E) { // Fx1E - ADD I, Vx; Set I = I + Vx
-                index += registers[Vx];
-            } else if (mode == 0x29) { // Fx29 - LD F, Vx; Set I = location of sprite for digit Vx
-                index = registers[Vx] * 0x5;
-            } else if (mode == 0x33) { // Fx33 - LD B, Vx; Store BCD representation of Vx in memory locations I, I+1, and I+2
-                memory[index] = registers[Vx] / 100;
-                memory[index+1] = (registers[Vx] / 10) % 10;
-                memory[index+2] = registers[Vx] % 10;
-            } else if (mode == 0x55) { // Fx55 - LD [I], Vx; Store registers V0 through Vx in memory starting at location I
-                for (uint8_t i = 0; i <= Vx; i++) {
-                    memory[index + i] = registers[i];
-                }
-            } else if (mode == 0x65) { // Fx65 - LD Vx, [I]; Read registers V0 through Vx from memory starting at location I
-                for (uint8_t i = 0; i <= Vx; i++) {
-                    registers[i] = memory[index + i];
-                }
+            switch (kk) {
+                case 0x01: selectPlanes(Vx); break;
+                case 0x07: loadDelay(Vx); break;
+                case 0x0A: waitKey(Vx); break;
+                case 0x15: setDelay(Vx); break;
+                case 0x18: setSound(Vx); break;
+                case 0x1E: addIndex(Vx); break;
+                case 0x29: loadFont(Vx); break;
+                case 0x33: storeBcd(Vx); break;
+                case 0x55: storeRegisters<Quirks>(Vx); break;
+                case 0x65: loadRegisters<Quirks>(Vx); break;
+                default: incrementProgramCounter();
             }
-            incrementProgramCounter();
     }
+}
 
+void Cpu::tickTimers() {
     if (delayTimer > 0) {
         delayTimer--;
     }
@@ -300,11 +222,178 @@ void Cpu::cycle() {
     if (soundTimer > 0) {
         if (!audioPlaying) {
             audioPlaying = true;
-            audio.play();
+            audio->play(ticks);
         }
         soundTimer--;
     } else if (audioPlaying) {
         audioPlaying = false;
-        audio.stop();
+        audio->stop(ticks);
+    }
+
+    ticks++;
+}
+
+// Idle loops run the same few instructions over and over without changing
+// anything but the program counter until a timer ticks or a key changes, and
+// neither happens inside a frame. Skipping whole iterations of one leaves the
+// machine exactly as running them would; the rest of the budget runs as usual.
+//
+//   1nnn to itself                      never ends
+//   Fx0A with no key down               never ends within the frame
+//   Fx07; 3xkk or 4xkk; 1nnn back       loops while the delay timer says so
+uint64_t Cpu::skipIdle(uint64_t remaining) {
+    uint16_t pc = programCounter & 0xFFF;
+    uint16_t opcode = (memory[pc] << 8) | memory[(pc + 1) & 0xFFF];
+
+    if (opcode == (0x1000 | programCounter)) {
+        return remaining;
+    }
+
+    if ((opcode & 0xF0FF) == 0xF00A) {
+        for (uint8_t key: keys) {
+            if (key != 0) {
+                return 0;
+            }
+        }
+        return remaining;
+    }
+
+    if ((opcode & 0xF0FF) == 0xF007) {
+        uint8_t x = (opcode >> 8) & 0xF;
+        uint16_t test = (memory[(pc + 2) & 0xFFF] << 8) | memory[(pc + 3) & 0xFFF];
+        uint16_t back = (memory[(pc + 4) & 0xFFF] << 8) | memory[(pc + 5) & 0xFFF];
+        if (back != (0x1000 | programCounter) || ((test >> 8) & 0xF) != x) {
+            return 0;
+        }
+
+        // the test skips over the jump back, leaving the loop
+        uint8_t kk = test & 0xFF;
+        bool loops;
+        if ((test >> 12) == 0x3) {
+            loops = delayTimer != kk;
+        } else if ((test >> 12) == 0x4) {
+            loops = delayTimer == kk;
+        } else {
+            return 0;
+        }
+        if (!loops) {
+            return 0;
+        }
+
+        uint64_t skipped = remaining - remaining % 3;
+        if (skipped != 0) {
+            registers[x] = delayTimer;
+        }
+        return skipped;
+    }
+
+    return 0;
+}
+
+bool Cpu::waitingForKey() const {
+    uint16_t pc = programCounter & 0xFFF;
+    uint16_t opcode = (memory[pc] << 8) | memory[(pc + 1) & 0xFFF];
+    if ((opcode & 0xF0FF) != 0xF00A || delayTimer != 0 || soundTimer != 0) {
+        return false;
+    }
+    for (uint8_t key: keys) {
+        if (key != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Cpu::stepUnfused() {
+    const Instruction& in = decodeCache[programCounter & 0xFFF];
+    if (in.length == 1) {
+        in.handler(*this, in);
+        return;
+    }
+    uint16_t pc = programCounter & 0xFFF;
+    Instruction single = decode((memory[pc] << 8) | memory[(pc + 1) & 0xFFF], profile);
+    single.handler(*this, single);
+}
+
+void Cpu::cycle() {
+    run(1);
+}
+
+uint64_t Cpu::run(uint64_t count) {
+    return withQuirks(profile, [&](auto quirks) {
+        typedef decltype(quirks) Quirks;
+        if (tracer != nullptr && profiler != nullptr) {
+            return runWith<BothHooks<TraceHooks, ProfileHooks>, Quirks>(count);
+        } else if (tracer != nullptr) {
+            return runWith<TraceHooks, Quirks>(count);
+        } else if (profiler != nullptr) {
+            return runWith<ProfileHooks, Quirks>(count);
+        }
+        return runWith<NoHooks, Quirks>(count);
+    });
+}
+
+template <typename Hooks, typename Quirks>
+uint64_t Cpu::runWith(uint64_t count) {
+    if (engine == Engine::Jit && jit == nullptr) {
+        jit = new Jit(*this);
+    }
+
+    // pick the engine once per run so the loops below carry no dispatch on it
+    if (engine == Engine::Jit && jit->available() && !Hooks::stepping) {
+        uint64_t i = 0;
+        while (i < count) {
+            uint32_t executed = jit->execute(count - i);
+            if (executed == 0) {
+                // no block here (or it doesn't fit the budget): single step
+                stepUnfused();
+                executed = 1;
+            }
+            i += executed;
+            if (idle) {
+                idle = false;
+                if (idleSkipping) {
+                    i += skipIdle(count - i);
+                }
+            }
+        }
+    } else if (engine != Engine::Interpreter) {
+        uint64_t i = 0;
+        while (i < count) {
+            const Instruction& in = decodeCache[programCounter & 0xFFF];
+            // read first, the instructions may overwrite the slot
+            uint8_t length = in.length;
+            Hooks::before(*this);
+            if (length == 1) {
+                in.handler(*this, in);
+            } else if (!Hooks::stepping && length <= count - i) {
+                in.handler(*this, in);
+            } else {
+                // a superinstruction that doesn't fit the budget, or that a
+                // stepping policy would see as one instruction
+                stepUnfused();
+                length = 1;
+            }
+            i += length;
+            if (idle) {
+                // a stepping policy has to see every instruction, it never skips
+                idle = false;
+                if (idleSkipping && !Hooks::stepping) {
+                    i += skipIdle(count - i);
+                }
+            }
+        }
+    } else {
+        for (uint64_t i = 0; i < count; i++) {
+            Hooks::before(*this);
+            interpret<Quirks>();
+            if (idle) {
+                idle = false;
+                if (idleSkipping && !Hooks::stepping) {
+                    i += skipIdle(count - i - 1);
+                }
+            }
+        }
     }
-}
\ No newline at end of file
+    return count;
+}
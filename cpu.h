@@ -1,29 +1,120 @@
-#include <cstdlib>
+#pragma once
+
 #include <cinttypes>
-#include <ctime>
-#include <iostream>
+#include <cstddef>
 
-#include "audio.cpp"
+#include "sinks.h"
+#include "quirks.h"
+#include "display.h"
 
-class Cpu {
-private:
-    
-public:
-    uint16_t opcode;
+// programs load at 0x200 and may fill memory from there to the end
+const size_t MAX_PROGRAM = 4096 - 0x200;
+
+// writes to memory are tracked in pages of this many bytes, see
+// Cpu::writtenPages
+const int MEMORY_PAGE = 64;
+const int MEMORY_PAGES = 4096 / MEMORY_PAGE;
+
+class Cpu;
+class Jit;
+class Tracer;
+class Profiler;
+
+// A pre-decoded opcode slot: the handler to run plus its operands, extracted
+// once instead of on every execution.
+struct Instruction {
+    void (*handler)(Cpu& cpu, const Instruction& in);
+    uint16_t nnn;
+    uint8_t x;
+    uint8_t y;
+    uint8_t kk;
+    uint8_t n;
+    // instructions the handler executes: 1, or more for a superinstruction
+    // (see Fusion)
+    uint8_t length;
+};
+
+// Common opcode sequences the decode cache runs as one superinstruction, with
+// the same effect as running them one at a time.
+enum Fusion {
+    FuseLoadDraw,   // Annn Dxyn
+    FuseLoads,      // 6xkk 6xkk ..., up to MAX_FUSED
+    FuseCountLoop,  // 7xkk 3xkk or 4xkk on the same register
+    FuseTimerWait,  // Fx07 3xkk 1nnn
+    FUSIONS
+};
+
+// the longest superinstruction, in instructions
+const int MAX_FUSED = 4;
+
+const char* fusionName(Fusion fusion);
+
+enum class Engine {
+    Interpreter, // decode every opcode through the switch in Cpu::interpret
+    DecodeCache, // run pre-decoded slots from Cpu::decodeCache
+    Jit          // run basic blocks recompiled to x86-64, see jit.h
+};
+
+// "interpreter", "cache" or "jit"; false when the name is none of them
+bool parseEngine(const char* name, Engine& engine);
+
+// Everything that makes up the emulated machine, kept in one plain block so a
+// snapshot is a single memcpy (see Cpu::saveState). Host-side bookkeeping
+// (engines, sinks, dirty rows) stays in Cpu.
+struct MachineState {
     uint8_t memory[4096];
-    uint8_t graphics[64 * 32];
+    // packed bitplanes, see display.h
+    uint64_t graphics[PLANES][MAX_HEIGHT][ROW_WORDS];
+    // 128x64 instead of 64x32
+    uint8_t hires;
+    // bit p set: plane p is drawn, scrolled and cleared (Fn01)
+    uint8_t planes;
     uint8_t registers[16];
     uint16_t index;
 
     uint16_t programCounter;
     uint8_t delayTimer;
     uint8_t soundTimer;
+    // 60 Hz timer ticks since init, the timestamp of beeper changes
+    uint64_t ticks;
 
     uint16_t stack[16];
     uint16_t stackPointer;
 
     uint8_t keys[16];
 
+    // xorshift state behind Cxkk, never 0
+    uint64_t rng;
+};
+
+class Cpu : public MachineState {
+private:
+    template <typename Quirks>
+    void interpret();
+
+    // the run loop for one hook policy (see trace.h) and quirk profile (see
+    // quirks.h), so a loop without tracing carries no trace of it and one
+    // profile never tests another's flags
+    template <typename Hooks, typename Quirks>
+    uint64_t runWith(uint64_t count);
+
+    static void decodeSlot(Cpu& cpu, const Instruction& in);
+    template <typename Quirks>
+    static Instruction decodeWith(uint16_t opcode);
+    // the superinstruction starting with `first` at address, or first
+    template <typename Quirks>
+    static Instruction fuseWith(const Cpu& cpu, uint16_t address, const Instruction& first);
+    
+public:
+    // last opcode fetched by the interpreter
+    uint16_t opcode;
+    // bit y is set whenever row y of the screen, in the current resolution,
+    // changes; the host clears it once it has presented the frame
+    uint64_t dirtyRows;
+    // bit p is set whenever memory page p (bytes p * MEMORY_PAGE on) may have
+    // been written; like dirtyRows, the host clears it when it has looked
+    uint64_t writtenPages;
+
     // from https://multigesture.net/articles/how-to-write-an-emulator-chip-8-interpreter/
     unsigned char fontset[80] = { 
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -44,13 +135,134 @@ public:
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
     };
 
-    bool printInfo;
-
-    Audio audio;
+    AudioSink* audio;
     bool audioPlaying;
-    
-    void init(bool print);
+
+    Engine engine;
+    // change it with setProfile, decoded code depends on it
+    Profile profile;
+    // created on first use of Engine::Jit
+    Jit* jit = nullptr;
+    // every executed instruction is recorded while set, the JIT is then
+    // bypassed for the decode cache
+    Tracer* tracer = nullptr;
+    // counts every executed instruction while set, see profiler.h; the JIT
+    // is bypassed the same way
+    Profiler* profiler = nullptr;
+
+    // set by the instructions that can close an idle loop (a short jump
+    // back, a key wait with no key down); the run loop then checks for one
+    bool idle = false;
+    // whether idle loops are skipped at all; off, they run instruction by
+    // instruction, as benchmarks of the instructions in them need
+    bool idleSkipping = true;
+
+    // one slot per byte address, any of them can be the start of an opcode
+    Instruction decodeCache[4096];
+    // whether the decode cache fuses instruction sequences; change it with
+    // setFusion. The JIT and stepping hook policies never use fused slots
+    bool fusion = true;
+    // superinstructions run since init, by Fusion
+    uint64_t fusionCounts[FUSIONS];
+
+    // audioSink may be null, the beeper is then silently dropped
+    void init(AudioSink* audioSink = nullptr);
     void deinit();
-    void incrementProgramCounter();
+    // restarts the random generator, the same seed and input replay the
+    // same run on any engine
+    void seed(uint64_t value);
+    // copies a program to 0x200, throws when it doesn't fit
+    void loadProgram(const uint8_t* program, size_t size);
+
+    void saveState(MachineState& state) const;
+    // drops the decoded code and marks the rows that differ from the current
+    // machine, so the engines and the host pick the restored state up
+    void loadState(const MachineState& state);
+    // FNV-1a of the machine state, equal runs end on equal hashes
+    uint64_t hash() const;
+
+    int screenWidth() const {
+        return hires ? 128 : 64;
+    }
+    int screenHeight() const {
+        return hires ? 64 : 32;
+    }
+
+    bool frameDirty() const {
+        return dirtyRows != 0;
+    }
+
+    void incrementProgramCounter() {
+        // incrementing by 2 cause every instruction is 2 bytes
+        programCounter += 2;
+    }
+    // cycle and run only execute instructions, the 60 Hz timers are ticked
+    // separately by whoever keeps time (see scheduler.h)
     void cycle();
-};
\ No newline at end of file
+    uint64_t run(uint64_t count);
+    void tickTimers();
+    // skips whole iterations of the idle loop at the program counter, at
+    // most `remaining` instructions, and returns how many; see cpu.cpp
+    uint64_t skipIdle(uint64_t remaining);
+    // waiting on Fx0A with no key down and both timers stopped: nothing
+    // changes until a key is pressed
+    bool waitingForKey() const;
+
+    // must be called after writing to memory from outside the core
+    void invalidate(uint16_t address, uint16_t length);
+    void invalidateAll();
+
+    void setProfile(Profile value);
+    void setFusion(bool value);
+
+    // runs the instruction at the program counter on its own, even where
+    // the decode cache holds a superinstruction
+    void stepUnfused();
+
+    static Instruction decode(uint16_t opcode, Profile profile);
+
+    // instruction semantics, defined in ops.h and shared by every engine
+    void clearScreen();
+    void scrollDown(uint8_t n);
+    void scrollUp(uint8_t n);
+    void scrollRight();
+    void scrollLeft();
+    void lowRes();
+    void highRes();
+    void returnFromSubroutine();
+    void jump(uint16_t nnn);
+    void call(uint16_t nnn);
+    void skipIfEqual(uint8_t x, uint8_t kk);
+    void skipIfNotEqual(uint8_t x, uint8_t kk);
+    void skipIfRegistersEqual(uint8_t x, uint8_t y);
+    void loadByte(uint8_t x, uint8_t kk);
+    void addByte(uint8_t x, uint8_t kk);
+    void loadRegister(uint8_t x, uint8_t y);
+    void orRegister(uint8_t x, uint8_t y);
+    void andRegister(uint8_t x, uint8_t y);
+    void xorRegister(uint8_t x, uint8_t y);
+    void addRegister(uint8_t x, uint8_t y);
+    void subRegister(uint8_t x, uint8_t y);
+    template <typename Quirks> void shiftRight(uint8_t x, uint8_t y);
+    void subnRegister(uint8_t x, uint8_t y);
+    template <typename Quirks> void shiftLeft(uint8_t x, uint8_t y);
+    void skipIfRegistersNotEqual(uint8_t x, uint8_t y);
+    void loadIndex(uint16_t nnn);
+    template <typename Quirks> void jumpOffset(uint16_t nnn);
+    void random(uint8_t x, uint8_t kk);
+    template <typename Quirks> void draw(uint8_t x, uint8_t y, uint8_t n);
+    void skipIfKey(uint8_t x);
+    void skipIfNotKey(uint8_t x);
+    void selectPlanes(uint8_t x);
+    void loadDelay(uint8_t x);
+    void waitKey(uint8_t x);
+    void setDelay(uint8_t x);
+    void setSound(uint8_t x);
+    void addIndex(uint8_t x);
+    void loadFont(uint8_t x);
+    void storeBcd(uint8_t x);
+    template <typename Quirks> void storeRegisters(uint8_t x);
+    template <typename Quirks> void loadRegisters(uint8_t x);
+
+    uint8_t nextRandom();
+};
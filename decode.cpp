@@ -0,0 +1,313 @@
+#include "cpu.h"
+#include "ops.h"
+#include "jit.h"
+
+// Handlers for pre-decoded slots. Each one forwards the operands extracted by
+// Cpu::decode straight into the shared instruction body; the quirk-dependent
+// ones exist once per profile.
+
+static void hSkip(Cpu& cpu, const Instruction& in) { cpu.incrementProgramCounter(); }
+static void hClearScreen(Cpu& cpu, const Instruction& in) { cpu.clearScreen(); }
+static void hReturn(Cpu& cpu, const Instruction& in) { cpu.returnFromSubroutine(); }
+static void hScrollDown(Cpu& cpu, const Instruction& in) { cpu.scrollDown(in.n); }
+static void hScrollUp(Cpu& cpu, const Instruction& in) { cpu.scrollUp(in.n); }
+static void hScrollRight(Cpu& cpu, const Instruction& in) { cpu.scrollRight(); }
+static void hScrollLeft(Cpu& cpu, const Instruction& in) { cpu.scrollLeft(); }
+static void hLowRes(Cpu& cpu, const Instruction& in) { cpu.lowRes(); }
+static void hHighRes(Cpu& cpu, const Instruction& in) { cpu.highRes(); }
+static void hJump(Cpu& cpu, const Instruction& in) { cpu.jump(in.nnn); }
+static void hCall(Cpu& cpu, const Instruction& in) { cpu.call(in.nnn); }
+static void hSkipIfEqual(Cpu& cpu, const Instruction& in) { cpu.skipIfEqual(in.x, in.kk); }
+static void hSkipIfNotEqual(Cpu& cpu, const Instruction& in) { cpu.skipIfNotEqual(in.x, in.kk); }
+static void hSkipIfRegistersEqual(Cpu& cpu, const Instruction& in) { cpu.skipIfRegistersEqual(in.x, in.y); }
+static void hLoadByte(Cpu& cpu, const Instruction& in) { cpu.loadByte(in.x, in.kk); }
+static void hAddByte(Cpu& cpu, const Instruction& in) { cpu.addByte(in.x, in.kk); }
+static void hLoadRegister(Cpu& cpu, const Instruction& in) { cpu.loadRegister(in.x, in.y); }
+static void hOrRegister(Cpu& cpu, const Instruction& in) { cpu.orRegister(in.x, in.y); }
+static void hAndRegister(Cpu& cpu, const Instruction& in) { cpu.andRegister(in.x, in.y); }
+static void hXorRegister(Cpu& cpu, const Instruction& in) { cpu.xorRegister(in.x, in.y); }
+static void hAddRegister(Cpu& cpu, const Instruction& in) { cpu.addRegister(in.x, in.y); }
+static void hSubRegister(Cpu& cpu, const Instruction& in) { cpu.subRegister(in.x, in.y); }
+template <typename Quirks> static void hShiftRight(Cpu& cpu, const Instruction& in) { cpu.shiftRight<Quirks>(in.x, in.y); }
+static void hSubnRegister(Cpu& cpu, const Instruction& in) { cpu.subnRegister(in.x, in.y); }
+template <typename Quirks> static void hShiftLeft(Cpu& cpu, const Instruction& in) { cpu.shiftLeft<Quirks>(in.x, in.y); }
+static void hSkipIfRegistersNotEqual(Cpu& cpu, const Instruction& in) { cpu.skipIfRegistersNotEqual(in.x, in.y); }
+static void hLoadIndex(Cpu& cpu, const Instruction& in) { cpu.loadIndex(in.nnn); }
+template <typename Quirks> static void hJumpOffset(Cpu& cpu, const Instruction& in) { cpu.jumpOffset<Quirks>(in.nnn); }
+static void hRandom(Cpu& cpu, const Instruction& in) { cpu.random(in.x, in.kk); }
+template <typename Quirks> static void hDraw(Cpu& cpu, const Instruction& in) { cpu.draw<Quirks>(in.x, in.y, in.n); }
+static void hSkipIfKey(Cpu& cpu, const Instruction& in) { cpu.skipIfKey(in.x); }
+static void hSkipIfNotKey(Cpu& cpu, const Instruction& in) { cpu.skipIfNotKey(in.x); }
+static void hSelectPlanes(Cpu& cpu, const Instruction& in) { cpu.selectPlanes(in.x); }
+static void hLoadDelay(Cpu& cpu, const Instruction& in) { cpu.loadDelay(in.x); }
+static void hWaitKey(Cpu& cpu, const Instruction& in) { cpu.waitKey(in.x); }
+static void hSetDelay(Cpu& cpu, const Instruction& in) { cpu.setDelay(in.x); }
+static void hSetSound(Cpu& cpu, const Instruction& in) { cpu.setSound(in.x); }
+static void hAddIndex(Cpu& cpu, const Instruction& in) { cpu.addIndex(in.x); }
+static void hLoadFont(Cpu& cpu, const Instruction& in) { cpu.loadFont(in.x); }
+static void hStoreBcd(Cpu& cpu, const Instruction& in) { cpu.storeBcd(in.x); }
+template <typename Quirks> static void hStoreRegisters(Cpu& cpu, const Instruction& in) { cpu.storeRegisters<Quirks>(in.x); }
+template <typename Quirks> static void hLoadRegisters(Cpu& cpu, const Instruction& in) { cpu.loadRegisters<Quirks>(in.x); }
+
+// Superinstructions. Each runs exactly in.length instructions. None of them
+// writes memory itself, and a write to the bytes they were fused from
+// invalidates the slot, so what they read there is what was decoded.
+
+// Annn Dxyn: nnn is the index, x, y and n the sprite
+template <typename Quirks>
+static void hLoadIndexDraw(Cpu& cpu, const Instruction& in) {
+    cpu.fusionCounts[FuseLoadDraw]++;
+    cpu.loadIndex(in.nnn);
+    cpu.draw<Quirks>(in.x, in.y, in.n);
+}
+
+// a run of 6xkk, operands read from the opcodes
+static void hLoadBytes(Cpu& cpu, const Instruction& in) {
+    cpu.fusionCounts[FuseLoads]++;
+    for (uint8_t i = 0; i < in.length; i++) {
+        uint16_t pc = cpu.programCounter & 0xFFF;
+        cpu.loadByte(cpu.memory[pc] & 0x0F, cpu.memory[pc + 1]);
+    }
+}
+
+// 7xkk 3xkk: x and kk add, n is the byte compared with
+static void hAddSkipIfEqual(Cpu& cpu, const Instruction& in) {
+    cpu.fusionCounts[FuseCountLoop]++;
+    cpu.addByte(in.x, in.kk);
+    cpu.skipIfEqual(in.x, in.n);
+}
+
+// 7xkk 4xkk, the same
+static void hAddSkipIfNotEqual(Cpu& cpu, const Instruction& in) {
+    cpu.fusionCounts[FuseCountLoop]++;
+    cpu.addByte(in.x, in.kk);
+    cpu.skipIfNotEqual(in.x, in.n);
+}
+
+// Fx07 3xkk 1nnn: x and kk compare, nnn is the jump. Once the timer reaches
+// kk the skip leaves the loop, and the third instruction is the one after it
+static void hTimerWait(Cpu& cpu, const Instruction& in) {
+    cpu.fusionCounts[FuseTimerWait]++;
+    cpu.loadDelay(in.x);
+    cpu.skipIfEqual(in.x, in.kk);
+    if (cpu.registers[in.x] != in.kk) {
+        cpu.jump(in.nnn);
+    } else {
+        cpu.stepUnfused();
+    }
+}
+
+static const char* const FUSION_NAMES[FUSIONS] = {
+    "load-draw",
+    "loads",
+    "count-loop",
+    "timer-wait"
+};
+
+const char* fusionName(Fusion fusion) {
+    return FUSION_NAMES[fusion];
+}
+
+Instruction Cpu::decode(uint16_t opcode, Profile profile) {
+    return withQuirks(profile, [&](auto quirks) {
+        return decodeWith<decltype(quirks)>(opcode);
+    });
+}
+
+template <typename Quirks>
+Instruction Cpu::decodeWith(uint16_t opcode) {
+    Instruction in;
+    in.handler = hSkip;
+    in.nnn = opcode & 0x0FFF;
+    in.x = (opcode & 0x0F00) >> 8;
+    in.y = (opcode & 0x00F0) >> 4;
+    in.kk = opcode & 0x00FF;
+    in.n = opcode & 0x000F;
+    in.length = 1;
+
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00E0) {
+                in.handler = hClearScreen;
+            } else if (opcode == 0x00EE) {
+                in.handler = hReturn;
+            } else if ((opcode & 0xFFF0) == 0x00C0) {
+                in.handler = hScrollDown;
+            } else if ((opcode & 0xFFF0) == 0x00D0) {
+                in.handler = hScrollUp;
+            } else if (opcode == 0x00FB) {
+                in.handler = hScrollRight;
+            } else if (opcode == 0x00FC) {
+                in.handler = hScrollLeft;
+            } else if (opcode == 0x00FE) {
+                in.handler = hLowRes;
+            } else if (opcode == 0x00FF) {
+                in.handler = hHighRes;
+            }
+            break;
+        case 0x1: in.handler = hJump; break;
+        case 0x2: in.handler = hCall; break;
+        case 0x3: in.handler = hSkipIfEqual; break;
+        case 0x4: in.handler = hSkipIfNotEqual; break;
+        case 0x5: in.handler = hSkipIfRegistersEqual; break;
+        case 0x6: in.handler = hLoadByte; break;
+        case 0x7: in.handler = hAddByte; break;
+        case 0x8:
+            switch (in.n) {
+                case 0x0: in.handler = hLoadRegister; break;
+                case 0x1: in.handler = hOrRegister; break;
+                case 0x2: in.handler = hAndRegister; break;
+                case 0x3: in.handler = hXorRegister; break;
+                case 0x4: in.handler = hAddRegister; break;
+                case 0x5: in.handler = hSubRegister; break;
+                case 0x6: in.handler = hShiftRight<Quirks>; break;
+                case 0x7: in.handler = hSubnRegister; break;
+                case 0xE: in.handler = hShiftLeft<Quirks>; break;
+            }
+            break;
+        case 0x9: in.handler = hSkipIfRegistersNotEqual; break;
+        case 0xA: in.handler = hLoadIndex; break;
+        case 0xB: in.handler = hJumpOffset<Quirks>; break;
+        case 0xC: in.handler = hRandom; break;
+        case 0xD: in.handler = hDraw<Quirks>; break;
+        case 0xE:
+            if (in.kk == 0x9E) {
+                in.handler = hSkipIfKey;
+            } else if (in.kk == 0xA1) {
+                in.handler = hSkipIfNotKey;
+            }
+            break;
+        case 0xF:
+            switch (in.kk) {
+                case 0x01: in.handler = hSelectPlanes; break;
+                case 0x07: in.handler = hLoadDelay; break;
+                case 0x0A: in.handler = hWaitKey; break;
+                case 0x15: in.handler = hSetDelay; break;
+                case 0x18: in.handler = hSetSound; break;
+                case 0x1E: in.handler = hAddIndex; break;
+                case 0x29: in.handler = hLoadFont; break;
+                case 0x33: in.handler = hStoreBcd; break;
+                case 0x55: in.handler = hStoreRegisters<Quirks>; break;
+                case 0x65: in.handler = hLoadRegisters<Quirks>; break;
+            }
+    }
+
+    return in;
+}
+
+template <typename Quirks>
+Instruction Cpu::fuseWith(const Cpu& cpu, uint16_t address, const Instruction& first) {
+    // the opcodes after the first one; a superinstruction never wraps around
+    // the end of memory
+    uint16_t next[MAX_FUSED - 1];
+    int available = 0;
+    while (available < MAX_FUSED - 1 && address + 2 * (available + 2) <= 0x1000) {
+        uint16_t at = address + 2 * (available + 1);
+        next[available] = (cpu.memory[at] << 8) | cpu.memory[at + 1];
+        available++;
+    }
+    if (available == 0) {
+        return first;
+    }
+
+    uint16_t opcode = (cpu.memory[address] << 8) | cpu.memory[address + 1];
+    Instruction in = first;
+
+    switch (opcode >> 12) {
+        case 0x6: {
+            int length = 1;
+            while (length - 1 < available && (next[length - 1] >> 12) == 0x6) {
+                length++;
+            }
+            if (length > 1) {
+                in.handler = hLoadBytes;
+                in.length = length;
+            }
+            break;
+        }
+        case 0x7:
+            if (((next[0] >> 12) == 0x3 || (next[0] >> 12) == 0x4) && ((next[0] >> 8) & 0xF) == first.x) {
+                in.handler = ((next[0] >> 12) == 0x3) ? hAddSkipIfEqual : hAddSkipIfNotEqual;
+                in.n = next[0] & 0xFF;
+                in.length = 2;
+            }
+            break;
+        case 0xA:
+            if ((next[0] >> 12) == 0xD) {
+                in.handler = hLoadIndexDraw<Quirks>;
+                in.x = (next[0] >> 8) & 0xF;
+                in.y = (next[0] >> 4) & 0xF;
+                in.n = next[0] & 0xF;
+                in.length = 2;
+            }
+            break;
+        case 0xF:
+            if (first.kk == 0x07 && available >= 2 && (next[0] & 0xF000) == 0x3000 && ((next[0] >> 8) & 0xF) == first.x && (next[1] >> 12) == 0x1) {
+                in.handler = hTimerWait;
+                in.kk = next[0] & 0xFF;
+                in.nnn = next[1] & 0x0FFF;
+                in.length = 3;
+            }
+            break;
+    }
+    return in;
+}
+
+// Handler of every slot that has not been decoded yet (or was invalidated):
+// decode the opcode at this address, fused with the ones after it where
+// they form a superinstruction, store it, then run the one instruction.
+void Cpu::decodeSlot(Cpu& cpu, const Instruction& in) {
+    uint16_t address = &in - cpu.decodeCache;
+    uint16_t opcode = (cpu.memory[address] << 8) | cpu.memory[(address + 1) & 0xFFF];
+
+    Instruction single = decode(opcode, cpu.profile);
+    Instruction& slot = cpu.decodeCache[address];
+    slot = single;
+    // only the decode cache loop without hooks runs superinstructions
+    if (cpu.fusion && cpu.engine == Engine::DecodeCache && cpu.tracer == nullptr && cpu.profiler == nullptr) {
+        slot = withQuirks(cpu.profile, [&](auto quirks) {
+            return fuseWith<decltype(quirks)>(cpu, address, single);
+        });
+    }
+    single.handler(cpu, single);
+}
+
+void Cpu::invalidate(uint16_t address, uint16_t length) {
+    // a slot decodes the bytes from its address up to MAX_FUSED opcodes on,
+    // so the slots just before the written range are stale too
+    for (int i = -(2 * MAX_FUSED - 1); i < (int) length; i++) {
+        Instruction& slot = decodeCache[(address + i) & 0xFFF];
+        slot.handler = decodeSlot;
+        slot.length = 1;
+    }
+    for (int page = address / MEMORY_PAGE; length > 0 && page <= (address + length - 1) / MEMORY_PAGE; page++) {
+        writtenPages |= (uint64_t) 1 << (page % MEMORY_PAGES);
+    }
+
+    if (jit != nullptr) {
+        jit->invalidate(address, length);
+    }
+}
+
+void Cpu::invalidateAll() {
+    for (Instruction& slot: decodeCache) {
+        slot.handler = decodeSlot;
+        slot.length = 1;
+    }
+    writtenPages = ~(uint64_t) 0;
+
+    if (jit != nullptr) {
+        jit->flush();
+    }
+}
+
+void Cpu::setProfile(Profile value) {
+    profile = value;
+    // handlers and compiled blocks were built for the old quirks
+    invalidateAll();
+}
+
+void Cpu::setFusion(bool value) {
+    fusion = value;
+    invalidateAll();
+}
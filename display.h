@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cinttypes>
+
+// The display is stored as bitplanes of packed rows, the most significant bit
+// of a word being the leftmost pixel. A row of the 128x64 hi-res screen is two
+// words (columns 0-63, then 64-127); the 64x32 lo-res screen uses only the
+// first word of the first 32 rows. XO-CHIP draws on up to 4 planes, a pixel's
+// color is the 4-bit number its planes spell.
+
+const int PLANES = 4;
+const int MAX_WIDTH = 128;
+const int MAX_HEIGHT = 64;
+const int ROW_WORDS = 2;
+
+// colors (0xRRGGBB) of the 16 plane combinations: off, the three single
+// planes, then mixes
+const uint32_t PALETTE[16] = {
+    0x000000, 0xFFFFFF, 0xAAAAAA, 0x555555, 0xFF0000, 0x00FF00, 0x0000FF, 0xFFFF00,
+    0x880000, 0x008800, 0x000088, 0x888800, 0xFF00FF, 0x00FFFF, 0x880088, 0x008888
+};
+
+inline uint64_t rotateRight(uint64_t value, unsigned shift) {
+    shift &= 63;
+    return (value >> shift) | (value << ((64 - shift) & 63));
+}
+
+// Places a sprite line, left-aligned in `line`, at column x of a 128-pixel
+// row. Pixels past the right edge wrap to the left one, or are dropped when
+// clipping.
+inline void placeWide(uint64_t line, unsigned x, bool clip, uint64_t& left, uint64_t& right) {
+    x &= 127;
+    if (x == 0) {
+        left = line;
+        right = 0;
+    } else if (x < 64) {
+        // a line is at most 16 pixels, it never reaches past column 127 here
+        left = line >> x;
+        right = line << (64 - x);
+    } else if (x == 64) {
+        left = 0;
+        right = line;
+    } else {
+        left = clip ? 0 : line << (128 - x);
+        right = line >> (x - 64);
+    }
+}
+
+// Expands one packed row into 64 pixels of `on`/`off`. Each byte of the row
+// selects an 8-lane mask from a table, so the inner loop is a fixed-width
+// blend the compiler turns into a couple of vector instructions.
+inline void expandRow(uint64_t row, uint32_t* out, uint32_t on, uint32_t off) {
+    struct Masks {
+        uint32_t lanes[256][8];
+        Masks() {
+            for (int b = 0; b < 256; b++) {
+                for (int k = 0; k < 8; k++) {
+                    lanes[b][k] = ((b >> (7 - k)) & 1) ? 0xFFFFFFFF : 0;
+                }
+            }
+        }
+    };
+    static const Masks masks;
+
+    const uint32_t diff = on ^ off;
+    for (int i = 0; i < 8; i++) {
+        const uint32_t* mask = masks.lanes[(row >> (56 - 8 * i)) & 0xFF];
+        for (int k = 0; k < 8; k++) {
+            out[i * 8 + k] = off ^ (diff & mask[k]);
+        }
+    }
+}
+
+// Expands 64 pixels of every plane into palette colors. Each byte of a plane
+// spreads into one bit of eight 4-bit color numbers at once.
+inline void expandPlanes(const uint64_t words[PLANES], uint32_t* out, const uint32_t palette[16]) {
+    struct Spread {
+        uint32_t nibbles[256];
+        Spread() {
+            for (int b = 0; b < 256; b++) {
+                nibbles[b] = 0;
+                for (int k = 0; k < 8; k++) {
+                    nibbles[b] |= (uint32_t) ((b >> (7 - k)) & 1) << (4 * k);
+                }
+            }
+        }
+    };
+    static const Spread spread;
+
+    for (int i = 0; i < 8; i++) {
+        int shift = 56 - 8 * i;
+        uint32_t colors = 0;
+        for (int plane = 0; plane < PLANES; plane++) {
+            colors |= spread.nibbles[(words[plane] >> shift) & 0xFF] << plane;
+        }
+        for (int k = 0; k < 8; k++) {
+            out[i * 8 + k] = palette[(colors >> (4 * k)) & 0xF];
+        }
+    }
+}
@@ -0,0 +1,159 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "env.h"
+
+void Environment::init(const uint8_t* rom, size_t size, size_t n, Profile profile, uint32_t hz, Engine engine, unsigned threads) {
+    if (hz == 0) {
+        // unlimited speed depends on the host clock, steps wouldn't repeat
+        throw std::runtime_error("ENVIRONMENTS NEED A FIXED SPEED.");
+    }
+
+    count = n;
+    cpus.reset(new Cpu[count]());
+    schedulers.clear();
+    schedulers.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        Cpu& cpu = cpus[i];
+        cpu.init();
+        cpu.loadProgram(rom, size);
+        cpu.setProfile(profile);
+        cpu.engine = engine;
+        schedulers.emplace_back(cpu, hz);
+    }
+
+    initial.reset(new MachineState());
+    cpus[0].saveState(*initial);
+
+    ended.assign(count, 0);
+    counters.assign(count * rewards.size(), 0);
+    pool.reset(new WorkPool(threads));
+
+    resetJob = [this](size_t machine, unsigned worker) {
+        if (which == nullptr || which[machine] != 0) {
+            resetOne(machine);
+        }
+    };
+    stepJob = [this](size_t machine, unsigned worker) {
+        stepOne(machine);
+    };
+}
+
+void Environment::deinit() {
+    pool.reset();
+    for (size_t i = 0; i < count; i++) {
+        cpus[i].deinit();
+    }
+    schedulers.clear();
+    cpus.reset();
+    count = 0;
+}
+
+void Environment::setRewards(const Reward* list, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (list[i].bytes != 1 && list[i].bytes != 2) {
+            throw std::runtime_error("REWARD COUNTERS ARE 1 OR 2 BYTES.");
+        }
+    }
+    rewards.assign(list, list + n);
+    counters.assign(count * rewards.size(), 0);
+}
+
+void Environment::setDone(uint16_t address, uint8_t value) {
+    hasDone = true;
+    doneAddress = address;
+    doneValue = value;
+}
+
+uint32_t Environment::counter(const Cpu& cpu, const Reward& reward) const {
+    uint32_t value = cpu.memory[reward.address & 0xFFF];
+    if (reward.bytes == 2) {
+        value = (value << 8) | cpu.memory[(reward.address + 1) & 0xFFF];
+    }
+    return value;
+}
+
+// Writes the screen as one color number per byte, lo-res pixels as 2x2.
+void Environment::observe(size_t machine) {
+    const Cpu& cpu = cpus[machine];
+    uint8_t* out = observations + machine * OBSERVATION_BYTES;
+    const int scale = cpu.hires ? 1 : 2;
+    const int width = cpu.screenWidth();
+
+    for (int y = 0; y < cpu.screenHeight(); y++) {
+        uint8_t* row = out + y * scale * OBSERVATION_WIDTH;
+        for (int x = 0; x < width; x++) {
+            int word = x >> 6;
+            int shift = 63 - (x & 63);
+            uint8_t color = 0;
+            for (int plane = 0; plane < PLANES; plane++) {
+                color |= ((cpu.graphics[plane][y][word] >> shift) & 1) << plane;
+            }
+            for (int i = 0; i < scale; i++) {
+                row[x * scale + i] = color;
+            }
+        }
+        if (scale == 2) {
+            memcpy(row + OBSERVATION_WIDTH, row, OBSERVATION_WIDTH);
+        }
+    }
+}
+
+void Environment::resetOne(size_t machine) {
+    Cpu& cpu = cpus[machine];
+    cpu.loadState(*initial);
+    cpu.seed(seeds[machine]);
+    schedulers[machine].frames = 0;
+    schedulers[machine].instructions = 0;
+    ended[machine] = 0;
+
+    for (size_t r = 0; r < rewards.size(); r++) {
+        counters[machine * rewards.size() + r] = counter(cpu, rewards[r]);
+    }
+    observe(machine);
+}
+
+void Environment::stepOne(size_t machine) {
+    Cpu& cpu = cpus[machine];
+    float reward = 0;
+
+    if (!ended[machine]) {
+        for (int k = 0; k < 16; k++) {
+            cpu.keys[k] = (actions[machine] >> k) & 1;
+        }
+        for (uint32_t frame = 0; frame < framesPerStep; frame++) {
+            schedulers[machine].runFrame(Clock::time_point::max());
+        }
+        cpu.dirtyRows = 0;
+
+        for (size_t r = 0; r < rewards.size(); r++) {
+            uint32_t& before = counters[machine * rewards.size() + r];
+            uint32_t now = counter(cpu, rewards[r]);
+            reward += rewards[r].scale * ((float) now - (float) before);
+            before = now;
+        }
+        if (hasDone && cpu.memory[doneAddress & 0xFFF] == doneValue) {
+            ended[machine] = 1;
+        }
+    }
+
+    stepRewards[machine] = reward;
+    dones[machine] = ended[machine];
+    observe(machine);
+}
+
+void Environment::reset(const uint8_t* whichMachines, const uint64_t* seedList, uint8_t* observationsOut) {
+    which = whichMachines;
+    seeds = seedList;
+    observations = observationsOut;
+    pool->run(count, resetJob);
+}
+
+void Environment::step(const uint16_t* actionList, uint32_t frames, uint8_t* observationsOut, float* rewardsOut, uint8_t* donesOut) {
+    actions = actionList;
+    framesPerStep = frames;
+    observations = observationsOut;
+    stepRewards = rewardsOut;
+    dones = donesOut;
+    pool->run(count, stepJob);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "cpu.h"
+#include "scheduler.h"
+#include "workpool.h"
+
+// Batched environment for training agents: N headless machines running the
+// same ROM, stepped together across a thread pool. Actions, observations,
+// rewards and done flags are caller-owned arrays with one entry per machine;
+// stepping writes straight into them and allocates nothing.
+//
+// An action is the mask of keys held during the step (bit k: key k). An
+// observation is the screen as OBSERVATION_WIDTH x OBSERVATION_HEIGHT bytes,
+// each the pixel's color number (the planes it is set on, see display.h);
+// lo-res screens are doubled to that size. The reward of a step is the change
+// of the configured memory counters, a machine is done once the configured
+// memory byte holds its value.
+class Environment {
+    public:
+        static const int OBSERVATION_WIDTH = MAX_WIDTH;
+        static const int OBSERVATION_HEIGHT = MAX_HEIGHT;
+        static const size_t OBSERVATION_BYTES = OBSERVATION_WIDTH * OBSERVATION_HEIGHT;
+
+        // a score counter: `bytes` (1 or 2, big endian) at `address`, with
+        // rewards of scale per unit it goes up
+        struct Reward {
+            uint16_t address;
+            uint8_t bytes;
+            float scale;
+        };
+
+    private:
+        size_t count = 0;
+        std::unique_ptr<Cpu[]> cpus;
+        std::vector<Scheduler> schedulers;
+        // every machine right after loading, resets restore it
+        std::unique_ptr<MachineState> initial;
+
+        std::vector<Reward> rewards;
+        // counter values at the start of the step, count * rewards.size()
+        std::vector<uint32_t> counters;
+        // per machine: done and not reset since
+        std::vector<uint8_t> ended;
+        bool hasDone = false;
+        uint16_t doneAddress = 0;
+        uint8_t doneValue = 0;
+
+        std::unique_ptr<WorkPool> pool;
+
+        // the arguments of the reset or step in progress, read by the
+        // workers through the two jobs below, built once in init
+        const uint8_t* which;
+        const uint64_t* seeds;
+        const uint16_t* actions;
+        uint32_t framesPerStep;
+        uint8_t* observations;
+        float* stepRewards;
+        uint8_t* dones;
+        std::function<void(size_t, unsigned)> resetJob;
+        std::function<void(size_t, unsigned)> stepJob;
+
+        uint32_t counter(const Cpu& cpu, const Reward& reward) const;
+        void resetOne(size_t machine);
+        void stepOne(size_t machine);
+        void observe(size_t machine);
+
+    public:
+        // count machines running rom; threads 0 is one per hardware thread
+        void init(const uint8_t* rom, size_t size, size_t count, Profile profile, uint32_t hz, Engine engine = Engine::DecodeCache, unsigned threads = 0);
+        void deinit();
+
+        size_t size() const {
+            return count;
+        }
+        const Cpu& machine(size_t machine) const {
+            return cpus[machine];
+        }
+
+        // replace the reward counters and the done condition; they apply
+        // from the next reset
+        void setRewards(const Reward* rewards, size_t n);
+        void setDone(uint16_t address, uint8_t value);
+
+        // restarts the machines whose `which` entry is non-zero (all of them
+        // when which is null) with their seed, and writes their observations
+        void reset(const uint8_t* which, const uint64_t* seeds, uint8_t* observations);
+
+        // holds every machine's action keys for framesPerStep frames, then
+        // writes its observation, reward and done flag. Machines that are done
+        // don't run until they are reset; their reward is 0
+        void step(const uint16_t* actions, uint32_t framesPerStep, uint8_t* observations, float* rewards, uint8_t* dones);
+};
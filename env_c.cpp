@@ -0,0 +1,88 @@
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "env_c.h"
+#include "env.h"
+
+struct e8_env {
+    Environment environment;
+    std::vector<Environment::Reward> rewards;
+    std::string error;
+};
+
+// why the last e8_env_create on this thread failed
+static thread_local std::string createError;
+
+// runs body, turning an exception into -1 and the env's error text
+template <typename Body>
+static int guarded(e8_env* env, Body body) {
+    try {
+        body();
+        return 0;
+    } catch (const std::exception& error) {
+        env->error = error.what();
+        return -1;
+    }
+}
+
+size_t e8_env_observation_size(void) {
+    return Environment::OBSERVATION_BYTES;
+}
+
+e8_env* e8_env_create(const uint8_t* rom, size_t size, size_t count, const char* profile, uint32_t hz, unsigned threads) {
+    Profile quirks;
+    if (profile == nullptr || !parseProfile(profile, quirks)) {
+        createError = std::string("UNKNOWN QUIRKS: ") + (profile != nullptr ? profile : "(null)");
+        return nullptr;
+    }
+    e8_env* env = new e8_env();
+    try {
+        env->environment.init(rom, size, count, quirks, hz, Engine::DecodeCache, threads);
+    } catch (const std::exception& error) {
+        createError = error.what();
+        delete env;
+        return nullptr;
+    }
+    createError.clear();
+    return env;
+}
+
+void e8_env_destroy(e8_env* env) {
+    if (env != nullptr) {
+        env->environment.deinit();
+        delete env;
+    }
+}
+
+const char* e8_env_error(const e8_env* env) {
+    if (env == nullptr) {
+        return createError.c_str();
+    }
+    return env->error.c_str();
+}
+
+int e8_env_add_reward(e8_env* env, uint16_t address, uint8_t bytes, float scale) {
+    return guarded(env, [&] {
+        env->rewards.push_back(Environment::Reward{ address, bytes, scale });
+        env->environment.setRewards(env->rewards.data(), env->rewards.size());
+    });
+}
+
+int e8_env_set_done(e8_env* env, uint16_t address, uint8_t value) {
+    return guarded(env, [&] {
+        env->environment.setDone(address, value);
+    });
+}
+
+int e8_env_reset(e8_env* env, const uint8_t* which, const uint64_t* seeds, uint8_t* observations) {
+    return guarded(env, [&] {
+        env->environment.reset(which, seeds, observations);
+    });
+}
+
+int e8_env_step(e8_env* env, const uint16_t* actions, uint32_t frames, uint8_t* observations, float* rewards, uint8_t* dones) {
+    return guarded(env, [&] {
+        env->environment.step(actions, frames, observations, rewards, dones);
+    });
+}
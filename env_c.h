@@ -0,0 +1,39 @@
+#ifndef EIGHTMULATOR_ENV_C_H
+#define EIGHTMULATOR_ENV_C_H
+
+/* C interface to the batched environment (env.h), for bindings. Functions
+ * that can fail return 0 on success and -1 on failure, with the reason in
+ * e8_env_error. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct e8_env e8_env;
+
+/* bytes of one machine's observation */
+size_t e8_env_observation_size(void);
+
+/* profile is "default", "chip8", "schip" or "xochip"; threads 0 is one per
+ * hardware thread. Returns NULL on failure, with the reason in
+ * e8_env_error(NULL) on the calling thread. */
+e8_env* e8_env_create(const uint8_t* rom, size_t size, size_t count, const char* profile, uint32_t hz, unsigned threads);
+void e8_env_destroy(e8_env* env);
+const char* e8_env_error(const e8_env* env);
+
+int e8_env_add_reward(e8_env* env, uint16_t address, uint8_t bytes, float scale);
+int e8_env_set_done(e8_env* env, uint16_t address, uint8_t value);
+
+/* which may be NULL to reset every machine; observations holds count *
+ * e8_env_observation_size() bytes */
+int e8_env_reset(e8_env* env, const uint8_t* which, const uint64_t* seeds, uint8_t* observations);
+int e8_env_step(e8_env* env, const uint16_t* actions, uint32_t frames, uint8_t* observations, float* rewards, uint8_t* dones);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
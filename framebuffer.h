@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstring>
+#include <functional>
+
+#include "cpu.h"
+#include "display.h"
+#include "inputqueue.h"
+#include "scheduler.h"
+#include "triple_buffer.h"
+
+// A finished frame as the machine thread hands it to the presenting thread.
+struct Frame {
+    uint64_t graphics[PLANES][MAX_HEIGHT][ROW_WORDS];
+    uint8_t hires;
+    // when the newest input the machine had applied was seen, for latency
+    Clock::time_point input;
+};
+
+// Publishes every presented frame through a triple buffer, so the machine
+// never waits on the thread drawing it. notify, when set, is called after
+// each publish, to wake that thread.
+class FrameBufferSink : public VideoSink {
+    private:
+        TripleBuffer<Frame>& frames;
+        const QueuedInputSource* input;
+
+    public:
+        std::function<void()> notify;
+
+        FrameBufferSink(TripleBuffer<Frame>& frames, const QueuedInputSource* input = nullptr) : frames(frames), input(input) {}
+
+        // dirtyRows is not passed on, the reader may skip frames and works
+        // out what changed since the one it showed last
+        void present(const Cpu& cpu, uint64_t dirtyRows) override {
+            Frame& frame = frames.write();
+            memcpy(frame.graphics, cpu.graphics, sizeof(frame.graphics));
+            frame.hires = cpu.hires;
+            frame.input = input ? input->newest : Clock::time_point();
+            frames.publish();
+            if (notify) {
+                notify();
+            }
+        }
+};
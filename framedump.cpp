@@ -0,0 +1,134 @@
+// Prints what a frame log written with --framelog (see framelog.h) holds, or
+// converts it to raw video:
+//
+//   framedump [--from frame] [--to frame] [--scale n] log [out.y4m]
+//
+// The video is YUV4MPEG2 at 60 frames per second, 128x64 pixels times
+// --scale (lo-res pixels are doubled), in the emulator's colors; most video
+// tools read it, e.g. `ffmpeg -i out.y4m out.gif` for an animated image.
+// --from and --to pick the frames [from, to), by default the whole run.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "framelog.h"
+#include "scheduler.h"
+
+// BT.601 studio range, what YUV4MPEG2 readers assume
+static void toYuv(uint32_t rgb, uint8_t yuv[3]) {
+    double r = ((rgb >> 16) & 0xFF) / 255.0;
+    double g = ((rgb >> 8) & 0xFF) / 255.0;
+    double b = (rgb & 0xFF) / 255.0;
+    yuv[0] = (uint8_t) (16 + 65.481 * r + 128.553 * g + 24.966 * b + 0.5);
+    yuv[1] = (uint8_t) (128 - 37.797 * r - 74.203 * g + 112.0 * b + 0.5);
+    yuv[2] = (uint8_t) (128 + 112.0 * r - 93.786 * g - 18.214 * b + 0.5);
+}
+
+// the picture as three planes of width x height bytes
+static void render(const FrameReader& reader, int scale, const uint8_t colors[16][3], std::vector<uint8_t>& out) {
+    const int width = MAX_WIDTH * scale;
+    const int height = MAX_HEIGHT * scale;
+    // screen pixels per output pixel, lo-res pixels are twice as large
+    const int shift = reader.hires ? 0 : 1;
+
+    for (int y = 0; y < height; y++) {
+        int row = (y / scale) >> shift;
+        for (int x = 0; x < width; x++) {
+            int column = (x / scale) >> shift;
+            int color = 0;
+            for (int plane = 0; plane < PLANES; plane++) {
+                uint64_t word = reader.graphics[plane][row][column / 64];
+                color |= ((word >> (63 - column % 64)) & 1) << plane;
+            }
+            for (int c = 0; c < 3; c++) {
+                out[c * width * height + y * width + x] = colors[color][c];
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char* logPath = NULL;
+    const char* outPath = NULL;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+    int scale = 4;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+                from = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+                to = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+                scale = std::stoi(argv[++i]);
+            } else if (logPath == NULL) {
+                logPath = argv[i];
+            } else {
+                outPath = argv[i];
+            }
+        }
+
+        if (logPath == NULL || scale < 1 || scale > 16) {
+            printf("usage: %s [--from frame] [--to frame] [--scale 1-16] log [out.y4m]\n", argv[0]);
+            return -1;
+        }
+
+        FrameReader reader;
+        reader.open(logPath);
+
+        if (outPath == NULL) {
+            double minutes = reader.length() / (60.0 * Scheduler::FRAME_RATE);
+            printf("frames: %" PRIu64 "\nkeyframes: %zu\nbytes: %zu\n", reader.length(), reader.keyframes(), reader.bytes());
+            if (minutes > 0) {
+                printf("bytes per minute: %.0f\n", reader.bytes() / minutes);
+            }
+            return 0;
+        }
+
+        FILE* out = fopen(outPath, "wb");
+        if (out == NULL) {
+            throw std::runtime_error(std::string("VIDEO CREATION FAILED: ") + outPath);
+        }
+
+        uint8_t colors[16][3];
+        for (int c = 0; c < 16; c++) {
+            toYuv(PALETTE[c], colors[c]);
+        }
+        const int width = MAX_WIDTH * scale;
+        const int height = MAX_HEIGHT * scale;
+        std::vector<uint8_t> picture(3 * width * height);
+        fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, Scheduler::FRAME_RATE);
+
+        to = std::min(to, reader.length());
+        reader.seek(from);
+        render(reader, scale, colors, picture);
+        for (uint64_t frame = from; frame < to; frame++) {
+            bool changed = false;
+            while (!reader.done() && reader.due() <= frame) {
+                reader.next();
+                changed = true;
+            }
+            if (changed) {
+                render(reader, scale, colors, picture);
+            }
+            fputs("FRAME\n", out);
+            fwrite(picture.data(), 1, picture.size(), out);
+        }
+
+        if (fclose(out) != 0) {
+            throw std::runtime_error(std::string("VIDEO WRITE FAILED: ") + outPath);
+        }
+        printf("%" PRIu64 " frames written.\n", to > from ? to - from : 0);
+    } catch (const std::runtime_error& error) {
+        fprintf(stderr, "%s\n", error.what());
+        return -1;
+    }
+
+    return 0;
+}
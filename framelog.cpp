@@ -0,0 +1,354 @@
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#include "framelog.h"
+
+static const char MAGIC[4] = { 'E', '8', 'F', 'R' };
+static const char FOOTER_MAGIC[4] = { 'E', '8', 'F', 'X' };
+static const uint8_t VERSION = 1;
+static const size_t HEADER_SIZE = sizeof(MAGIC) + 1;
+static const size_t FOOTER_SIZE = 8 + 4 + sizeof(FOOTER_MAGIC);
+
+static void putInt(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out.push_back((uint8_t) (value >> (i * 8)));
+    }
+}
+
+static void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        out.push_back(value != 0 ? byte | 0x80 : byte);
+    } while (value != 0);
+}
+
+static uint64_t getInt(const uint8_t* data, size_t& pos, size_t end, int bytes) {
+    if (end < pos || end - pos < (size_t) bytes) {
+        throw std::runtime_error("INVALID FRAME LOG.");
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t) data[pos++] << (i * 8);
+    }
+    return value;
+}
+
+static uint64_t getVarint(const uint8_t* data, size_t& pos, size_t end) {
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = (uint8_t) getInt(data, pos, end, 1);
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        shift += 7;
+    } while ((byte & 0x80) != 0 && shift < 64);
+    return value;
+}
+
+// byte i of a row, left to right
+static uint8_t rowByte(const uint64_t row[ROW_WORDS], int i) {
+    return (uint8_t) (row[i / 8] >> (56 - (i % 8) * 8));
+}
+
+FrameRecorder::FrameRecorder(VideoSink& sink) : sink(sink) {}
+
+void FrameRecorder::open(const char* path) {
+    file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("FRAME LOG CREATION FAILED.");
+    }
+    file.write(MAGIC, sizeof(MAGIC));
+    file.put((char) VERSION);
+
+    memset(shown, 0, sizeof(shown));
+    hires = 0;
+    frame = 0;
+    lastTicks = 0;
+    lastKeyframe = 0;
+    started = false;
+    index.clear();
+    // the largest record: a hi-res keyframe with every byte of every plane set
+    record.reserve(32 + PLANES * MAX_HEIGHT * (2 + ROW_WORDS * 8));
+}
+
+// where the next record goes on the log's timeline
+static uint64_t nextFrame(uint64_t frame, uint64_t lastTicks, bool started, uint64_t ticks) {
+    if (!started) {
+        return ticks;
+    }
+    return frame + (ticks >= lastTicks ? ticks - lastTicks : 1);
+}
+
+void FrameRecorder::present(const Cpu& cpu, uint64_t dirtyRows) {
+    if (file.is_open()) {
+        uint64_t at = nextFrame(frame, lastTicks, started, cpu.ticks);
+        bool keyframe = !started || cpu.hires != hires || at - lastKeyframe >= KEYFRAME_INTERVAL;
+        write(cpu, keyframe ? ~(uint64_t) 0 : dirtyRows, keyframe);
+    }
+    sink.present(cpu, dirtyRows);
+}
+
+bool encodeFrame(const uint64_t graphics[PLANES][MAX_HEIGHT][ROW_WORDS], uint8_t hires, uint64_t rows, bool keyframe, uint64_t shown[PLANES][MAX_HEIGHT][ROW_WORDS], std::vector<uint8_t>& out) {
+    int height = hires ? MAX_HEIGHT : MAX_HEIGHT / 2;
+    int words = hires ? ROW_WORDS : 1;
+    if (height < 64) {
+        rows &= ((uint64_t) 1 << height) - 1;
+    }
+    if (keyframe) {
+        memset(shown, 0, PLANES * MAX_HEIGHT * ROW_WORDS * sizeof(uint64_t));
+    }
+
+    // only rows that really changed are stored, a dirty row may be redrawn
+    // with what it had
+    uint64_t stored = 0;
+    uint8_t planes = 0;
+    for (uint64_t marks = rows; marks != 0; marks &= marks - 1) {
+        int y = __builtin_ctzll(marks);
+        for (int plane = 0; plane < PLANES; plane++) {
+            for (int word = 0; word < words; word++) {
+                if (graphics[plane][y][word] != shown[plane][y][word]) {
+                    stored |= (uint64_t) 1 << y;
+                    planes |= 1 << plane;
+                }
+            }
+        }
+    }
+    if (stored == 0 && !keyframe) {
+        return false;
+    }
+
+    out.push_back((hires ? FRAME_HIRES : 0) | (keyframe ? FRAME_KEYFRAME : 0) | (planes << 4));
+    putVarint(out, stored);
+    for (int plane = 0; plane < PLANES; plane++) {
+        if ((planes & (1 << plane)) == 0) {
+            continue;
+        }
+        for (uint64_t marks = stored; marks != 0; marks &= marks - 1) {
+            int y = __builtin_ctzll(marks);
+            uint64_t delta[ROW_WORDS] = {};
+            for (int word = 0; word < words; word++) {
+                delta[word] = graphics[plane][y][word] ^ shown[plane][y][word];
+                shown[plane][y][word] = graphics[plane][y][word];
+            }
+
+            uint16_t changed = 0;
+            for (int i = 0; i < words * 8; i++) {
+                if (rowByte(delta, i) != 0) {
+                    changed |= 1 << i;
+                }
+            }
+            putInt(out, changed, words);
+            for (int i = 0; i < words * 8; i++) {
+                if ((changed & (1 << i)) != 0) {
+                    out.push_back(rowByte(delta, i));
+                }
+            }
+        }
+    }
+    return true;
+}
+
+size_t decodeFrame(const uint8_t* data, size_t size, uint64_t (*graphics)[MAX_HEIGHT][ROW_WORDS], uint8_t& flags) {
+    size_t at = 0;
+    flags = (uint8_t) getInt(data, at, size, 1);
+    uint64_t rows = getVarint(data, at, size);
+    int words = (flags & FRAME_HIRES) ? ROW_WORDS : 1;
+
+    if (graphics != nullptr && (flags & FRAME_KEYFRAME) != 0) {
+        memset(graphics, 0, PLANES * MAX_HEIGHT * ROW_WORDS * sizeof(uint64_t));
+    }
+    for (int plane = 0; plane < PLANES; plane++) {
+        if ((flags & (16 << plane)) == 0) {
+            continue;
+        }
+        for (uint64_t marks = rows; marks != 0; marks &= marks - 1) {
+            int y = __builtin_ctzll(marks);
+            uint16_t changed = (uint16_t) getInt(data, at, size, words);
+            for (int i = 0; i < words * 8; i++) {
+                if ((changed & (1 << i)) == 0) {
+                    continue;
+                }
+                uint8_t byte = (uint8_t) getInt(data, at, size, 1);
+                if (graphics != nullptr) {
+                    graphics[plane][y][i / 8] ^= (uint64_t) byte << (56 - (i % 8) * 8);
+                }
+            }
+        }
+    }
+    return at;
+}
+
+void FrameRecorder::write(const Cpu& cpu, uint64_t rows, bool keyframe) {
+    uint64_t at = nextFrame(frame, lastTicks, started, cpu.ticks);
+
+    record.clear();
+    putVarint(record, at - frame);
+    if (!encodeFrame(cpu.graphics, cpu.hires, rows, keyframe, shown, record)) {
+        return;
+    }
+    if (keyframe) {
+        hires = cpu.hires;
+        index.push_back(Entry{ at, (uint64_t) file.tellp() });
+        lastKeyframe = at;
+    }
+    file.write((const char*) record.data(), record.size());
+
+    frame = at;
+    lastTicks = cpu.ticks;
+    started = true;
+}
+
+void FrameRecorder::close(const Cpu& cpu) {
+    if (!file.is_open()) {
+        return;
+    }
+
+    record.clear();
+    if (started) {
+        // the end: nothing changes, the last frame stays up until here
+        uint64_t at = nextFrame(frame, lastTicks, started, cpu.ticks);
+        putVarint(record, at - frame);
+        record.push_back((hires ? FRAME_HIRES : 0) | FRAME_END);
+        putVarint(record, 0);
+        frame = at;
+    }
+
+    for (const Entry& entry: index) {
+        putInt(record, entry.frame, 8);
+        putInt(record, entry.offset, 8);
+    }
+    putInt(record, frame, 8);
+    putInt(record, index.size(), 4);
+    record.insert(record.end(), FOOTER_MAGIC, FOOTER_MAGIC + sizeof(FOOTER_MAGIC));
+
+    file.write((const char*) record.data(), record.size());
+    file.close();
+}
+
+void FrameReader::open(const char* path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("FRAME LOG OPEN FAILED.");
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    if (data.size() < HEADER_SIZE || memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error("INVALID FRAME LOG.");
+    }
+    if (data[sizeof(MAGIC)] != VERSION) {
+        throw std::runtime_error("UNSUPPORTED FRAME LOG VERSION.");
+    }
+
+    index.clear();
+    last = 0;
+    bool footer = data.size() >= HEADER_SIZE + FOOTER_SIZE &&
+        memcmp(data.data() + data.size() - sizeof(FOOTER_MAGIC), FOOTER_MAGIC, sizeof(FOOTER_MAGIC)) == 0;
+    if (footer) {
+        size_t at = data.size() - FOOTER_SIZE;
+        last = getInt(data.data(), at, data.size(), 8);
+        uint64_t count = getInt(data.data(), at, data.size(), 4);
+        if (count * 16 > data.size() - HEADER_SIZE - FOOTER_SIZE) {
+            throw std::runtime_error("INVALID FRAME LOG.");
+        }
+        end = data.size() - FOOTER_SIZE - count * 16;
+        at = end;
+        for (uint64_t i = 0; i < count; i++) {
+            Entry entry;
+            entry.frame = getInt(data.data(), at, data.size(), 8);
+            entry.offset = getInt(data.data(), at, data.size(), 8);
+            if (entry.offset < HEADER_SIZE || entry.offset >= end) {
+                throw std::runtime_error("INVALID FRAME LOG.");
+            }
+            index.push_back(entry);
+        }
+    } else {
+        // cut short: find the keyframes and the last whole record by reading
+        // through, up to the end record if the run got to write one
+        end = data.size();
+        size_t at = HEADER_SIZE;
+        uint64_t position = 0;
+        while (at < end) {
+            uint64_t delta;
+            uint8_t flags;
+            size_t next;
+            try {
+                next = read(at, false, delta, flags);
+            } catch (const std::runtime_error&) {
+                break;
+            }
+            position += delta;
+            if ((flags & FRAME_KEYFRAME) != 0) {
+                index.push_back(Entry{ position, at });
+            }
+            last = position;
+            at = next;
+            if ((flags & FRAME_END) != 0) {
+                break;
+            }
+        }
+        end = at;
+    }
+
+    seek(0);
+}
+
+size_t FrameReader::read(size_t at, bool draw, uint64_t& delta, uint8_t& flags) {
+    delta = getVarint(data.data(), at, end);
+    at += decodeFrame(data.data() + at, end - at, draw ? graphics : nullptr, flags);
+    if (draw) {
+        hires = flags & FRAME_HIRES;
+    }
+    return at;
+}
+
+void FrameReader::peek() {
+    ended = pos >= end;
+    if (!ended) {
+        size_t at = pos;
+        pending = frame + getVarint(data.data(), at, end);
+    }
+}
+
+bool FrameReader::next() {
+    if (ended) {
+        return false;
+    }
+    uint64_t delta;
+    uint8_t flags;
+    pos = read(pos, true, delta, flags);
+    frame = pending;
+    peek();
+    return true;
+}
+
+void FrameReader::seek(uint64_t target) {
+    // the last keyframe on or before target
+    size_t low = 0;
+    size_t high = index.size();
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (index[middle].frame <= target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low == 0) {
+        memset(graphics, 0, sizeof(graphics));
+        hires = 0;
+        frame = 0;
+        pos = HEADER_SIZE;
+        peek();
+    } else {
+        pos = index[low - 1].offset;
+        pending = index[low - 1].frame;
+        ended = false;
+    }
+
+    while (!ended && pending <= target) {
+        next();
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cinttypes>
+#include <fstream>
+#include <vector>
+
+#include "cpu.h"
+#include "display.h"
+#include "sinks.h"
+
+// A frame delta: what changed on the screen since the frame before, as XOR,
+// only the bytes that changed in the rows that changed. Frame logs and the
+// stream server (streamserver.h) both store frames this way:
+//   flags: bit 0 hires, bit 1 keyframe (against a blank screen), bit 2 the
+//   end of a frame log, bits 4-7 the planes stored
+//   the rows stored (LEB128 mask, rows of the current resolution)
+//   per plane stored, per row stored: which bytes of the row changed (a bit
+//   per byte, left to right; 1 byte lo-res, 2 bytes hi-res), then the XOR of
+//   each of those bytes
+const uint8_t FRAME_HIRES = 1;
+const uint8_t FRAME_KEYFRAME = 2;
+const uint8_t FRAME_END = 4;
+
+// Appends the delta from shown to graphics, looking at the given rows only,
+// and makes shown match. Appends nothing and returns false when none of them
+// changed, unless it is a keyframe.
+bool encodeFrame(const uint64_t graphics[PLANES][MAX_HEIGHT][ROW_WORDS], uint8_t hires, uint64_t rows, bool keyframe, uint64_t shown[PLANES][MAX_HEIGHT][ROW_WORDS], std::vector<uint8_t>& out);
+// Applies the delta at data to graphics (null only reads it) and returns its
+// size; throws when it runs past size.
+size_t decodeFrame(const uint8_t* data, size_t size, uint64_t (*graphics)[MAX_HEIGHT][ROW_WORDS], uint8_t& flags);
+
+// Frame logs store what a run showed, compactly enough to keep for every
+// headless run: a frame delta per presented frame.
+//
+// Layout, little endian:
+//   "E8FR", version byte
+//   records: frames since the previous record (LEB128), by the machine's
+//   timer ticks (1 when a rewind sent them back), then the frame delta
+//   index: per keyframe, its frame and file offset (8 bytes each)
+//   footer: the frame of the last record (8 bytes), keyframe count (4
+//   bytes), "E8FX"
+// Keyframes come every KEYFRAME_INTERVAL frames and on every resolution
+// change. The last record stores nothing and marks the end of the run
+// (FRAME_END). The index and footer are written on close; a log without them
+// (the run was killed, or the file cut short) still reads, up to its end
+// record or else its last whole record.
+class FrameRecorder : public VideoSink {
+    private:
+        VideoSink& sink;
+        std::ofstream file;
+
+        // the frame as the log has it so far
+        uint64_t shown[PLANES][MAX_HEIGHT][ROW_WORDS];
+        uint8_t hires = 0;
+
+        uint64_t frame = 0;
+        uint64_t lastTicks = 0;
+        uint64_t lastKeyframe = 0;
+        bool started = false;
+
+        struct Entry {
+            uint64_t frame;
+            uint64_t offset;
+        };
+        std::vector<Entry> index;
+        // the record being built, reused so recording allocates nothing
+        std::vector<uint8_t> record;
+
+        void write(const Cpu& cpu, uint64_t rows, bool keyframe);
+
+    public:
+        static const uint64_t KEYFRAME_INTERVAL = 600;
+
+        // records what is presented to sink, then passes it on
+        FrameRecorder(VideoSink& sink);
+
+        void open(const char* path);
+        // cpu is the machine at the end of the run, the last record marks
+        // how long its last frame stayed on screen
+        void close(const Cpu& cpu);
+
+        void present(const Cpu& cpu, uint64_t dirtyRows) override;
+};
+
+// Plays a frame log back, frame by frame or from any frame on.
+class FrameReader {
+    private:
+        std::vector<uint8_t> data;
+        // where the records end, the index starts
+        size_t end = 0;
+        size_t pos = 0;
+
+        struct Entry {
+            uint64_t frame;
+            uint64_t offset;
+        };
+        std::vector<Entry> index;
+
+        // the frame of the last record
+        uint64_t last = 0;
+        // the frame of the record at pos
+        uint64_t pending = 0;
+        bool ended = true;
+
+        void peek();
+        // reads the record at `at`, onto the picture when draw is set
+        size_t read(size_t at, bool draw, uint64_t& delta, uint8_t& flags);
+
+    public:
+        // the picture, as Cpu::graphics, and the frame it was recorded on
+        uint64_t graphics[PLANES][MAX_HEIGHT][ROW_WORDS];
+        uint8_t hires = 0;
+        uint64_t frame = 0;
+
+        void open(const char* path);
+
+        // the frame the run ended on
+        uint64_t length() const {
+            return last;
+        }
+        size_t keyframes() const {
+            return index.size();
+        }
+        size_t bytes() const {
+            return data.size();
+        }
+
+        // applies the next record; false when there are no more
+        bool next();
+        // the frame the next record is due on
+        uint64_t due() const {
+            return pending;
+        }
+        bool done() const {
+            return ended;
+        }
+        // moves to the picture shown on `target`, decoding from the last
+        // keyframe before it
+        void seek(uint64_t target);
+};
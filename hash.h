@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+
+// 64-bit FNV-1a, for ROM identities and machine state checksums.
+inline uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t value = 0xCBF29CE484222325ull) {
+    for (size_t i = 0; i < size; i++) {
+        value = (value ^ data[i]) * 0x100000001B3ull;
+    }
+    return value;
+}
@@ -0,0 +1,148 @@
+#include <iterator>
+#include <stdexcept>
+
+#include "inputlog.h"
+
+static const char MAGIC[4] = { 'E', '8', 'I', 'N' };
+static const uint8_t VERSION = 2;
+
+static void putInt(std::ofstream& file, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        file.put((char) (value >> (i * 8)));
+    }
+}
+
+static uint64_t getInt(const std::vector<uint8_t>& data, size_t& pos, int bytes) {
+    if (data.size() - pos < (size_t) bytes) {
+        throw std::runtime_error("INVALID INPUT LOG.");
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t) data[pos++] << (i * 8);
+    }
+    return value;
+}
+
+static uint16_t packKeys(const uint8_t keys[16]) {
+    uint16_t mask = 0;
+    for (int i = 0; i < 16; i++) {
+        if (keys[i] != 0) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+InputRecorder::InputRecorder(InputSource& source) : source(source) {}
+
+void InputRecorder::open(const char* path, uint64_t seed, uint32_t hz, Profile profile) {
+    file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("INPUT LOG CREATION FAILED.");
+    }
+
+    file.write(MAGIC, sizeof(MAGIC));
+    file.put((char) VERSION);
+    putInt(file, seed, 8);
+    putInt(file, hz, 4);
+    putInt(file, (uint64_t) profile, 1);
+
+    frame = 0;
+    lastFrame = 0;
+    lastMask = 0;
+}
+
+void InputRecorder::write(uint64_t at, uint16_t mask) {
+    uint64_t delta = at - lastFrame;
+    do {
+        uint8_t byte = delta & 0x7F;
+        delta >>= 7;
+        file.put((char) (delta != 0 ? byte | 0x80 : byte));
+    } while (delta != 0);
+    putInt(file, mask, 2);
+
+    lastFrame = at;
+    lastMask = mask;
+}
+
+void InputRecorder::close() {
+    if (!file.is_open()) {
+        return;
+    }
+    if (frame > 0) {
+        write(frame - 1, lastMask);
+    }
+    file.close();
+}
+
+bool InputRecorder::poll(uint8_t keys[16]) {
+    bool keepOpen = source.poll(keys);
+
+    uint16_t mask = packKeys(keys);
+    if (file.is_open() && mask != lastMask) {
+        write(frame, mask);
+    }
+    frame++;
+
+    return keepOpen;
+}
+
+void InputReplay::open(const char* path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("INPUT LOG OPEN FAILED.");
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t pos = 0;
+    for (char c: MAGIC) {
+        if ((char) getInt(data, pos, 1) != c) {
+            throw std::runtime_error("INVALID INPUT LOG.");
+        }
+    }
+    uint8_t version = (uint8_t) getInt(data, pos, 1);
+    if (version < 1 || version > VERSION) {
+        throw std::runtime_error("UNSUPPORTED INPUT LOG VERSION.");
+    }
+    seed = getInt(data, pos, 8);
+    hz = (uint32_t) getInt(data, pos, 4);
+    profile = Profile::Default;
+    if (version >= 2) {
+        uint8_t value = (uint8_t) getInt(data, pos, 1);
+        if (value > (uint8_t) Profile::XoChip) {
+            throw std::runtime_error("INVALID INPUT LOG.");
+        }
+        profile = (Profile) value;
+    }
+
+    records.clear();
+    uint64_t at = 0;
+    while (pos < data.size()) {
+        uint64_t delta = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = (uint8_t) getInt(data, pos, 1);
+            delta |= (uint64_t) (byte & 0x7F) << shift;
+            shift += 7;
+        } while ((byte & 0x80) != 0 && shift < 64);
+
+        at += delta;
+        records.push_back(Record{ at, (uint16_t) getInt(data, pos, 2) });
+    }
+
+    next = 0;
+    frame = 0;
+}
+
+bool InputReplay::poll(uint8_t keys[16]) {
+    while (next < records.size() && records[next].frame == frame) {
+        for (int i = 0; i < 16; i++) {
+            keys[i] = (records[next].mask >> i) & 1;
+        }
+        next++;
+    }
+
+    uint64_t last = records.empty() ? 0 : records.back().frame;
+    return frame++ < last;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cinttypes>
+#include <fstream>
+#include <vector>
+
+#include "sinks.h"
+#include "quirks.h"
+
+// Input logs make a run reproducible: with the same ROM, RNG seed, speed and
+// quirk profile the core is deterministic, so the key changes and the frame
+// they happened on are all that has to be stored.
+//
+// Layout, little endian:
+//   "E8IN", version byte, seed (8 bytes), hz (4 bytes), profile (1 byte,
+//   version 2 on; version 1 logs ran the default profile)
+//   records: frames since the previous record (LEB128), key mask (2 bytes)
+// The last record marks the last frame of the run and repeats the mask.
+class InputRecorder : public InputSource {
+    private:
+        InputSource& source;
+        std::ofstream file;
+
+        uint64_t frame = 0;
+        uint64_t lastFrame = 0;
+        uint16_t lastMask = 0;
+
+        void write(uint64_t at, uint16_t mask);
+
+    public:
+        // records whatever source reports
+        InputRecorder(InputSource& source);
+
+        void open(const char* path, uint64_t seed, uint32_t hz, Profile profile);
+        void close();
+
+        bool poll(uint8_t keys[16]) override;
+        bool rewinding() const override {
+            return source.rewinding();
+        }
+        bool fastForward() const override {
+            return source.fastForward();
+        }
+        void wait() override {
+            source.wait();
+        }
+};
+
+class InputReplay : public InputSource {
+    private:
+        struct Record {
+            uint64_t frame;
+            uint16_t mask;
+        };
+
+        std::vector<Record> records;
+        size_t next = 0;
+        uint64_t frame = 0;
+
+    public:
+        // the run the log was recorded with
+        uint64_t seed = 0;
+        uint32_t hz = 0;
+        Profile profile = Profile::Default;
+
+        void open(const char* path);
+
+        // plays the keys back, asks to quit on the last recorded frame
+        bool poll(uint8_t keys[16]) override;
+};
@@ -0,0 +1,60 @@
+#include "inputqueue.h"
+
+bool QueuedInputSource::push(const InputEvent& event) {
+    bool queued = true;
+    if (event.type == InputEvent::Quit) {
+        quit.store(true, std::memory_order_relaxed);
+    } else {
+        queued = queue.push(event);
+    }
+
+    // pairs with the fence in wait(): either this sees the machine asleep, or
+    // the machine sees the event (or the quit) before it goes to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeup.notify_one();
+    }
+    return queued;
+}
+
+bool QueuedInputSource::poll(uint8_t keys[16]) {
+    InputEvent event;
+    while (queue.pop(event)) {
+        switch (event.type) {
+            case InputEvent::KeyDown:
+                keys[event.key & 0xF] = 1;
+                break;
+            case InputEvent::KeyUp:
+                keys[event.key & 0xF] = 0;
+                break;
+            case InputEvent::RewindDown:
+                rewindHeld = true;
+                break;
+            case InputEvent::RewindUp:
+                rewindHeld = false;
+                break;
+            case InputEvent::TurboDown:
+                turboHeld = true;
+                break;
+            case InputEvent::TurboUp:
+                turboHeld = false;
+                break;
+            case InputEvent::Quit:
+                // push() keeps these out of the queue
+                break;
+        }
+        newest = event.time;
+    }
+    return !quit.load(std::memory_order_relaxed);
+}
+
+void QueuedInputSource::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (queue.front() == nullptr && !quit.load(std::memory_order_relaxed)) {
+        wakeup.wait(lock);
+    }
+    sleeping.store(false, std::memory_order_relaxed);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "sinks.h"
+#include "scheduler.h"
+#include "spsc_queue.h"
+
+// A key going down or up, or a frontend control, stamped with when the host
+// saw it.
+struct InputEvent {
+    enum Type : uint8_t {
+        KeyDown,
+        KeyUp,
+        RewindDown,
+        RewindUp,
+        TurboDown,
+        TurboUp,
+        Quit
+    };
+
+    Type type;
+    // the CHIP-8 key, for KeyDown and KeyUp
+    uint8_t key;
+    Clock::time_point time;
+};
+
+// Input handed from the thread that owns the window to the thread running the
+// machine. The host pushes events as they arrive; poll() applies everything
+// queued since the last frame to the keys. A machine waiting for a key sleeps
+// in wait() until the next push.
+class QueuedInputSource : public InputSource {
+    private:
+        SpscQueue<InputEvent, 256> queue;
+
+        bool rewindHeld = false;
+        bool turboHeld = false;
+        // set by push() rather than queued, so a full queue can't drop it
+        std::atomic<bool> quit{false};
+
+        // set while the machine thread sleeps in wait()
+        std::atomic<bool> sleeping{false};
+        std::mutex mutex;
+        std::condition_variable wakeup;
+
+    public:
+        // machine side: when the newest event poll() applied was seen, for
+        // measuring input latency
+        Clock::time_point newest;
+
+        // host side; false when the machine is 256 events behind and the
+        // event was dropped. Quit is never dropped.
+        bool push(const InputEvent& event);
+
+        bool poll(uint8_t keys[16]) override;
+        bool rewinding() const override {
+            return rewindHeld;
+        }
+        bool fastForward() const override {
+            return turboHeld;
+        }
+        void wait() override;
+};
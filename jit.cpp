@@ -0,0 +1,470 @@
+#include <cstring>
+
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+static const uint8_t BLOCK_EMPTY = 0;
+static const uint8_t BLOCK_COMPILED = 1;
+static const uint8_t BLOCK_UNCOMPILABLE = 2;
+
+static const size_t BUFFER_SIZE = 1 << 20;
+// worst case code for a whole block, compiling only starts with this much room
+static const size_t BLOCK_RESERVE = 8192;
+static const int MAX_BLOCK_INSTRUCTIONS = 64;
+
+// host registers, by encoding
+static const uint8_t EAX = 0;
+static const uint8_t ECX = 1;
+static const uint8_t EDX = 2;
+
+// Minimal x86-64 encoder. Every memory operand is [rbx + disp32], rbx being
+// the Cpu pointer.
+class Emitter {
+    private:
+        uint8_t* code;
+        size_t size;
+
+    public:
+        Emitter(uint8_t* start) : code(start), size(0) {}
+
+        uint8_t* start() { return code; }
+        size_t length() { return size; }
+
+        void byte(uint8_t b) { code[size++] = b; }
+        void word(uint16_t w) { memcpy(code + size, &w, 2); size += 2; }
+        void dword(uint32_t d) { memcpy(code + size, &d, 4); size += 4; }
+        void qword(uint64_t q) { memcpy(code + size, &q, 8); size += 8; }
+
+        // ModRM for [rbx + disp32] with the given reg field
+        void rbx(uint8_t reg, int32_t disp) { byte(0x80 | (reg << 3) | 3); dword(disp); }
+
+        void loadByte(uint8_t reg, int32_t disp) { byte(0x0F); byte(0xB6); rbx(reg, disp); }   // movzx r32, byte [rbx+d]
+        void storeByte(int32_t disp, uint8_t reg) { byte(0x88); rbx(reg, disp); }               // mov byte [rbx+d], r8
+        void storeImm8(int32_t disp, uint8_t imm) { byte(0xC6); rbx(0, disp); byte(imm); }     // mov byte [rbx+d], imm8
+        void addImm8(int32_t disp, uint8_t imm) { byte(0x80); rbx(0, disp); byte(imm); }       // add byte [rbx+d], imm8
+        void cmpImm8(int32_t disp, uint8_t imm) { byte(0x80); rbx(7, disp); byte(imm); }       // cmp byte [rbx+d], imm8
+        void storeImm16(int32_t disp, uint16_t imm) { byte(0x66); byte(0xC7); rbx(0, disp); word(imm); }
+        void storeWord(int32_t disp, uint8_t reg) { byte(0x66); byte(0x89); rbx(reg, disp); }   // mov word [rbx+d], r16
+        void loadWord(uint8_t reg, int32_t disp) { byte(0x0F); byte(0xB7); rbx(reg, disp); }   // movzx r32, word [rbx+d]
+
+        // op byte [rbx+d], r8 for or (0x08), and (0x20), xor (0x30)
+        void aluStore(uint8_t op, int32_t disp, uint8_t reg) { byte(op); rbx(reg, disp); }
+        // op r32, r32 for add (0x01), sub (0x29), cmp (0x39): dst op= src
+        void alu(uint8_t op, uint8_t dst, uint8_t src) { byte(op); byte(0xC0 | (src << 3) | dst); }
+        void movReg(uint8_t dst, uint8_t src) { alu(0x89, dst, src); }
+        void movImm(uint8_t reg, uint32_t imm) { byte(0xB8 + reg); dword(imm); }
+        void shrImm(uint8_t reg, uint8_t imm) { byte(0xC1); byte(0xE8 | reg); byte(imm); }
+        void andImm8(uint8_t reg, uint8_t imm) { byte(0x83); byte(0xE0 | reg); byte(imm); }
+        void seta(uint8_t reg) { byte(0x0F); byte(0x97); byte(0xC0 | reg); }
+        // cmovcc eax, ecx for e (0x44) and ne (0x45)
+        void cmov(uint8_t cc) { byte(0x0F); byte(cc); byte(0xC1); }
+
+        void loadIndex(int32_t disp) { byte(0x44); byte(0x0F); byte(0xB7); rbx(4, disp); }   // movzx r12d, word [rbx+d]
+        void storeIndex(int32_t disp) { byte(0x66); byte(0x44); byte(0x89); rbx(4, disp); } // mov word [rbx+d], r12w
+        void setIndex(uint32_t imm) { byte(0x41); byte(0xBC); dword(imm); }                 // mov r12d, imm32
+        void indexFromEax() { byte(0x41); byte(0x89); byte(0xC4); }                         // mov r12d, eax
+        void addIndexEax() {
+            byte(0x41); byte(0x01); byte(0xC4);              // add r12d, eax
+            byte(0x45); byte(0x0F); byte(0xB7); byte(0xE4);  // movzx r12d, r12w
+        }
+
+        void prologue() {
+            byte(0x53);                          // push rbx
+            byte(0x41); byte(0x54);              // push r12
+            byte(0x48); byte(0x83); byte(0xEC); byte(0x08); // sub rsp, 8
+            byte(0x48); byte(0x89); byte(0xFB);  // mov rbx, rdi
+        }
+
+        void epilogue() {
+            byte(0x48); byte(0x83); byte(0xC4); byte(0x08); // add rsp, 8
+            byte(0x41); byte(0x5C);              // pop r12
+            byte(0x5B);                          // pop rbx
+            byte(0xC3);                          // ret
+        }
+
+        // handler(cpu, slot), as if it were called from Cpu::run
+        void callHelper(const Instruction* slot) {
+            byte(0x48); byte(0x89); byte(0xDF);  // mov rdi, rbx
+            byte(0x48); byte(0xBE); qword((uint64_t) slot);           // mov rsi, imm64
+            byte(0x48); byte(0xB8); qword((uint64_t) slot->handler);  // mov rax, imm64
+            byte(0xFF); byte(0xD0);              // call rax
+        }
+};
+
+Jit::Jit(Cpu& cpu) : cpu(cpu), buffer(NULL), used(0) {
+#if JIT_SUPPORTED
+    void* mapped = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped != MAP_FAILED) {
+        buffer = (uint8_t*) mapped;
+    }
+#endif
+    flush();
+}
+
+Jit::~Jit() {
+#if JIT_SUPPORTED
+    if (buffer != NULL) {
+        munmap(buffer, BUFFER_SIZE);
+    }
+#endif
+}
+
+bool Jit::available() const {
+    return buffer != NULL;
+}
+
+void Jit::flush() {
+    memset(blocks, 0, sizeof(blocks));
+    memset(coverage, 0, sizeof(coverage));
+    slots.clear();
+    used = 0;
+}
+
+void Jit::drop(uint16_t address) {
+    Block& block = blocks[address];
+    for (uint16_t i = 0; i < block.bytes && address + i < 0x1000; i++) {
+        coverage[address + i]--;
+    }
+    block.state = BLOCK_EMPTY;
+    block.bytes = 0;
+}
+
+void Jit::invalidate(uint16_t address, uint16_t length) {
+    address &= 0xFFF;
+    if (address + length > 0x1000) {
+        // the write wrapped around the end of memory
+        invalidate(0, address + length - 0x1000);
+        length = 0x1000 - address;
+    }
+
+    bool hit = false;
+    for (uint16_t i = 0; i < length; i++) {
+        if (coverage[address + i] != 0) {
+            hit = true;
+            break;
+        }
+    }
+    if (!hit) {
+        return;
+    }
+
+    // self-modifying code: drop every block that overlaps the written bytes.
+    // Blocks are at most 2 * MAX_BLOCK_INSTRUCTIONS bytes long, so only entry
+    // points that close before the write can reach it.
+    for (int start = address - 2 * MAX_BLOCK_INSTRUCTIONS; start < address + length; start++) {
+        if (start < 0) {
+            continue;
+        }
+        Block& block = blocks[start];
+        if (block.state != BLOCK_EMPTY && start + block.bytes > address) {
+            drop(start);
+        }
+    }
+}
+
+uint32_t Jit::execute(uint64_t budget) {
+    uint16_t pc = cpu.programCounter;
+    if (buffer == NULL || pc >= 0x1000) {
+        return 0;
+    }
+
+    Block& block = blocks[pc];
+    if (block.state == BLOCK_EMPTY) {
+        compile(pc);
+    }
+    if (block.state != BLOCK_COMPILED || block.instructions > budget) {
+        return 0;
+    }
+
+    // a store inside the block may drop it, so read its length first
+    uint32_t instructions = block.instructions;
+    block.code(&cpu);
+    return instructions;
+}
+
+void Jit::compile(uint16_t address) {
+    if (BUFFER_SIZE - used < BLOCK_RESERVE) {
+        flush();
+    }
+
+    const int32_t offRegisters = (uint8_t*) cpu.registers - (uint8_t*) &cpu;
+    const int32_t offIndex = (uint8_t*) &cpu.index - (uint8_t*) &cpu;
+    const int32_t offPc = (uint8_t*) &cpu.programCounter - (uint8_t*) &cpu;
+    const int32_t offIdle = (uint8_t*) &cpu.idle - (uint8_t*) &cpu;
+    const int32_t offStack = (uint8_t*) cpu.stack - (uint8_t*) &cpu;
+    const int32_t offSp = (uint8_t*) &cpu.stackPointer - (uint8_t*) &cpu;
+    const int32_t offKeys = (uint8_t*) cpu.keys - (uint8_t*) &cpu;
+    const int32_t offDelay = (uint8_t*) &cpu.delayTimer - (uint8_t*) &cpu;
+    const int32_t offSound = (uint8_t*) &cpu.soundTimer - (uint8_t*) &cpu;
+    const int32_t VF = offRegisters + 0xF;
+
+    // the quirks the native sequences depend on, fixed for the whole block
+    const bool shiftUsesVy = withQuirks(cpu.profile, [](auto quirks) { return decltype(quirks)::shiftUsesVy; });
+    const bool jumpUsesVx = withQuirks(cpu.profile, [](auto quirks) { return decltype(quirks)::jumpUsesVx; });
+
+    Emitter e(buffer + used);
+    e.prologue();
+    e.loadIndex(offIndex);
+
+    uint16_t pc = address;
+    int count = 0;
+    // set once an instruction wrote the program counter itself
+    bool ended = false;
+    // set at an instruction that has to run outside of the block
+    bool stop = false;
+
+    while (!ended && !stop && count < MAX_BLOCK_INSTRUCTIONS && pc + 1 < 0x1000) {
+        uint16_t opcode = (cpu.memory[pc] << 8) | cpu.memory[pc + 1];
+        uint8_t x = (opcode & 0x0F00) >> 8;
+        uint8_t y = (opcode & 0x00F0) >> 4;
+        uint8_t kk = opcode & 0x00FF;
+        uint16_t nnn = opcode & 0x0FFF;
+        int32_t Vx = offRegisters + x;
+        int32_t Vy = offRegisters + y;
+
+        // ops executed through their decode-cache handler
+        bool helper = false;
+        // helper ops that end the block, the helper sets the program counter
+        bool helperEnds = false;
+        // conditional skips: the flags decide between pc + 2 and pc + 4
+        uint8_t skipCondition = 0;
+
+        switch (opcode >> 12) {
+            case 0x0:
+                if (opcode == 0x00E0 || (opcode & 0xFFE0) == 0x00C0 || opcode == 0x00FB || opcode == 0x00FC || opcode == 0x00FE || opcode == 0x00FF) {
+                    // clear, scrolls and resolution switches
+                    helper = true;
+                } else if (opcode == 0x00EE) {
+                    e.byte(0x66); e.byte(0xFF); e.rbx(1, offSp);        // dec word [sp]
+                    e.loadWord(EAX, offSp);
+                    e.andImm8(EAX, 0x0F);
+                    e.byte(0x0F); e.byte(0xB7); e.byte(0x84); e.byte(0x43); e.dword(offStack); // movzx eax, word [rbx+stack+rax*2]
+                    e.byte(0x83); e.byte(0xC0); e.byte(0x02);          // add eax, 2
+                    e.storeWord(offPc, EAX);
+                    ended = true;
+                }
+                break;
+            case 0x1:
+                if (nnn == pc || nnn + 4 == pc) {
+                    // may close an idle loop, see Cpu::skipIdle
+                    e.storeImm8(offIdle, 1);
+                }
+                e.storeImm16(offPc, nnn);
+                ended = true;
+                break;
+            case 0x2:
+                e.loadWord(EAX, offSp);
+                e.andImm8(EAX, 0x0F);
+                e.byte(0x66); e.byte(0xC7); e.byte(0x84); e.byte(0x43); e.dword(offStack); e.word(pc); // mov word [rbx+stack+rax*2], pc
+                e.byte(0x66); e.byte(0xFF); e.rbx(0, offSp);        // inc word [sp]
+                e.storeImm16(offPc, nnn);
+                ended = true;
+                break;
+            case 0x3:
+                e.cmpImm8(Vx, kk);
+                skipCondition = 0x44;
+                break;
+            case 0x4:
+                e.cmpImm8(Vx, kk);
+                skipCondition = 0x45;
+                break;
+            case 0x5:
+                e.loadByte(EAX, Vx);
+                e.byte(0x3A); e.rbx(EAX, Vy);                         // cmp al, byte [Vy]
+                skipCondition = 0x44;
+                break;
+            case 0x6:
+                e.storeImm8(Vx, kk);
+                break;
+            case 0x7:
+                e.addImm8(Vx, kk);
+                break;
+            case 0x8:
+                // every sequence below follows ops.h: VF is written first and
+                // the operands are reloaded after, in case x or y is F
+                switch (opcode & 0x000F) {
+                    case 0x0:
+                        e.loadByte(EAX, Vy);
+                        e.storeByte(Vx, EAX);
+                        break;
+                    case 0x1:
+                        e.loadByte(EAX, Vy);
+                        e.aluStore(0x08, Vx, EAX);
+                        break;
+                    case 0x2:
+                        e.loadByte(EAX, Vy);
+                        e.aluStore(0x20, Vx, EAX);
+                        break;
+                    case 0x3:
+                        e.loadByte(EAX, Vy);
+                        e.aluStore(0x30, Vx, EAX);
+                        break;
+                    case 0x4:
+                        e.loadByte(EAX, Vx);
+                        e.loadByte(ECX, Vy);
+                        e.alu(0x01, EAX, ECX);
+                        e.movReg(EDX, EAX);
+                        e.shrImm(EDX, 8);
+                        e.storeByte(VF, EDX);
+                        e.storeByte(Vx, EAX);
+                        break;
+                    case 0x5:
+                        e.loadByte(EAX, Vx);
+                        e.loadByte(ECX, Vy);
+                        e.alu(0x39, EAX, ECX);
+                        e.seta(EDX);
+                        e.storeByte(VF, EDX);
+                        e.loadByte(EAX, Vx);
+                        e.loadByte(ECX, Vy);
+                        e.alu(0x29, EAX, ECX);
+                        e.storeByte(Vx, EAX);
+                        break;
+                    case 0x6:
+                        e.loadByte(EAX, shiftUsesVy ? Vy : Vx);
+                        e.movReg(EDX, EAX);
+                        e.andImm8(EDX, 1);
+                        e.storeByte(VF, EDX);
+                        e.loadByte(EAX, shiftUsesVy ? Vy : Vx);
+                        e.shrImm(EAX, 1);
+                        e.storeByte(Vx, EAX);
+                        break;
+                    case 0x7:
+                        e.loadByte(EAX, Vx);
+                        e.loadByte(ECX, Vy);
+                        e.alu(0x39, ECX, EAX);
+                        e.seta(EDX);
+                        e.storeByte(VF, EDX);
+                        e.loadByte(EAX, Vx);
+                        e.loadByte(ECX, Vy);
+                        e.alu(0x29, ECX, EAX);
+                        e.storeByte(Vx, ECX);
+                        break;
+                    case 0xE:
+                        e.loadByte(EAX, shiftUsesVy ? Vy : Vx);
+                        e.movReg(EDX, EAX);
+                        e.shrImm(EDX, 7);
+                        e.storeByte(VF, EDX);
+                        e.loadByte(EAX, shiftUsesVy ? Vy : Vx);
+                        e.byte(0xD1); e.byte(0xE0);                   // shl eax, 1
+                        e.storeByte(Vx, EAX);
+                        break;
+                }
+                break;
+            case 0x9:
+                helper = true;
+                helperEnds = true;
+                break;
+            case 0xA:
+                e.setIndex(nnn);
+                break;
+            case 0xB:
+                e.loadByte(EAX, jumpUsesVx ? Vx : offRegisters);
+                e.byte(0x05); e.dword(nnn);                           // add eax, nnn
+                e.storeWord(offPc, EAX);
+                ended = true;
+                break;
+            case 0xC:
+            case 0xD:
+                helper = true;
+                break;
+            case 0xE:
+                if (kk == 0x9E || kk == 0xA1) {
+                    e.loadByte(EAX, Vx);
+                    e.andImm8(EAX, 0x0F);
+                    e.byte(0x80); e.byte(0xBC); e.byte(0x03); e.dword(offKeys); e.byte(1); // cmp byte [rbx+keys+rax], 1
+                    skipCondition = (kk == 0x9E) ? 0x44 : 0x45;
+                }
+                break;
+            case 0xF:
+                switch (kk) {
+                    case 0x01:
+                        helper = true;
+                        break;
+                    case 0x07:
+                        e.loadByte(EAX, offDelay);
+                        e.storeByte(Vx, EAX);
+                        break;
+                    case 0x0A:
+                        // a key wait may not advance at all, it stays outside of blocks
+                        stop = true;
+                        continue;
+                    case 0x15:
+                        e.loadByte(EAX, Vx);
+                        e.storeByte(offDelay, EAX);
+                        break;
+                    case 0x18:
+                        e.loadByte(EAX, Vx);
+                        e.storeByte(offSound, EAX);
+                        break;
+                    case 0x1E:
+                        e.loadByte(EAX, Vx);
+                        e.addIndexEax();
+                        break;
+                    case 0x29:
+                        e.loadByte(EAX, Vx);
+                        e.byte(0x8D); e.byte(0x04); e.byte(0x80);    // lea eax, [rax+rax*4]
+                        e.indexFromEax();
+                        break;
+                    case 0x33:
+                    case 0x55:
+                        helper = true;
+                        helperEnds = true;
+                        break;
+                    case 0x65:
+                        helper = true;
+                        break;
+                }
+                break;
+        }
+
+        if (helper) {
+            slots.push_back(Cpu::decode(opcode, cpu.profile));
+            e.storeIndex(offIndex);
+            e.storeImm16(offPc, pc);
+            e.callHelper(&slots.back());
+            e.loadIndex(offIndex);
+            ended = helperEnds;
+        }
+
+        if (skipCondition != 0) {
+            e.movImm(EAX, pc + 2);
+            e.movImm(ECX, pc + 4);
+            e.cmov(skipCondition);
+            e.storeWord(offPc, EAX);
+            ended = true;
+        }
+
+        pc += 2;
+        count++;
+    }
+
+    Block& block = blocks[address];
+    if (count == 0) {
+        // first instruction can't be compiled; remember it so we don't retry
+        // until the bytes under it change
+        block.state = BLOCK_UNCOMPILABLE;
+        block.bytes = 2;
+    } else {
+        if (!ended) {
+            e.storeImm16(offPc, pc);
+        }
+        e.storeIndex(offIndex);
+        e.epilogue();
+
+        block.code = (void (*)(Cpu*)) e.start();
+        block.state = BLOCK_COMPILED;
+        block.instructions = count;
+        block.bytes = pc - address;
+        used += (e.length() + 15) & ~(size_t) 15;
+    }
+
+    for (uint16_t i = 0; i < block.bytes && address + i < 0x1000; i++) {
+        coverage[address + i]++;
+    }
+}
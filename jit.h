@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <deque>
+
+#include "cpu.h"
+
+// Basic-block recompiler to x86-64. Straight-line runs of CHIP-8 instructions
+// are translated into one native function per block entry address; blocks end
+// at control flow (1nnn, 2nnn, 00EE, Bnnn, skips) and at memory writes
+// (Fx33, Fx55), and never include the key wait (Fx0A), which is left to the
+// decode cache.
+//
+// Inside a block rbx holds the Cpu, r12 holds index and the program counter
+// is a compile-time constant, only written back when the block exits.
+class Jit {
+    private:
+        struct Block {
+            void (*code)(Cpu* cpu);
+            uint16_t bytes;        // bytes of CHIP-8 code the block covers
+            uint8_t instructions;  // instructions executed on every path through it
+            uint8_t state;         // BLOCK_EMPTY, BLOCK_COMPILED or BLOCK_UNCOMPILABLE
+        };
+
+        Cpu& cpu;
+
+        uint8_t* buffer;
+        size_t used;
+
+        Block blocks[4096];
+        // how many blocks cover each byte of memory, so writes can tell cheaply
+        // whether they hit code
+        uint8_t coverage[4096];
+        // decoded operands handed to the helpers called from generated code
+        std::deque<Instruction> slots;
+
+        void compile(uint16_t address);
+        void drop(uint16_t address);
+
+    public:
+        explicit Jit(Cpu& cpu);
+        ~Jit();
+
+        // false when the host can't map executable memory or isn't x86-64
+        bool available() const;
+
+        // runs the block at the program counter if it fits in the budget and
+        // returns how many instructions it executed, 0 when nothing ran
+        uint32_t execute(uint64_t budget);
+
+        void invalidate(uint16_t address, uint16_t length);
+        void flush();
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// text as the inside of a JSON string, for the tools that print JSON
+inline std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c: text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char) c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
@@ -0,0 +1,274 @@
+#include <cstring>
+
+#include "lockstep.h"
+
+typedef Lockstep::Bytes Bytes;
+typedef Lockstep::Words Words;
+typedef Lockstep::Counts Counts;
+typedef int8_t SignedBytes __attribute__((vector_size(Lockstep::LANES)));
+typedef int16_t SignedWords __attribute__((vector_size(Lockstep::LANES * 2)));
+
+// Word vectors are wider than SSE2 registers, so these take and give them by
+// reference: passing them by value has an ABI that depends on -march.
+
+// the lanes of target where mask is all ones become value's
+template <typename V>
+static inline void blend(V& target, const V& mask, const V& value) {
+    target = (value & mask) | (target & ~mask);
+}
+
+// byte lanes as words
+static inline void widen(const Bytes& value, Words& out) {
+    out = __builtin_convertvector(value, Words);
+}
+
+static inline void narrow(const Words& value, Bytes& out) {
+    out = __builtin_convertvector(value, Bytes);
+}
+
+// moves the lanes in mask to the next instruction, or past it where cond is
+// all ones
+static inline void skip(Words& programCounter, const Words& mask, const Bytes& cond) {
+    Words wide = (Words) __builtin_convertvector((SignedBytes) cond, SignedWords);
+    programCounter += mask & (2 + (wide & 2));
+}
+
+void Lockstep::init(const uint8_t* rom, size_t size, Profile profile, const uint64_t seeds[LANES]) {
+    if (!cpus) {
+        cpus.reset(new Cpu[LANES]());
+    }
+    this->profile = profile;
+
+    for (int lane = 0; lane < LANES; lane++) {
+        Cpu& cpu = cpus[lane];
+        cpu.init();
+        cpu.loadProgram(rom, size);
+        cpu.setProfile(profile);
+        cpu.engine = Engine::DecodeCache;
+        cpu.seed(seeds[lane]);
+        fill(lane);
+    }
+
+    memset(written, 0, sizeof(written));
+    instructions = 0;
+    steps = 0;
+}
+
+void Lockstep::deinit() {
+    if (cpus) {
+        for (int lane = 0; lane < LANES; lane++) {
+            cpus[lane].deinit();
+        }
+    }
+}
+
+void Lockstep::spill(int lane) {
+    Cpu& cpu = cpus[lane];
+    for (int i = 0; i < 16; i++) {
+        cpu.registers[i] = registers[i][lane];
+    }
+    cpu.index = index[lane];
+    cpu.programCounter = programCounter[lane];
+    cpu.delayTimer = delayTimer[lane];
+    cpu.soundTimer = soundTimer[lane];
+}
+
+void Lockstep::fill(int lane) {
+    const Cpu& cpu = cpus[lane];
+    for (int i = 0; i < 16; i++) {
+        registers[i][lane] = cpu.registers[i];
+    }
+    index[lane] = cpu.index;
+    programCounter[lane] = cpu.programCounter;
+    delayTimer[lane] = cpu.delayTimer;
+    soundTimer[lane] = cpu.soundTimer;
+}
+
+void Lockstep::sync() {
+    for (int lane = 0; lane < LANES; lane++) {
+        spill(lane);
+    }
+}
+
+// Runs one instruction on the lane's own Cpu.
+void Lockstep::scalar(int lane, uint16_t opcode) {
+    Cpu& cpu = cpus[lane];
+    spill(lane);
+
+    uint16_t at = cpu.index;
+    cpu.cycle();
+
+    // the lanes' code may differ wherever one of them stored
+    int stored = 0;
+    if ((opcode & 0xF0FF) == 0xF033) {
+        stored = 3;
+    } else if ((opcode & 0xF0FF) == 0xF055) {
+        stored = ((opcode >> 8) & 0xF) + 1;
+    }
+    for (int i = 0; i < stored; i++) {
+        written[(at + i) & 0xFFF] = 1;
+    }
+
+    fill(lane);
+}
+
+void Lockstep::run(uint64_t count) {
+    while (count > 0) {
+        uint64_t chunk = (count < UINT32_MAX) ? count : UINT32_MAX;
+        withQuirks(profile, [&](auto quirks) {
+            return runWith<decltype(quirks)>(chunk);
+        });
+        instructions += chunk * LANES;
+        count -= chunk;
+    }
+}
+
+// Every step takes the first lane that still has instructions left, runs its
+// instruction on all lanes that are at the same address with the same code,
+// and charges it to those lanes only.
+template <typename Quirks>
+uint64_t Lockstep::runWith(uint64_t count) {
+    Counts left = (Counts) {} + (uint32_t) count;
+
+    for (;;) {
+        int leader = 0;
+        while (leader < LANES && left[leader] == 0) {
+            leader++;
+        }
+        if (leader == LANES) {
+            break;
+        }
+
+        uint16_t pc = programCounter[leader];
+        const Cpu& lead = cpus[leader];
+        uint16_t opcode = (lead.memory[pc & 0xFFF] << 8) | lead.memory[(pc + 1) & 0xFFF];
+
+        Words mask = (Words) (programCounter == pc) & __builtin_convertvector((Counts) (left != 0), Words);
+        if (written[pc & 0xFFF] | written[(pc + 1) & 0xFFF]) {
+            for (int lane = leader + 1; lane < LANES; lane++) {
+                const Cpu& cpu = cpus[lane];
+                if (mask[lane] != 0 && ((cpu.memory[pc & 0xFFF] << 8) | cpu.memory[(pc + 1) & 0xFFF]) != opcode) {
+                    mask[lane] = 0;
+                }
+            }
+        }
+        Bytes m;
+        narrow(mask, m);
+
+        uint8_t x = (opcode & 0x0F00) >> 8;
+        uint8_t y = (opcode & 0x00F0) >> 4;
+        uint8_t kk = opcode & 0x00FF;
+        uint16_t nnn = opcode & 0x0FFF;
+        Bytes* R = registers;
+        Words wide;
+        bool vector = true;
+
+        switch (opcode >> 12) {
+            case 0x1:
+                blend(programCounter, mask, (Words) {} + nnn);
+                break;
+            case 0x3:
+                skip(programCounter, mask, (Bytes) (R[x] == kk));
+                break;
+            case 0x4:
+                skip(programCounter, mask, (Bytes) (R[x] != kk));
+                break;
+            case 0x5:
+                skip(programCounter, mask, (Bytes) (R[x] == R[y]));
+                break;
+            case 0x6:
+                blend(R[x], m, (Bytes) {} + kk);
+                programCounter += mask & 2;
+                break;
+            case 0x7:
+                blend(R[x], m, R[x] + kk);
+                programCounter += mask & 2;
+                break;
+            case 0x8: {
+                // same order of reads and writes as ops.h, VF can be x or y
+                const uint8_t source = Quirks::shiftUsesVy ? y : x;
+                Bytes sum;
+                switch (opcode & 0x000F) {
+                    case 0x0: blend(R[x], m, R[y]); break;
+                    case 0x1: blend(R[x], m, R[x] | R[y]); break;
+                    case 0x2: blend(R[x], m, R[x] & R[y]); break;
+                    case 0x3: blend(R[x], m, R[x] ^ R[y]); break;
+                    case 0x4:
+                        // the sum wrapped around where it is below an addend
+                        sum = R[x] + R[y];
+                        blend(R[0xF], m, (Bytes) (sum < R[x]) & 1);
+                        blend(R[x], m, sum);
+                        break;
+                    case 0x5:
+                        blend(R[0xF], m, (Bytes) (R[x] > R[y]) & 1);
+                        blend(R[x], m, R[x] - R[y]);
+                        break;
+                    case 0x6:
+                        blend(R[0xF], m, R[source] & 1);
+                        blend(R[x], m, R[source] >> 1);
+                        break;
+                    case 0x7:
+                        blend(R[0xF], m, (Bytes) (R[y] > R[x]) & 1);
+                        blend(R[x], m, R[y] - R[x]);
+                        break;
+                    case 0xE:
+                        blend(R[0xF], m, R[source] >> 7);
+                        blend(R[x], m, R[source] << 1);
+                        break;
+                }
+                programCounter += mask & 2;
+                break;
+            }
+            case 0x9:
+                skip(programCounter, mask, (Bytes) (R[x] != R[y]));
+                break;
+            case 0xA:
+                blend(index, mask, (Words) {} + nnn);
+                programCounter += mask & 2;
+                break;
+            case 0xB:
+                widen(R[Quirks::jumpUsesVx ? (nnn >> 8) : 0], wide);
+                blend(programCounter, mask, wide + nnn);
+                break;
+            case 0xF:
+                switch (kk) {
+                    case 0x07: blend(R[x], m, delayTimer); break;
+                    case 0x15: blend(delayTimer, m, R[x]); break;
+                    case 0x18: blend(soundTimer, m, R[x]); break;
+                    case 0x1E: widen(R[x], wide); index += mask & wide; break;
+                    case 0x29: widen(R[x], wide); blend(index, mask, wide * 5); break;
+                    case 0x01: case 0x0A: case 0x33: case 0x55: case 0x65:
+                        vector = false;
+                        break;
+                }
+                if (vector) {
+                    programCounter += mask & 2;
+                }
+                break;
+            default:
+                // 0nnn, 2nnn, Cxkk, Dxyn, Exkk
+                vector = false;
+        }
+
+        if (!vector) {
+            for (int lane = leader; lane < LANES; lane++) {
+                if (mask[lane] != 0) {
+                    scalar(lane, opcode);
+                }
+            }
+        }
+
+        left -= __builtin_convertvector(mask, Counts) & 1;
+        steps++;
+    }
+
+    return count;
+}
+
+void Lockstep::tickTimers() {
+    delayTimer -= (Bytes) (delayTimer != 0) & 1;
+    soundTimer -= (Bytes) (soundTimer != 0) & 1;
+    for (int lane = 0; lane < LANES; lane++) {
+        cpus[lane].ticks++;
+    }
+}
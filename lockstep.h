@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <memory>
+
+#include "cpu.h"
+
+// Runs LANES machines with the same ROM side by side, for seed sweeps. The
+// registers, index, program counter and timers of all lanes are kept as
+// vectors (GCC vector extensions, lowered to whatever -march allows: SSE2,
+// AVX2, AVX-512), and an instruction the lanes agree on runs once for all of
+// them. Lanes that are elsewhere, or whose code differs, are masked out and
+// catch up on later steps.
+//
+// Register-only instructions (6xkk, 7xkk, 8xyN, skips, jumps, Annn, Fx07,
+// Fx15, Fx18, Fx1E, Fx29) are vector code. Everything touching memory, the
+// screen, the stack, the keys or the random generator runs on the lane's own
+// Cpu through the decode cache, with its vector registers spilled there and
+// reloaded after, so those semantics stay the ones in ops.h.
+class Lockstep {
+    public:
+        static const int LANES = 16;
+
+        typedef uint8_t Bytes __attribute__((vector_size(LANES)));
+        typedef uint16_t Words __attribute__((vector_size(LANES * 2)));
+        typedef uint32_t Counts __attribute__((vector_size(LANES * 4)));
+
+    private:
+        // one per lane: memory, screen, stack, keys and the random generator
+        // live there for good, the vector fields are copied in on sync()
+        std::unique_ptr<Cpu[]> cpus;
+
+        Bytes registers[16];
+        Words index;
+        Words programCounter;
+        Bytes delayTimer;
+        Bytes soundTimer;
+
+        // addresses some lane wrote to, where the lanes' code may differ
+        uint8_t written[4096];
+
+        Profile profile = Profile::Default;
+
+        void spill(int lane);
+        void fill(int lane);
+        void scalar(int lane, uint16_t opcode);
+
+        template <typename Quirks>
+        uint64_t runWith(uint64_t count);
+
+    public:
+        // instructions executed by lanes, and the steps they took: with every
+        // lane in agreement steps * LANES == instructions
+        uint64_t instructions = 0;
+        uint64_t steps = 0;
+
+        // every lane gets the ROM, the profile and its own seed
+        void init(const uint8_t* rom, size_t size, Profile profile, const uint64_t seeds[LANES]);
+        void deinit();
+
+        // runs count instructions on every lane; the timers don't tick
+        void run(uint64_t count);
+        // ticks every lane's 60 Hz timers, the beeper is not emulated
+        void tickTimers();
+
+        // the lane's machine; its vector fields are current after sync(), and
+        // its keys are what the lane's key instructions read
+        Cpu& lane(int lane) {
+            return cpus[lane];
+        }
+        void sync();
+};
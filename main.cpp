@@ -1,17 +1,31 @@
 #include <iostream>
-#include <fstream>
-#include <vector>
+#include <string>
 #include <stdexcept>
+#include <cstring>
+#include <ctime>
+#include <cinttypes>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <exception>
 #include <thread>
 
 #include <SDL2/SDL.h>
 
-#include "cpu.cpp"
-
-SDL_Renderer* renderer;
-SDL_Window* window;
-SDL_Texture* texture;
+#include "cpu.h"
+#include "audio.h"
+#include "display.h"
+#include "scheduler.h"
+#include "rewind.h"
+#include "inputlog.h"
+#include "inputqueue.h"
+#include "framelog.h"
+#include "framebuffer.h"
+#include "trace.h"
+#include "profiler.h"
+#include "romdb.h"
+#include "romfile.h"
+#include "romindex.h"
 
 const int keymap[16] = {
     SDL_SCANCODE_X,
@@ -32,10 +46,61 @@ const int keymap[16] = {
     SDL_SCANCODE_V
 };
 
+// The window. It belongs to the main thread, as SDL wants, and shows the
+// frames the machine thread publishes (see runThreaded).
+class SdlVideo {
+    private:
+        SDL_Window* window = NULL;
+        SDL_Renderer* renderer = NULL;
+        SDL_Texture* texture = NULL;
+
+        // staging copy of the texture, only changed rows are re-expanded; the
+        // texture is always 128x64, lo-res pixels are drawn 2x2
+        uint32_t pixels[MAX_WIDTH * MAX_HEIGHT];
+        // the frame on screen, the next one is compared against it
+        Frame shown;
+        bool showing = false;
+
+        // input to present latency
+        Clock::time_point lastInput;
+        std::chrono::duration<double> latencyTotal{0};
+        std::chrono::duration<double> latencyMax{0};
+        uint64_t latencyCount = 0;
+
+    public:
+        // the user event machine threads push when a frame is published
+        Uint32 frameEvent = 0;
+
+        void open();
+        void close();
+
+        void show(const Frame& frame);
+        void printLatency() const;
+};
+
+// rewind history kept by the SDL frontend, about 10 minutes of frames
+const size_t REWIND_BYTES = 8 * 1024 * 1024;
+const size_t REWIND_FRAMES = 10 * 60 * Scheduler::FRAME_RATE;
+
+// How fast-forward runs: the speed, and which of the frames it races through
+// are shown. Audio is muted meanwhile.
+struct Turbo {
+    // multiple of real time, 0 is as fast as the host allows
+    uint32_t speed = 0;
+    // present every nth frame, 0 presents the latest one once per 60 Hz refresh
+    uint32_t frameSkip = 0;
+};
+
 Cpu cpu;
 
-void init() {
-    if (SDL_Init(SDL_INIT_EVERYTHING) < 0) { throw std::runtime_error("SDL INITALIZATION FAILED."); }
+bool headless = false;
+SdlVideo sdlVideo;
+Audio sdlAudio;
+Tracer tracer;
+Profiler profiler;
+
+void SdlVideo::open() {
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) { throw std::runtime_error("SDL INITALIZATION FAILED."); }
 
     // window with 64x32 ratio
     window = SDL_CreateWindow("eightmulator", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1024, 512, SDL_WINDOW_VULKAN);
@@ -46,95 +111,541 @@ void init() {
 
     if (renderer == NULL) { throw std::runtime_error("RENDERER CREATION FAILED."); }
 
-    // 64 x 32 texture
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
+    // 128 x 64 texture
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, MAX_WIDTH, MAX_HEIGHT);
     if (texture == NULL) { throw std::runtime_error("TEXTURE CREATION FAILED."); }
 
-    cpu.init(true);
+    frameEvent = SDL_RegisterEvents(1);
+    if (frameEvent == (Uint32) -1) { throw std::runtime_error("EVENT REGISTRATION FAILED."); }
+    showing = false;
 }
 
-void deinit() {
-    cpu.deinit();
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+void SdlVideo::close() {
+    if (texture != NULL) {
+        SDL_DestroyTexture(texture);
+        texture = NULL;
+    }
+    if (renderer != NULL) {
+        SDL_DestroyRenderer(renderer);
+        renderer = NULL;
+    }
+    if (window != NULL) {
+        SDL_DestroyWindow(window);
+        window = NULL;
+    }
 }
 
-void loadROM(char *filename) {
-   std::ifstream file(filename, std::ios::in | std::ios::binary);
-    if (file.is_open()) {
-        char c;
-        int check = 0x200;
-        for (int i = 0x200; file.get(c); i++) {
-            if (check >= 4096) {
-                throw std::runtime_error("ROM TOO LARGE.");
+void SdlVideo::show(const Frame& frame) {
+    const int height = frame.hires ? MAX_HEIGHT : MAX_HEIGHT / 2;
+    // texture rows per screen row
+    const int scale = MAX_HEIGHT / height;
+    const int words = frame.hires ? ROW_WORDS : 1;
+
+    // the rows that differ from the frame on screen, frames the machine
+    // published in between were never shown
+    uint64_t dirtyRows = ~0ull;
+    if (showing && shown.hires == frame.hires) {
+        dirtyRows = 0;
+        for (int y = 0; y < height; y++) {
+            for (int plane = 0; plane < PLANES; plane++) {
+                for (int word = 0; word < words; word++) {
+                    if (frame.graphics[plane][y][word] != shown.graphics[plane][y][word]) {
+                        dirtyRows |= 1ull << y;
+                    }
+                }
             }
-            cpu.memory[i] = (uint8_t) c;
-            check++;
         }
     }
+    shown = frame;
+    showing = true;
+
+    // upload each run of consecutive dirty rows with a single update
+    int y = 0;
+    while (y < height) {
+        if (((dirtyRows >> y) & 1) == 0) {
+            y++;
+            continue;
+        }
+
+        int first = y;
+        while (y < height && ((dirtyRows >> y) & 1) != 0) {
+            uint32_t* out = pixels + y * scale * MAX_WIDTH;
+            for (int word = 0; word < words; word++) {
+                uint64_t row[PLANES];
+                for (int plane = 0; plane < PLANES; plane++) {
+                    row[plane] = frame.graphics[plane][y][word];
+                }
+                if ((row[1] | row[2] | row[3]) == 0) {
+                    // plain CHIP-8 only ever draws on the first plane
+                    expandRow(row[0], out + word * 64, PALETTE[1], PALETTE[0]);
+                } else {
+                    expandPlanes(row, out + word * 64, PALETTE);
+                }
+            }
+            if (!frame.hires) {
+                // double in place from the right so no pixel is overwritten before it is read
+                for (int x = 63; x >= 0; x--) {
+                    out[2 * x] = out[2 * x + 1] = out[x];
+                }
+                memcpy(out + MAX_WIDTH, out, MAX_WIDTH * sizeof(uint32_t));
+            }
+            y++;
+        }
+
+        SDL_Rect rect = { 0, first * scale, MAX_WIDTH, (y - first) * scale };
+        SDL_UpdateTexture(texture, &rect, pixels + first * scale * MAX_WIDTH, MAX_WIDTH * sizeof(uint32_t));
+    }
+
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+
+    // the first frame showing the effect of new input
+    if (frame.input != lastInput) {
+        lastInput = frame.input;
+        std::chrono::duration<double> latency = Clock::now() - frame.input;
+        latencyTotal += latency;
+        latencyMax = std::max(latencyMax, latency);
+        latencyCount++;
+    }
 }
 
-int main(int argc, char *argv[]) {
-    try {
-        init();
-        
-        char* filename = argv[1];
-
-        if (filename == NULL) {
-            printf("No ROM argument present.\n");
-            exit(-1);
-        }
-
-        loadROM(filename);
-
-        // Main loop
-        bool keepOpen = true;
-        while (keepOpen) {
-            cpu.cycle();
-
-            // SDL Events
-            SDL_Event e;
-            while(SDL_PollEvent(&e) > 0) {
-                switch (e.type) {
-                    case SDL_QUIT: 
-                        keepOpen = false;
-                        break;
-                    case SDL_KEYDOWN:
-                        for(int i = 0; i < 16; i++) {
-                            if (e.key.keysym.scancode == keymap[i]) {
-                                cpu.keys[i] = 1;
-                            }
-                        }
-                        break;
-                    case SDL_KEYUP:
-                        for(int i = 0; i < 16; i++) {
-                            if (e.key.keysym.scancode == keymap[i]) {
-                                cpu.keys[i] = 0;
-                            }
-                        }
+void SdlVideo::printLatency() const {
+    if (latencyCount > 0) {
+        printf("[Video] input to present: %.2f ms average, %.2f ms worst over %" PRIu64 " inputs\n",
+            latencyTotal.count() * 1000 / latencyCount, latencyMax.count() * 1000, latencyCount);
+    }
+}
+
+// Hands one SDL event to the machine thread as an input event.
+void forwardEvent(QueuedInputSource& input, const SDL_Event& e) {
+    InputEvent event = {};
+    event.time = Clock::now();
+
+    switch (e.type) {
+        case SDL_QUIT:
+            event.type = InputEvent::Quit;
+            input.push(event);
+            break;
+        case SDL_KEYDOWN:
+        case SDL_KEYUP: {
+            bool down = e.type == SDL_KEYDOWN;
+            if (e.key.repeat) {
+                break;
+            }
+            if (e.key.keysym.scancode == SDL_SCANCODE_BACKSPACE) {
+                event.type = down ? InputEvent::RewindDown : InputEvent::RewindUp;
+                input.push(event);
+            } else if (e.key.keysym.scancode == SDL_SCANCODE_TAB) {
+                event.type = down ? InputEvent::TurboDown : InputEvent::TurboUp;
+                input.push(event);
+            }
+            for (int i = 0; i < 16; i++) {
+                if (e.key.keysym.scancode == keymap[i]) {
+                    event.type = down ? InputEvent::KeyDown : InputEvent::KeyUp;
+                    event.key = i;
+                    input.push(event);
                 }
             }
+            break;
+        }
+    }
+}
+
+void init() {
+    if (headless) {
+        // no SDL at all: null sinks, no window, no audio device
+        cpu.init();
+        return;
+    }
+
+    if (SDL_Init(0) < 0) { throw std::runtime_error("SDL INITALIZATION FAILED."); }
+
+    sdlVideo.open();
+    sdlAudio.open();
+
+    cpu.init(&sdlAudio);
+}
+
+void deinit() {
+    cpu.deinit();
+    tracer.close();
+
+    if (!headless) {
+        sdlAudio.close();
+        sdlVideo.close();
+        SDL_Quit();
+    }
+}
+
+// returns the size of the ROM
+size_t loadROM(Cpu& cpu, const char* filename) {
+    RomFile rom;
+    rom.open(filename);
+    cpu.loadProgram(rom.data(), rom.size());
+    return rom.size();
+}
+
+// The quirk profile and speed for a ROM: the ones forced on the command line
+// or by a replayed log, else the ones the ROM index (or without one the ROM
+// database) lists for it, else the defaults.
+void chooseSettings(const Cpu& cpu, size_t romSize, const char* romdbPath, const char* romindexPath, bool profileForced, Profile& profile, bool hzForced, uint32_t& hz) {
+    if (profileForced && hzForced) {
+        return;
+    }
+
+    uint64_t hash = RomDatabase::hashRom(cpu.memory + 0x200, romSize);
+    Profile listed = Profile::Default;
+    uint32_t listedHz = hz;
+    std::string name;
+
+    RomIndex index;
+    RomDatabase database;
+    openLibrary(romindexPath, romdbPath, index, database);
+    bool found = settingsFor(hash, index, database, listed, listedHz, &name);
+
+    if (!profileForced) {
+        profile = listed;
+    }
+    if (!hzForced) {
+        hz = listedHz;
+    }
+    if (found && !headless) {
+        std::cout << "[Rom] " << name << ", " << profileName(profile) << " quirks, " << hz << " Hz" << std::endl;
+    }
+}
 
-            SDL_RenderClear(renderer);
+// Writes the profiler's report and collapsed call stacks, either may be null.
+void writeProfile(const char* reportPath, const char* stacksPath) {
+    if (reportPath != NULL) {
+        FILE* file = fopen(reportPath, "w");
+        if (file == NULL) {
+            throw std::runtime_error("PROFILE OPEN FAILED.");
+        }
+        profiler.writeReport(file);
+        fclose(file);
+    }
+    if (stacksPath != NULL) {
+        FILE* file = fopen(stacksPath, "w");
+        if (file == NULL) {
+            throw std::runtime_error("STACKS OPEN FAILED.");
+        }
+        profiler.writeCollapsed(file);
+        fclose(file);
+    }
+}
 
-            uint32_t* bytes = new uint32_t[64 * 32];
-            int pitch = 0;
+// Runs the machine frame by frame until the input source asks to quit or
+// maxCycles instructions have run (0 means no limit). Throttled runs are paced
+// to 60 frames per second of wall-clock time, the others go as fast as the
+// host allows. With a rewind history every frame is recorded, and frames the
+// input source asks to rewind restore the previous one instead of running.
+// While the input source asks to fast-forward, throttled runs go at the turbo
+// speed, skip presenting frames and mute the beeper. A throttled machine
+// waiting for a key blocks until the input source has events.
+void run(Cpu& cpu, VideoSink& video, InputSource& input, Scheduler& scheduler, uint64_t maxCycles, bool throttle, Rewind* rewind, const Turbo& turbo) {
+    FramePacer pacer;
+    MachineState previous;
+    bool fast = false;
+    Clock::time_point nextRefresh = Clock::now();
+    const std::chrono::nanoseconds refresh(1000000000 / Scheduler::FRAME_RATE);
 
-            SDL_LockTexture(texture, NULL, (void**) &bytes, &pitch);
+    if (rewind != nullptr) {
+        rewind->push(cpu);
+    }
+
+    bool keepOpen = true;
+    while (keepOpen && (maxCycles == 0 || scheduler.instructions < maxCycles)) {
+        keepOpen = input.poll(cpu.keys);
+
+        if (throttle && input.fastForward() != fast) {
+            fast = !fast;
+            pacer.setSpeed(fast ? turbo.speed : 1);
+            cpu.audio->setMuted(fast);
+        }
+        // unlimited turbo never waits on the pacer
+        bool paced = throttle && !(fast && turbo.speed == 0);
+
+        // only unlimited speed (hz 0) needs a deadline when not paced
+        Clock::time_point deadline = Clock::time_point::max();
+        if (paced) {
+            deadline = pacer.deadline();
+        } else if (scheduler.hz == 0) {
+            deadline = Clock::now() + refresh;
+        }
+        uint64_t limit = (maxCycles == 0) ? 0 : maxCycles - scheduler.instructions;
+        if (rewind != nullptr && input.rewinding()) {
+            if (rewind->back(previous)) {
+                // the keys are whatever is held now, not what was then
+                memcpy(previous.keys, cpu.keys, sizeof(previous.keys));
+                cpu.loadState(previous);
+            }
+        } else {
+            scheduler.runFrame(deadline, limit);
+            if (rewind != nullptr) {
+                rewind->push(cpu);
+            }
+        }
 
-            for (int y = 0; y < 32; y++) {
-                for (int x  = 0; x < 64; x++) {
-                    bytes[y * 64 + x] = (cpu.graphics[y * 64 + x] == 1) ? 0xFFFFFF : (uint32_t) 0x000000;
+        // skipped frames leave their rows dirty, the next presented one
+        // redraws everything that changed in between
+        bool show = true;
+        if (fast) {
+            if (turbo.frameSkip != 0) {
+                show = scheduler.frames % turbo.frameSkip == 0;
+            } else {
+                Clock::time_point now = Clock::now();
+                show = now >= nextRefresh;
+                if (show) {
+                    nextRefresh = now + refresh;
                 }
             }
+        }
+        if (show && cpu.frameDirty()) {
+            video.present(cpu, cpu.dirtyRows);
+            cpu.dirtyRows = 0;
+        }
 
-            SDL_UnlockTexture(texture);
+        if (keepOpen && paced && !fast && cpu.waitingForKey()) {
+            // nothing changes before a key goes down: sleep on the event
+            // queue instead of emulating idle frames
+            input.wait();
+            pacer.reset();
+        } else if (paced) {
+            pacer.wait();
+        }
+    }
 
-            SDL_RenderCopy(renderer, texture, NULL, NULL);
-            SDL_RenderPresent(renderer);
+    if (fast) {
+        cpu.audio->setMuted(false);
+    }
+}
+
+// Runs the machine with run() on a thread of its own while this thread, the
+// one the window and SDL's events belong to, forwards input to it through
+// queue and shows the newest frame it published. A slow present never holds
+// the machine up; the machine wakes this thread with frame events, at most
+// one pending at a time. input is queue, possibly wrapped in a recorder;
+// with framelogPath the frames presented are also recorded there.
+void runThreaded(Cpu& cpu, InputSource& input, QueuedInputSource& queue, Scheduler& scheduler, uint64_t maxCycles, Rewind* rewind, const Turbo& turbo, const char* framelogPath) {
+    TripleBuffer<Frame> frames;
+    FrameBufferSink video(frames, &queue);
+    FrameRecorder recorder(video);
+    if (framelogPath != NULL) {
+        recorder.open(framelogPath);
+    }
+    std::atomic<bool> running{true};
+    std::atomic<bool> framePending{false};
+    std::exception_ptr failure;
 
-            // sleep for 16 milliseconds for 16Hz
-            std::this_thread::sleep_for(std::chrono::milliseconds(16));
+    auto wake = [] {
+        SDL_Event e = {};
+        e.type = sdlVideo.frameEvent;
+        SDL_PushEvent(&e);
+    };
+    video.notify = [&] {
+        if (!framePending.exchange(true)) {
+            wake();
+        }
+    };
+
+    std::thread machine([&] {
+        try {
+            run(cpu, recorder, input, scheduler, maxCycles, true, rewind, turbo);
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        running = false;
+        wake();
+    });
+
+    SDL_Event e;
+    while (running) {
+        if (SDL_WaitEvent(&e) == 0) {
+            continue;
+        }
+        do {
+            if (e.type == sdlVideo.frameEvent) {
+                framePending = false;
+            } else {
+                forwardEvent(queue, e);
+            }
+        } while (SDL_PollEvent(&e) > 0);
+
+        if (frames.update()) {
+            sdlVideo.show(frames.read());
+        }
+    }
+    machine.join();
+    recorder.close(cpu);
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    sdlVideo.printLatency();
+}
+
+int main(int argc, char *argv[]) {
+    char* filename = NULL;
+    uint64_t maxCycles = 0;
+    Engine engine = Engine::Interpreter;
+    uint32_t hz = 700;
+    uint64_t seed = (uint64_t) time(0);
+    char* recordPath = NULL;
+    char* replayPath = NULL;
+    char* tracePath = NULL;
+    char* profilePath = NULL;
+    char* stacksPath = NULL;
+    char* framelogPath = NULL;
+    const char* romdbPath = "roms.txt";
+    const char* romindexPath = NULL;
+    bool hzForced = false;
+    bool fusion = true;
+    bool fusionStats = false;
+    Profile profile = Profile::Default;
+    bool profileForced = false;
+    Turbo turbo;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            maxCycles = std::stoull(argv[++i]);
+        } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+            hz = std::stoul(argv[++i]);
+            hzForced = true;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = std::stoull(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--stacks") == 0 && i + 1 < argc) {
+            stacksPath = argv[++i];
+        } else if (strcmp(argv[i], "--framelog") == 0 && i + 1 < argc) {
+            framelogPath = argv[++i];
+        } else if (strcmp(argv[i], "--no-fusion") == 0) {
+            fusion = false;
+        } else if (strcmp(argv[i], "--fusion-stats") == 0) {
+            fusionStats = true;
+        } else if (strcmp(argv[i], "--turbo") == 0 && i + 1 < argc) {
+            turbo.speed = std::stoul(argv[++i]);
+        } else if (strcmp(argv[i], "--frameskip") == 0 && i + 1 < argc) {
+            turbo.frameSkip = std::stoul(argv[++i]);
+        } else if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc) {
+            romdbPath = argv[++i];
+        } else if (strcmp(argv[i], "--romindex") == 0 && i + 1 < argc) {
+            romindexPath = argv[++i];
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            i++;
+            if (!parseProfile(argv[i], profile)) {
+                printf("Unknown quirks %s.\n", argv[i]);
+                exit(-1);
+            }
+            profileForced = true;
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (!parseEngine(argv[i], engine)) {
+                printf("Unknown engine %s.\n", argv[i]);
+                exit(-1);
+            }
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if (filename == NULL) {
+        printf("No ROM argument present.\n");
+        printf("usage: %s [--headless] [--cycles n] [--hz n] [--engine interpreter|cache|jit] [--quirks default|chip8|schip|xochip] [--romdb file] [--romindex file] [--seed n] [--turbo n] [--frameskip n] [--record log | --replay log] [--trace file] [--profile file] [--stacks file] [--framelog file] [--no-fusion] [--fusion-stats] rom\n", argv[0]);
+        exit(-1);
+    }
+
+    try {
+        InputReplay replay;
+        if (replayPath != NULL) {
+            // the log decides the run, played back headless as fast as possible
+            replay.open(replayPath);
+            seed = replay.seed;
+            hz = replay.hz;
+            hzForced = true;
+            profile = replay.profile;
+            profileForced = true;
+            headless = true;
+        }
+        if (recordPath != NULL && hz == 0) {
+            // unlimited speed depends on the host clock, it can't be replayed
+            throw std::runtime_error("CAN'T RECORD AT UNLIMITED SPEED.");
+        }
+
+        init();
+
+        size_t romSize = loadROM(cpu, filename);
+        chooseSettings(cpu, romSize, romdbPath, romindexPath, profileForced, profile, hzForced, hz);
+        cpu.setProfile(profile);
+        cpu.engine = engine;
+        cpu.setFusion(fusion);
+        cpu.seed(seed);
+
+        if (tracePath != NULL) {
+            tracer.open(tracePath);
+            cpu.tracer = &tracer;
+        }
+        if (profilePath != NULL || stacksPath != NULL) {
+            cpu.profiler = &profiler;
+        }
+
+        Scheduler scheduler(cpu, hz);
+
+        if (replayPath != NULL) {
+            NullVideoSink null;
+            FrameRecorder video(null);
+            if (framelogPath != NULL) {
+                video.open(framelogPath);
+            }
+            run(cpu, video, replay, scheduler, maxCycles, false, nullptr, turbo);
+            video.close(cpu);
+            printf("replayed %" PRIu64 " frames, %" PRIu64 " instructions, state %.16" PRIX64 "\n", scheduler.frames, scheduler.instructions, cpu.hash());
+        } else if (headless) {
+            NullVideoSink nullVideo;
+            FrameRecorder video(nullVideo);
+            if (framelogPath != NULL) {
+                video.open(framelogPath);
+            }
+            NullInputSource null;
+            InputRecorder input(null);
+            if (recordPath != NULL) {
+                input.open(recordPath, seed, hz, profile);
+            }
+            run(cpu, video, input, scheduler, maxCycles, false, nullptr, turbo);
+            input.close();
+            video.close(cpu);
+        } else {
+            QueuedInputSource queue;
+            InputRecorder input(queue);
+            Rewind rewind;
+            if (recordPath != NULL) {
+                // a rewound run has no linear history to record
+                input.open(recordPath, seed, hz, profile);
+            } else {
+                rewind.init(REWIND_BYTES, REWIND_FRAMES);
+            }
+            runThreaded(cpu, input, queue, scheduler, maxCycles, recordPath != NULL ? nullptr : &rewind, turbo, framelogPath);
+            input.close();
+        }
+
+        if (fusionStats) {
+            // times each kind of superinstruction ran
+            for (int f = 0; f < FUSIONS; f++) {
+                printf("[Fusion] %-10s %" PRIu64 "\n", fusionName((Fusion) f), cpu.fusionCounts[f]);
+            }
+        }
+        if (cpu.profiler != nullptr) {
+            profiler.finish(cpu);
+            writeProfile(profilePath, stacksPath);
         }
 
         // Close
@@ -0,0 +1,62 @@
+// Builds the binary ROM index (see romindex.h) of a ROM directory, for the
+// emulator's and batch's --romindex:
+//
+//   mkromindex [--romdb file] [--list] directory index
+//
+// Titles, quirk profiles and speeds come from the ROM database (roms.txt by
+// default). --list prints what went into the index.
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "romdb.h"
+#include "romindex.h"
+
+int main(int argc, char *argv[]) {
+    const char* romdbPath = "roms.txt";
+    const char* directory = NULL;
+    const char* indexPath = NULL;
+    bool list = false;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc) {
+                romdbPath = argv[++i];
+            } else if (strcmp(argv[i], "--list") == 0) {
+                list = true;
+            } else if (directory == NULL) {
+                directory = argv[i];
+            } else {
+                indexPath = argv[i];
+            }
+        }
+
+        if (indexPath == NULL) {
+            printf("usage: %s [--romdb file] [--list] directory index\n", argv[0]);
+            return -1;
+        }
+
+        RomDatabase database;
+        database.load(romdbPath);
+        size_t count = RomIndex::build(directory, database, indexPath);
+
+        if (list) {
+            RomIndex index;
+            index.open(indexPath);
+            for (uint32_t i = 0; i < index.capacity(); i++) {
+                const RomIndex::Slot& slot = index.slot(i);
+                if (slot.used) {
+                    printf("%.16" PRIx64 " %5" PRIu32 " %-7s %5" PRIu32 " %s\n", slot.hash, slot.size, profileName((Profile) slot.profile), slot.hz, slot.title);
+                }
+            }
+        }
+        printf("indexed %zu ROMs\n", count);
+    } catch (const std::runtime_error& error) {
+        fprintf(stderr, "%s\n", error.what());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,391 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+
+#include "cpu.h"
+#include "display.h"
+
+// Instruction semantics. Every engine (the interpreter switch, the decode
+// cache) runs these same bodies so they can never disagree; they are inline
+// so each engine gets them folded into its own dispatch. The ones that differ
+// between CHIP-8 variants take the quirk profile as a template parameter.
+
+inline void Cpu::clearScreen() { // 00E0 - CLS; clear screen
+    for (int plane = 0; plane < PLANES; plane++) {
+        if ((planes >> plane) & 1) {
+            for (int y = 0; y < MAX_HEIGHT; y++) {
+                if ((graphics[plane][y][0] | graphics[plane][y][1]) != 0) {
+                    graphics[plane][y][0] = 0;
+                    graphics[plane][y][1] = 0;
+                    dirtyRows |= (uint64_t) 1 << y;
+                }
+            }
+        }
+    }
+    incrementProgramCounter();
+}
+
+// Scrolls move whole rows with memmove and shift rows a word at a time, only
+// on the selected planes. Distances are in pixels of the current resolution.
+
+inline void Cpu::scrollDown(uint8_t n) { // 00Cn - SCD n; Scroll down n rows
+    const int height = screenHeight();
+    n = (n < height) ? n : height;
+    for (int plane = 0; plane < PLANES; plane++) {
+        if ((planes >> plane) & 1) {
+            memmove(graphics[plane][n], graphics[plane][0], (height - n) * sizeof(graphics[plane][0]));
+            memset(graphics[plane][0], 0, n * sizeof(graphics[plane][0]));
+        }
+    }
+    dirtyRows = ~(uint64_t) 0;
+    incrementProgramCounter();
+}
+
+inline void Cpu::scrollUp(uint8_t n) { // 00Dn - SCU n; Scroll up n rows
+    const int height = screenHeight();
+    n = (n < height) ? n : height;
+    for (int plane = 0; plane < PLANES; plane++) {
+        if ((planes >> plane) & 1) {
+            memmove(graphics[plane][0], graphics[plane][n], (height - n) * sizeof(graphics[plane][0]));
+            memset(graphics[plane][height - n], 0, n * sizeof(graphics[plane][0]));
+        }
+    }
+    dirtyRows = ~(uint64_t) 0;
+    incrementProgramCounter();
+}
+
+inline void Cpu::scrollRight() { // 00FB - SCR; Scroll right 4 pixels
+    for (int plane = 0; plane < PLANES; plane++) {
+        if ((planes >> plane) & 1) {
+            for (int y = 0; y < MAX_HEIGHT; y++) {
+                uint64_t* row = graphics[plane][y];
+                if (hires) {
+                    row[1] = (row[1] >> 4) | (row[0] << 60);
+                }
+                row[0] >>= 4;
+            }
+        }
+    }
+    dirtyRows = ~(uint64_t) 0;
+    incrementProgramCounter();
+}
+
+inline void Cpu::scrollLeft() { // 00FC - SCL; Scroll left 4 pixels
+    for (int plane = 0; plane < PLANES; plane++) {
+        if ((planes >> plane) & 1) {
+            for (int y = 0; y < MAX_HEIGHT; y++) {
+                uint64_t* row = graphics[plane][y];
+                row[0] <<= 4;
+                if (hires) {
+                    row[0] |= row[1] >> 60;
+                    row[1] <<= 4;
+                }
+            }
+        }
+    }
+    dirtyRows = ~(uint64_t) 0;
+    incrementProgramCounter();
+}
+
+inline void Cpu::lowRes() { // 00FE - LOW; 64x32 screen, cleared
+    hires = 0;
+    memset(graphics, 0, sizeof(graphics));
+    dirtyRows = ~(uint64_t) 0;
+    incrementProgramCounter();
+}
+
+inline void Cpu::highRes() { // 00FF - HIGH; 128x64 screen, cleared
+    hires = 1;
+    memset(graphics, 0, sizeof(graphics));
+    dirtyRows = ~(uint64_t) 0;
+    incrementProgramCounter();
+}
+
+inline void Cpu::returnFromSubroutine() { // 00EE - RET; return from subrutine
+    stackPointer--;
+    programCounter = stack[stackPointer & 0xF];
+    incrementProgramCounter();
+}
+
+inline void Cpu::jump(uint16_t nnn) { // 1nnn - JP addr; Jump to location nnn
+    if (nnn == programCounter || nnn + 4 == programCounter) {
+        idle = true;
+    }
+    programCounter = nnn;
+}
+
+inline void Cpu::call(uint16_t nnn) { // 2nnn - CALL addr; Call subroutine at nnn
+    stack[stackPointer & 0xF] = programCounter;
+    stackPointer++;
+    programCounter = nnn;
+}
+
+inline void Cpu::skipIfEqual(uint8_t x, uint8_t kk) { // 3xkk - SE Vx, byte; Skip next instruction if Vx == kkk
+    if (registers[x] == kk) {
+        incrementProgramCounter();
+    }
+    incrementProgramCounter();
+}
+
+inline void Cpu::skipIfNotEqual(uint8_t x, uint8_t kk) { // 4xkk - SNE Vx, byte; Skip next intruction if Vx != kk
+    if (registers[x] != kk) {
+        incrementProgramCounter();
+    }
+    incrementProgramCounter();
+}
+
+inline void Cpu::skipIfRegistersEqual(uint8_t x, uint8_t y) { // 5xy0 - SE Vx, Vy; Skip next instruction if Vx == Vy
+    if (registers[x] == registers[y]) {
+        incrementProgramCounter();
+    }
+    incrementProgramCounter();
+}
+
+inline void Cpu::loadByte(uint8_t x, uint8_t kk) { // 6xkk - LD Vx, byte; Set Vx = kk
+    registers[x] = kk;
+    incrementProgramCounter();
+}
+
+inline void Cpu::addByte(uint8_t x, uint8_t kk) { // 7xkk - ADD Vx, byte; Set Vx = Vx + kk
+    registers[x] += kk;
+    incrementProgramCounter();
+}
+
+inline void Cpu::loadRegister(uint8_t x, uint8_t y) { // 8xy0 - LD Vx, Vy; Set Vx = Vy
+    registers[x] = registers[y];
+    incrementProgramCounter();
+}
+
+inline void Cpu::orRegister(uint8_t x, uint8_t y) { // 8xy1 - OR Vx, Vy; Set Vx = Vx | Vy
+    registers[x] |= registers[y];
+    incrementProgramCounter();
+}
+
+inline void Cpu::andRegister(uint8_t x, uint8_t y) { // 8xy2 - AND Vx, Vy; Set Vx = Vx & Vy
+    registers[x] &= registers[y];
+    incrementProgramCounter();
+}
+
+inline void Cpu::xorRegister(uint8_t x, uint8_t y) { // 8xy3 - XOR Vx, Vy; Set Vx = Vx ^ Vy
+    registers[x] ^= registers[y];
+    incrementProgramCounter();
+}
+
+inline void Cpu::addRegister(uint8_t x, uint8_t y) { // 8xy4 - ADD Vx, Vy; Set Vx = Vx + Vy, Set Vf = carry
+    // type promotion to catch overflows
+    uint16_t sum = registers[x];
+    sum += registers[y];
+
+    registers[0xF] = (sum > 255) ? 1 : 0;
+    registers[x] = sum & 0x00FF;
+    incrementProgramCounter();
+}
+
+inline void Cpu::subRegister(uint8_t x, uint8_t y) { // 8xy5 - SUB Vx, Vy; Set Vx = Vx - Vy, set VF = NOT borrow
+    registers[0xF] = (registers[x] > registers[y]) ? 1 : 0;
+    registers[x] -= registers[y];
+    incrementProgramCounter();
+}
+
+template <typename Quirks>
+inline void Cpu::shiftRight(uint8_t x, uint8_t y) { // 8xy6 - SHR Vx {, Vy}; Set Vx = Vx SHR 1
+    uint8_t source = Quirks::shiftUsesVy ? y : x;
+    registers[0xF] = registers[source] & 1;
+    registers[x] = registers[source] >> 1;
+    incrementProgramCounter();
+}
+
+inline void Cpu::subnRegister(uint8_t x, uint8_t y) { // 8xy7 - SUBN Vx, Vy; Set Vx = Vy - Vx, set VF = NOT borrow
+    registers[0xF] = (registers[y] > registers[x]) ? 1 : 0;
+    registers[x] = registers[y] - registers[x];
+    incrementProgramCounter();
+}
+
+template <typename Quirks>
+inline void Cpu::shiftLeft(uint8_t x, uint8_t y) { // 8xyE - SHL Vx {, Vy}; Set Vx = Vx SHL 1
+    uint8_t source = Quirks::shiftUsesVy ? y : x;
+    registers[0xF] = ((registers[source] & 0x80) != 0) ? 1 : 0;
+    registers[x] = registers[source] << 1;
+    incrementProgramCounter();
+}
+
+inline void Cpu::skipIfRegistersNotEqual(uint8_t x, uint8_t y) { // 9xy0 - SE Vx, Vy; Skip next instruction if Vx != Vy
+    if ((uint8_t) registers[x] != (uint8_t) registers[y]) {
+        incrementProgramCounter();
+    }
+    incrementProgramCounter();
+}
+
+inline void Cpu::loadIndex(uint16_t nnn) { // Annn - LD I, addr; Set I = nnn
+    index = nnn;
+    incrementProgramCounter();
+}
+
+template <typename Quirks>
+inline void Cpu::jumpOffset(uint16_t nnn) { // Bnnn - JP V0, addr; Jump to nnn + V0
+    programCounter = nnn + (uint16_t) registers[Quirks::jumpUsesVx ? (nnn >> 8) : 0x0];
+}
+
+inline void Cpu::random(uint8_t x, uint8_t kk) { // Cxkk - RND Vx, byte; Set Vx = random byte & kk
+    registers[x] = nextRandom() & kk;
+    incrementProgramCounter();
+}
+
+inline uint8_t Cpu::nextRandom() { // xorshift64*, top byte of the product
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (uint8_t) ((rng * 0x2545F4914F6CDD1Dull) >> 56);
+}
+
+// Dxyn - DRW Vx, Vy, nibble; Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
+// Dxy0 draws a 16x16 sprite, two bytes per row. With several planes selected
+// each plane takes the next sprite's worth of bytes.
+template <typename Quirks>
+inline void Cpu::draw(uint8_t x, uint8_t y, uint8_t n) {
+    registers[0xF] = 0;
+    const int width = screenWidth();
+    const int height = screenHeight();
+    uint8_t regX = registers[x] & (width - 1);
+    uint8_t regY = registers[y] & (height - 1);
+
+    const int rows = (n == 0) ? 16 : n;
+    const int rowBytes = (n == 0) ? 2 : 1;
+    int visible = rows;
+    if (Quirks::clipSprites && regY + rows > height) {
+        visible = height - regY;
+    }
+
+    // each sprite row is rotated into place so it wraps around the screen
+    // edge, or shifted so it falls off it when clipping; a pixel collides
+    // when it was already set
+    uint64_t collision = 0;
+    uint16_t address = index;
+    for (int plane = 0; plane < PLANES; plane++) {
+        if (((planes >> plane) & 1) == 0) {
+            continue;
+        }
+
+        for (int i = 0; i < visible; i++) {
+            uint16_t at = address + i * rowBytes;
+            uint64_t line = (uint64_t) memory[at & 0xFFF] << 56;
+            if (rowBytes == 2) {
+                line |= (uint64_t) memory[(at + 1) & 0xFFF] << 48;
+            }
+            int y = (regY + i) & (height - 1);
+            uint64_t* row = graphics[plane][y];
+
+            uint64_t changed;
+            if (hires) {
+                uint64_t left, right;
+                placeWide(line, regX, Quirks::clipSprites, left, right);
+                collision |= (row[0] & left) | (row[1] & right);
+                row[0] ^= left;
+                row[1] ^= right;
+                changed = left | right;
+            } else {
+                uint64_t sprite = Quirks::clipSprites ? line >> regX : rotateRight(line, regX);
+                collision |= row[0] & sprite;
+                row[0] ^= sprite;
+                changed = sprite;
+            }
+            if (changed != 0) {
+                dirtyRows |= (uint64_t) 1 << y;
+            }
+        }
+        address += rows * rowBytes;
+    }
+
+    registers[0xF] = (collision != 0) ? 1 : 0;
+    incrementProgramCounter();
+}
+
+inline void Cpu::skipIfKey(uint8_t x) { // Ex9E - SKP Vx; Skip next instruction if key with the value of Vx is pressed
+    if(keys[registers[x] & 0xF] == 1) {
+        incrementProgramCounter();
+    }
+    incrementProgramCounter();
+}
+
+inline void Cpu::skipIfNotKey(uint8_t x) { // ExA1 - SKNP Vx; Skip next instruction if key with the value of Vx is not pressed
+    if(keys[registers[x] & 0xF] != 1) {
+        incrementProgramCounter();
+    }
+    incrementProgramCounter();
+}
+
+inline void Cpu::selectPlanes(uint8_t x) { // Fn01 - PLANE n; Draw, scroll and clear on planes n
+    planes = x;
+    incrementProgramCounter();
+}
+
+inline void Cpu::loadDelay(uint8_t x) { // Fx07 - LD Vx, DT; Set Vx = delay timer value
+    registers[x] = delayTimer;
+    incrementProgramCounter();
+}
+
+inline void Cpu::waitKey(uint8_t x) { // Fx0A - LD Vx, K; Wait for a key press, store the value of the key in Vx
+    uint8_t i = 0;
+    for (uint8_t key: keys) {
+        if(key != 0) {
+            registers[x] = i;
+            incrementProgramCounter();
+            return;
+        }
+        i++;
+    }
+    // no key yet: leave the program counter alone so this runs again
+    idle = true;
+}
+
+inline void Cpu::setDelay(uint8_t x) { // Fx15 - LD DT, Vx; Set delay timer = Vx
+    delayTimer = registers[x];
+    incrementProgramCounter();
+}
+
+inline void Cpu::setSound(uint8_t x) { // Fx18 - LD ST, Vx; Set sound timer = Vx
+    soundTimer = registers[x];
+    incrementProgramCounter();
+}
+
+inline void Cpu::addIndex(uint8_t x) { // Fx1E - ADD I, Vx; Set I = I + Vx
+    index += registers[x];
+    incrementProgramCounter();
+}
+
+inline void Cpu::loadFont(uint8_t x) { // Fx29 - LD F, Vx; Set I = location of sprite for digit Vx
+    index = registers[x] * 0x5;
+    incrementProgramCounter();
+}
+
+inline void Cpu::storeBcd(uint8_t x) { // Fx33 - LD B, Vx; Store BCD representation of Vx in memory locations I, I+1, and I+2
+    memory[index & 0xFFF] = registers[x] / 100;
+    memory[(index + 1) & 0xFFF] = (registers[x] / 10) % 10;
+    memory[(index + 2) & 0xFFF] = registers[x] % 10;
+    invalidate(index, 3);
+    incrementProgramCounter();
+}
+
+template <typename Quirks>
+inline void Cpu::storeRegisters(uint8_t x) { // Fx55 - LD [I], Vx; Store registers V0 through Vx in memory starting at location I
+    for (uint8_t i = 0; i <= x; i++) {
+        memory[(index + i) & 0xFFF] = registers[i];
+    }
+    invalidate(index, x + 1);
+    if (Quirks::memoryMovesIndex) {
+        index += x + 1;
+    }
+    incrementProgramCounter();
+}
+
+template <typename Quirks>
+inline void Cpu::loadRegisters(uint8_t x) { // Fx65 - LD Vx, [I]; Read registers V0 through Vx from memory starting at location I
+    for (uint8_t i = 0; i <= x; i++) {
+        registers[i] = memory[(index + i) & 0xFFF];
+    }
+    if (Quirks::memoryMovesIndex) {
+        index += x + 1;
+    }
+    incrementProgramCounter();
+}
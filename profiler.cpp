@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "profiler.h"
+
+// opcode classes, in the order the report lists them
+static const char* const CLASS_NAMES[] = {
+    "00E0 CLS", "00EE RET", "00Cn SCD", "00Dn SCU", "00FB SCR", "00FC SCL", "00FE LOW", "00FF HIGH", "0nnn SYS",
+    "1nnn JP", "2nnn CALL", "3xkk SE", "4xkk SNE", "5xy0 SE", "6xkk LD", "7xkk ADD",
+    "8xy0 LD", "8xy1 OR", "8xy2 AND", "8xy3 XOR", "8xy4 ADD", "8xy5 SUB", "8xy6 SHR", "8xy7 SUBN", "8xyE SHL", "8xy? (none)",
+    "9xy0 SNE", "Annn LD I", "Bnnn JP V0", "Cxkk RND", "Dxyn DRW", "Ex9E SKP", "ExA1 SKNP", "Ex?? (none)",
+    "Fn01 PLANE", "Fx07 LD Vx, DT", "Fx0A LD Vx, K", "Fx15 LD DT", "Fx18 LD ST", "Fx1E ADD I", "Fx29 LD F", "Fx33 LD B",
+    "Fx55 LD [I]", "Fx65 LD Vx, [I]", "Fx?? (none)"
+};
+
+static const int CLASSES = sizeof(CLASS_NAMES) / sizeof(CLASS_NAMES[0]);
+
+static int classify(uint16_t opcode) {
+    uint8_t kk = opcode & 0xFF;
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00E0) return 0;
+            if (opcode == 0x00EE) return 1;
+            if ((opcode & 0xFFF0) == 0x00C0) return 2;
+            if ((opcode & 0xFFF0) == 0x00D0) return 3;
+            if (opcode == 0x00FB) return 4;
+            if (opcode == 0x00FC) return 5;
+            if (opcode == 0x00FE) return 6;
+            if (opcode == 0x00FF) return 7;
+            return 8;
+        case 0x8:
+            switch (opcode & 0xF) {
+                case 0x0: case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x6: case 0x7:
+                    return 16 + (opcode & 0xF);
+                case 0xE: return 24;
+                default: return 25;
+            }
+        case 0xE:
+            if (kk == 0x9E) return 31;
+            if (kk == 0xA1) return 32;
+            return 33;
+        case 0xF:
+            switch (kk) {
+                case 0x01: return 34;
+                case 0x07: return 35;
+                case 0x0A: return 36;
+                case 0x15: return 37;
+                case 0x18: return 38;
+                case 0x1E: return 39;
+                case 0x29: return 40;
+                case 0x33: return 41;
+                case 0x55: return 42;
+                case 0x65: return 43;
+                default: return 44;
+            }
+        case 0x9: return 26;
+        default:
+            // 1nnn to 7xkk are 9 to 15, Annn to Dxyn 27 to 30
+            return (opcode >> 12) < 0x9 ? 8 + (opcode >> 12) : 17 + (opcode >> 12);
+    }
+}
+
+Profiler::Profiler() {
+    static_assert(CLASSES <= 64, "classCounts holds every class");
+    for (int opcode = 0; opcode < 65536; opcode++) {
+        classOf[opcode] = classify(opcode);
+    }
+    clear();
+}
+
+void Profiler::clear() {
+    frames.assign(1, Frame{ 0, 0x200, 0, 0 });
+    children.clear();
+    current = 0;
+    unpushed = 0;
+    calls.clear();
+    drawPending = false;
+
+    instructions = 0;
+    memset(pcCounts, 0, sizeof(pcCounts));
+    memset(pcOpcodes, 0, sizeof(pcOpcodes));
+    memset(classCounts, 0, sizeof(classCounts));
+    timerWaits = 0;
+    keyWaits = 0;
+    sprites = 0;
+    spritePixels = 0;
+    collisions = 0;
+}
+
+void Profiler::call(uint16_t site, uint16_t target) {
+    calls[(uint32_t) site << 16 | target]++;
+
+    // calls that never return (the stack pointer just wraps) would grow the
+    // tree for good, past MAX_DEPTH they stay in their caller
+    if (frames[current].depth >= MAX_DEPTH) {
+        unpushed++;
+        return;
+    }
+    uint64_t key = (uint64_t) current << 16 | target;
+    auto found = children.find(key);
+    if (found != children.end()) {
+        current = found->second;
+        return;
+    }
+    frames.push_back(Frame{ current, target, (uint16_t) (frames[current].depth + 1), 0 });
+    current = frames.size() - 1;
+    children[key] = current;
+}
+
+// Sprite pixels are the set bits of the sprite data, on every selected plane,
+// before any clipping.
+void Profiler::draw(const Cpu& cpu, uint16_t opcode) {
+    uint8_t n = opcode & 0xF;
+    int bytes = (n == 0) ? 32 : n;
+    int planes = __builtin_popcount(cpu.planes & 0xF);
+
+    for (int i = 0; i < bytes * planes; i++) {
+        spritePixels += __builtin_popcount(cpu.memory[(cpu.index + i) & 0xFFF]);
+    }
+    sprites++;
+    drawPending = true;
+}
+
+// Fx07 at the top of a poll loop (Fx07; 3xkk or 4xkk; 1nnn back, see
+// Cpu::skipIdle) counts the loop's instructions, 2 for the pass that leaves.
+void Profiler::wait(const Cpu& cpu, uint16_t opcode) {
+    if ((opcode & 0xFF) == 0x0A) {
+        for (uint8_t key: cpu.keys) {
+            if (key != 0) {
+                return;
+            }
+        }
+        keyWaits++;
+        return;
+    }
+
+    uint16_t pc = cpu.programCounter & 0xFFF;
+    uint8_t x = (opcode >> 8) & 0xF;
+    uint16_t test = (cpu.memory[(pc + 2) & 0xFFF] << 8) | cpu.memory[(pc + 3) & 0xFFF];
+    uint16_t back = (cpu.memory[(pc + 4) & 0xFFF] << 8) | cpu.memory[(pc + 5) & 0xFFF];
+    if (back != (0x1000 | pc) || ((test >> 8) & 0xF) != x) {
+        return;
+    }
+
+    uint8_t kk = test & 0xFF;
+    if ((test >> 12) == 0x3) {
+        timerWaits += (cpu.delayTimer != kk) ? 3 : 2;
+    } else if ((test >> 12) == 0x4) {
+        timerWaits += (cpu.delayTimer == kk) ? 3 : 2;
+    }
+}
+
+void Profiler::finish(const Cpu& cpu) {
+    if (drawPending) {
+        collisions += cpu.registers[0xF];
+        drawPending = false;
+    }
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole != 0 ? 100.0 * part / whole : 0.0;
+}
+
+void Profiler::writeReport(FILE* file, int top) const {
+    fprintf(file, "instructions          %" PRIu64 "\n", instructions);
+    fprintf(file, "delay timer polling   %" PRIu64 " (%.1f%%)\n", timerWaits, percent(timerWaits, instructions));
+    fprintf(file, "key waits             %" PRIu64 " (%.1f%%)\n", keyWaits, percent(keyWaits, instructions));
+    fprintf(file, "sprites               %" PRIu64 ", %" PRIu64 " pixels, %" PRIu64 " with collisions\n", sprites, spritePixels, collisions);
+
+    fprintf(file, "\nopcodes\n");
+    for (int c = 0; c < CLASSES; c++) {
+        if (classCounts[c] != 0) {
+            fprintf(file, "  %14" PRIu64 " %5.1f%%  %s\n", classCounts[c], percent(classCounts[c], instructions), CLASS_NAMES[c]);
+        }
+    }
+
+    std::vector<uint16_t> hot;
+    for (int pc = 0; pc < 4096; pc++) {
+        if (pcCounts[pc] != 0) {
+            hot.push_back(pc);
+        }
+    }
+    std::sort(hot.begin(), hot.end(), [this](uint16_t a, uint16_t b) {
+        return pcCounts[a] > pcCounts[b] || (pcCounts[a] == pcCounts[b] && a < b);
+    });
+    if ((int) hot.size() > top) {
+        hot.resize(top);
+    }
+    fprintf(file, "\nhot spots\n");
+    for (uint16_t pc: hot) {
+        fprintf(file, "  %.3X  %.4X  %14" PRIu64 " %5.1f%%\n", pc, pcOpcodes[pc], pcCounts[pc], percent(pcCounts[pc], instructions));
+    }
+
+    std::vector<std::pair<uint32_t, uint64_t>> sites(calls.begin(), calls.end());
+    std::sort(sites.begin(), sites.end(), [](const std::pair<uint32_t, uint64_t>& a, const std::pair<uint32_t, uint64_t>& b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    fprintf(file, "\ncall sites\n");
+    for (const auto& site: sites) {
+        fprintf(file, "  %.3X -> %.3X  %14" PRIu64 "\n", site.first >> 16, site.first & 0xFFF, site.second);
+    }
+}
+
+void Profiler::writeCollapsed(FILE* file) const {
+    for (size_t f = 0; f < frames.size(); f++) {
+        if (frames[f].self == 0) {
+            continue;
+        }
+        // build the path leaf first, print it root first
+        std::vector<uint16_t> path;
+        for (uint32_t at = f; ; at = frames[at].parent) {
+            path.push_back(frames[at].address);
+            if (at == 0) {
+                break;
+            }
+        }
+        std::string line;
+        char name[16];
+        for (auto address = path.rbegin(); address != path.rend(); ++address) {
+            snprintf(name, sizeof(name), "%ssub_%.3X", line.empty() ? "" : ";", *address);
+            line += name;
+        }
+        fprintf(file, "%s %" PRIu64 "\n", line.c_str(), frames[f].self);
+    }
+}
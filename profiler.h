@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+#include "cpu.h"
+
+// Counts what a ROM spends its instructions on: executions per address and
+// per kind of opcode, the call tree through 2nnn/00EE, instructions spent
+// polling the delay timer or waiting for a key, and sprite drawing. It runs
+// as a stepping hook policy (see trace.h), so a machine without a profiler
+// carries none of it.
+class Profiler {
+    private:
+        // a function in the call tree, entered through 2nnn from its parent
+        struct Frame {
+            uint32_t parent;
+            uint16_t address;
+            uint16_t depth;
+            // instructions executed in this function itself
+            uint64_t self;
+        };
+
+        static const int MAX_DEPTH = 64;
+
+        uint8_t classOf[65536];
+
+        std::vector<Frame> frames;
+        // child frame by parent << 16 | address
+        std::unordered_map<uint64_t, uint32_t> children;
+        uint32_t current = 0;
+        // calls past MAX_DEPTH that stayed in current; their 00EE stay too
+        uint64_t unpushed = 0;
+        // times each 2nnn ran, by site << 16 | target
+        std::unordered_map<uint32_t, uint64_t> calls;
+
+        // the last instruction was a Dxyn, VF now holds its collision flag
+        bool drawPending = false;
+
+        void call(uint16_t site, uint16_t target);
+        void draw(const Cpu& cpu, uint16_t opcode);
+        void wait(const Cpu& cpu, uint16_t opcode);
+
+    public:
+        uint64_t instructions = 0;
+        uint64_t pcCounts[4096];
+        // the opcode last seen at each address
+        uint16_t pcOpcodes[4096];
+        uint64_t classCounts[64];
+        // Fx07 polling loops and Fx0A with no key down
+        uint64_t timerWaits = 0;
+        uint64_t keyWaits = 0;
+        uint64_t sprites = 0;
+        uint64_t spritePixels = 0;
+        uint64_t collisions = 0;
+
+        Profiler();
+
+        void clear();
+
+        // counts the instruction cpu is about to execute
+        void count(const Cpu& cpu) {
+            uint16_t pc = cpu.programCounter & 0xFFF;
+            uint16_t opcode = (cpu.memory[pc] << 8) | cpu.memory[(pc + 1) & 0xFFF];
+
+            if (drawPending) {
+                collisions += cpu.registers[0xF];
+                drawPending = false;
+            }
+
+            instructions++;
+            pcCounts[pc]++;
+            pcOpcodes[pc] = opcode;
+            classCounts[classOf[opcode]]++;
+            frames[current].self++;
+
+            switch (opcode >> 12) {
+                case 0x0:
+                    if (opcode == 0x00EE && unpushed != 0) {
+                        unpushed--;
+                    } else if (opcode == 0x00EE && current != 0) {
+                        current = frames[current].parent;
+                    }
+                    break;
+                case 0x2:
+                    call(pc, opcode & 0x0FFF);
+                    break;
+                case 0xD:
+                    draw(cpu, opcode);
+                    break;
+                case 0xF:
+                    if ((opcode & 0xFF) == 0x07 || (opcode & 0xFF) == 0x0A) {
+                        wait(cpu, opcode);
+                    }
+                    break;
+            }
+        }
+
+        // picks up the collision flag of a draw that ran last
+        void finish(const Cpu& cpu);
+
+        // a readable summary, the hottest `top` addresses in it
+        void writeReport(FILE* file, int top = 32) const;
+        // one line per call stack and its instruction count, the collapsed
+        // format flame graph tools read
+        void writeCollapsed(FILE* file) const;
+};
+
+struct ProfileHooks {
+    static constexpr bool stepping = true;
+    static void before(Cpu& cpu) {
+        cpu.profiler->count(cpu);
+    }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+// Behaviors that differ between CHIP-8 implementations, one struct per
+// profile. They are template parameters of the run loop and of the ops that
+// depend on them, so every profile gets its own interpreter with the choices
+// folded in instead of flags tested on every instruction.
+//
+//   shiftUsesVy        8xy6/8xyE shift Vy into Vx instead of Vx in place
+//   memoryMovesIndex   Fx55/Fx65 leave index at I + x + 1
+//   jumpUsesVx         Bxnn jumps to xnn + Vx instead of nnn + V0
+//   clipSprites        Dxyn clips at the screen edges instead of wrapping
+//                      (the starting position always wraps)
+
+enum class Profile {
+    Default,   // what this emulator always did
+    Chip8,     // the COSMAC VIP interpreter
+    SuperChip, // SUPER-CHIP 1.1 on the HP 48
+    XoChip     // XO-CHIP
+};
+
+struct DefaultQuirks {
+    static constexpr bool shiftUsesVy = false;
+    static constexpr bool memoryMovesIndex = false;
+    static constexpr bool jumpUsesVx = false;
+    static constexpr bool clipSprites = false;
+};
+
+struct Chip8Quirks {
+    static constexpr bool shiftUsesVy = true;
+    static constexpr bool memoryMovesIndex = true;
+    static constexpr bool jumpUsesVx = false;
+    static constexpr bool clipSprites = true;
+};
+
+struct SuperChipQuirks {
+    static constexpr bool shiftUsesVy = false;
+    static constexpr bool memoryMovesIndex = false;
+    static constexpr bool jumpUsesVx = true;
+    static constexpr bool clipSprites = true;
+};
+
+struct XoChipQuirks {
+    static constexpr bool shiftUsesVy = true;
+    static constexpr bool memoryMovesIndex = true;
+    static constexpr bool jumpUsesVx = false;
+    static constexpr bool clipSprites = false;
+};
+
+// Calls visit with a value of the quirk struct for profile, the one place a
+// runtime profile turns into a type.
+template <typename Visitor>
+auto withQuirks(Profile profile, Visitor&& visit) {
+    switch (profile) {
+        case Profile::Chip8: return visit(Chip8Quirks());
+        case Profile::SuperChip: return visit(SuperChipQuirks());
+        case Profile::XoChip: return visit(XoChipQuirks());
+        default: return visit(DefaultQuirks());
+    }
+}
+
+// "default", "chip8", "schip" or "xochip"; false for anything else
+bool parseProfile(const char* name, Profile& profile);
+const char* profileName(Profile profile);
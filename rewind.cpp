@@ -0,0 +1,147 @@
+#include <cstring>
+
+#include "rewind.h"
+
+// Delta encoding, one token after another:
+//   0xxxxxxx yyyyyyyy  skip 1 + x:y unchanged bytes (up to 32768)
+//   1nnnnnnn ...       1 + n changed bytes follow, XORed with the old value
+// Unchanged bytes at the end of the state get no token.
+static const size_t MAX_SKIP = 32768;
+static const size_t MAX_LITERAL = 128;
+
+static uint64_t load64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+void Rewind::init(size_t bytes, size_t frames) {
+    buffer.assign(bytes, 0);
+    entries.assign(frames, Entry{ 0, 0 });
+    clear();
+}
+
+void Rewind::clear() {
+    writePos = 0;
+    first = 0;
+    count = 0;
+    used = 0;
+    hasLatest = false;
+}
+
+void Rewind::dropOldest() {
+    used -= entries[first].length;
+    first = (first + 1) % entries.size();
+    count--;
+}
+
+uint32_t Rewind::encode(const uint8_t* previous, const uint8_t* current) {
+    const size_t size = sizeof(MachineState);
+    uint8_t* out = scratch;
+    size_t i = 0;
+
+    while (i < size) {
+        // most of the machine doesn't change, skip it a word at a time
+        size_t start = i;
+        while (i + 8 <= size && load64(previous + i) == load64(current + i)) {
+            i += 8;
+        }
+        while (i < size && previous[i] == current[i]) {
+            i++;
+        }
+        if (i == size) {
+            break;
+        }
+
+        size_t skip = i - start;
+        while (skip > 0) {
+            size_t run = skip < MAX_SKIP ? skip : MAX_SKIP;
+            *out++ = (uint8_t) ((run - 1) >> 8);
+            *out++ = (uint8_t) (run - 1);
+            skip -= run;
+        }
+
+        uint8_t* header = out++;
+        start = i;
+        while (i < size && i - start < MAX_LITERAL && previous[i] != current[i]) {
+            *out++ = previous[i] ^ current[i];
+            i++;
+        }
+        *header = (uint8_t) (0x80 | (i - start - 1));
+    }
+
+    return (uint32_t) (out - scratch);
+}
+
+void Rewind::push(const MachineState& state) {
+    if (!hasLatest || entries.empty()) {
+        memcpy(&latest, &state, sizeof(MachineState));
+        hasLatest = true;
+        return;
+    }
+
+    uint32_t length = encode((const uint8_t*) &latest, (const uint8_t*) &state);
+    memcpy(&latest, &state, sizeof(MachineState));
+
+    if (length > buffer.size()) {
+        // can't hold even one step, the history restarts from here
+        writePos = 0;
+        count = 0;
+        used = 0;
+        return;
+    }
+
+    if (count == entries.size()) {
+        dropOldest();
+    }
+
+    size_t pos = writePos;
+    if (pos + length > buffer.size()) {
+        // the entries between writePos and the end are the oldest ones
+        while (count > 0 && entries[first].offset >= writePos) {
+            dropOldest();
+        }
+        pos = 0;
+    }
+    while (count > 0 && entries[first].offset < pos + length && pos < entries[first].offset + entries[first].length) {
+        dropOldest();
+    }
+
+    memcpy(buffer.data() + pos, scratch, length);
+    entries[(first + count) % entries.size()] = Entry{ pos, length };
+    count++;
+    used += length;
+    writePos = pos + length;
+}
+
+bool Rewind::back(MachineState& state) {
+    if (count == 0) {
+        return false;
+    }
+
+    const Entry& entry = entries[(first + count - 1) % entries.size()];
+    const uint8_t* in = buffer.data() + entry.offset;
+    const uint8_t* end = in + entry.length;
+    uint8_t* target = (uint8_t*) &latest;
+
+    while (in < end) {
+        uint8_t token = *in++;
+        if (token & 0x80) {
+            size_t run = (token & 0x7F) + 1;
+            for (size_t i = 0; i < run; i++) {
+                target[i] ^= in[i];
+            }
+            target += run;
+            in += run;
+        } else {
+            target += (((size_t) token << 8) | *in++) + 1;
+        }
+    }
+
+    writePos = entry.offset;
+    used -= entry.length;
+    count--;
+
+    memcpy(&state, &latest, sizeof(MachineState));
+    return true;
+}
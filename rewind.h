@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <vector>
+
+#include "cpu.h"
+
+// Rewind history. Every pushed snapshot is stored as the XOR against the one
+// before it, run-length encoded: a frame usually changes a few registers,
+// timers and rows, so an entry is tens of bytes instead of a whole machine.
+// Only the newest snapshot is kept in full; stepping back decodes the newest
+// delta into it. When the buffer fills up the oldest entries are dropped.
+class Rewind {
+    private:
+        struct Entry {
+            size_t offset;
+            uint32_t length;
+        };
+
+        // byte ring the encoded deltas live in; an entry never wraps, it
+        // starts over at 0 when it doesn't fit before the end
+        std::vector<uint8_t> buffer;
+        size_t writePos = 0;
+
+        // entry ring, oldest first
+        std::vector<Entry> entries;
+        size_t first = 0;
+        size_t count = 0;
+        size_t used = 0;
+
+        MachineState latest;
+        bool hasLatest = false;
+
+        // worst case encoding of one delta: every other byte changed, each
+        // byte then costs a literal header or half a skip token
+        uint8_t scratch[2 * sizeof(MachineState) + 16];
+
+        void dropOldest();
+        uint32_t encode(const uint8_t* previous, const uint8_t* current);
+
+    public:
+        // bytes of delta storage and the most frames kept
+        void init(size_t bytes, size_t frames);
+        void clear();
+
+        // records the state reached at the end of a frame
+        void push(const MachineState& state);
+
+        // steps back one frame: state becomes the snapshot pushed before the
+        // newest one, which is then forgotten. False when there is none.
+        bool back(MachineState& state);
+
+        size_t frames() const {
+            return count;
+        }
+
+        // delta bytes currently stored
+        size_t bytes() const {
+            return used;
+        }
+};
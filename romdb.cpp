@@ -0,0 +1,99 @@
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "romdb.h"
+#include "hash.h"
+
+static const struct {
+    const char* name;
+    Profile profile;
+} PROFILES[] = {
+    { "default", Profile::Default },
+    { "chip8", Profile::Chip8 },
+    { "schip", Profile::SuperChip },
+    { "xochip", Profile::XoChip }
+};
+
+bool parseProfile(const char* name, Profile& profile) {
+    for (const auto& p: PROFILES) {
+        if (strcmp(name, p.name) == 0) {
+            profile = p.profile;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* profileName(Profile profile) {
+    for (const auto& p: PROFILES) {
+        if (p.profile == profile) {
+            return p.name;
+        }
+    }
+    return "default";
+}
+
+bool RomDatabase::load(const char* path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string hash, profile;
+        if (!(fields >> hash) || hash[0] == '#') {
+            continue;
+        }
+
+        Entry entry;
+        if (!(fields >> profile) || !parseProfile(profile.c_str(), entry.profile)) {
+            throw std::runtime_error("INVALID ROM DATABASE LINE: " + line);
+        }
+        std::getline(fields >> std::ws, entry.name);
+
+        // an optional speed before the title, as in "1000hz"
+        entry.hz = 0;
+        size_t digits = 0;
+        while (digits < entry.name.size() && isdigit((unsigned char) entry.name[digits])) {
+            digits++;
+        }
+        if (digits > 0 && entry.name.compare(digits, 2, "hz") == 0 && (digits + 2 == entry.name.size() || isspace((unsigned char) entry.name[digits + 2]))) {
+            entry.hz = strtoul(entry.name.c_str(), NULL, 10);
+            entry.name.erase(0, digits + 2);
+            entry.name.erase(0, entry.name.find_first_not_of(" \t"));
+        }
+
+        char* end;
+        uint64_t key = strtoull(hash.c_str(), &end, 16);
+        if (*end != '\0') {
+            throw std::runtime_error("INVALID ROM DATABASE LINE: " + line);
+        }
+        entries[key] = entry;
+    }
+    return true;
+}
+
+bool RomDatabase::lookup(uint64_t hash, Profile& profile, std::string& name) const {
+    auto found = entries.find(hash);
+    if (found == entries.end()) {
+        return false;
+    }
+    profile = found->second.profile;
+    name = found->second.name;
+    return true;
+}
+
+const RomDatabase::Entry* RomDatabase::find(uint64_t hash) const {
+    auto found = entries.find(hash);
+    return (found == entries.end()) ? nullptr : &found->second;
+}
+
+uint64_t RomDatabase::hashRom(const uint8_t* rom, size_t size) {
+    return fnv1a(rom, size);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+#include "quirks.h"
+
+// ROM database: which quirk profile each known ROM needs, and optionally the
+// speed it plays best at. It is a text file, one ROM per line, keyed by the
+// FNV-1a hash of the ROM image:
+//
+//   # comment
+//   9b1ad8c9e5a1f6a3 schip Some Game (1991)
+//   04b1b5a2e9c8d7f6 xochip 1000hz Another Game
+//
+// ROMs that aren't listed run with the default profile.
+class RomDatabase {
+    public:
+        struct Entry {
+            Profile profile;
+            // instructions per second, 0 when not listed
+            uint32_t hz;
+            std::string name;
+        };
+
+    private:
+        std::unordered_map<uint64_t, Entry> entries;
+
+    public:
+        // false when the file can't be read; malformed lines are an error
+        bool load(const char* path);
+
+        // the profile and title for a ROM, false when it isn't listed
+        bool lookup(uint64_t hash, Profile& profile, std::string& name) const;
+        // the whole entry, null when the ROM isn't listed
+        const Entry* find(uint64_t hash) const;
+
+        static uint64_t hashRom(const uint8_t* rom, size_t size);
+};
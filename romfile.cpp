@@ -0,0 +1,50 @@
+#include <stdexcept>
+#include <string>
+
+#include "romfile.h"
+#include "cpu.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void RomFile::open(const char* path) {
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("ROM OPEN FAILED: ") + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        ::close(fd);
+        throw std::runtime_error(std::string("ROM OPEN FAILED: ") + path);
+    }
+    if ((size_t) info.st_size > MAX_PROGRAM) {
+        ::close(fd);
+        throw std::runtime_error(std::string("ROM TOO LARGE: ") + path);
+    }
+
+    length = info.st_size;
+    if (length > 0) {
+        void* address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            ::close(fd);
+            length = 0;
+            throw std::runtime_error(std::string("ROM MAP FAILED: ") + path);
+        }
+        mapped = address;
+    }
+    // the mapping outlives the descriptor
+    ::close(fd);
+}
+
+void RomFile::close() {
+    if (mapped != nullptr) {
+        munmap(mapped, length);
+        mapped = nullptr;
+    }
+    length = 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+
+// A ROM image mapped read-only from its file, so loading it into a machine
+// is the one copy Cpu::loadProgram makes. The size is checked against
+// MAX_PROGRAM before anything is mapped.
+class RomFile {
+    private:
+        void* mapped = nullptr;
+        size_t length = 0;
+
+    public:
+        RomFile() = default;
+        RomFile(const RomFile&) = delete;
+        RomFile& operator=(const RomFile&) = delete;
+        ~RomFile() {
+            close();
+        }
+
+        // throws when the file can't be opened or is too large to load
+        void open(const char* path);
+        void close();
+
+        // null for an empty file
+        const uint8_t* data() const {
+            return (const uint8_t*) mapped;
+        }
+        size_t size() const {
+            return length;
+        }
+};
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "romindex.h"
+#include "romfile.h"
+#include "cpu.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = { 'E', '8', 'R', 'O', 'M', 'I', 'D', 'X' };
+static const uint32_t VERSION = 1;
+
+static_assert(sizeof(RomIndex::Slot) == 64, "a slot is one cache line");
+
+bool RomIndex::open(const char* path) {
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    length = info.st_size;
+    if (length >= sizeof(Header)) {
+        void* address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        mapped = (address == MAP_FAILED) ? nullptr : address;
+    }
+    ::close(fd);
+
+    const Header* header = (const Header*) mapped;
+    if (header == nullptr || memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION
+            || header->slots == 0 || (header->slots & (header->slots - 1)) != 0
+            || length != sizeof(Header) + (size_t) header->slots * sizeof(Slot)) {
+        close();
+        throw std::runtime_error(std::string("INVALID ROM INDEX: ") + path);
+    }
+
+    slots = (const Slot*) (header + 1);
+    mask = header->slots - 1;
+    return true;
+}
+
+void RomIndex::close() {
+    if (mapped != nullptr) {
+        munmap(mapped, length);
+        mapped = nullptr;
+    }
+    length = 0;
+    slots = nullptr;
+    mask = 0;
+}
+
+const RomIndex::Slot* RomIndex::find(uint64_t hash) const {
+    if (slots == nullptr) {
+        return nullptr;
+    }
+    // never full, so the probe ends on an unused slot
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        if (!slots[i].used) {
+            return nullptr;
+        }
+        if (slots[i].hash == hash) {
+            return &slots[i];
+        }
+    }
+}
+
+size_t RomIndex::build(const char* directory, const RomDatabase& database, const char* path) {
+    DIR* dir = opendir(directory);
+    if (dir == NULL) {
+        throw std::runtime_error(std::string("ROM DIRECTORY OPEN FAILED: ") + directory);
+    }
+    // sorted, so the same directory always gives the same index
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    std::vector<Slot> roms;
+    for (const std::string& name: names) {
+        std::string file = std::string(directory) + "/" + name;
+        struct stat info;
+        if (stat(file.c_str(), &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0 || (size_t) info.st_size > MAX_PROGRAM) {
+            continue;
+        }
+
+        RomFile rom;
+        rom.open(file.c_str());
+
+        Slot slot = {};
+        slot.hash = RomDatabase::hashRom(rom.data(), rom.size());
+        slot.size = rom.size();
+        slot.used = 1;
+
+        std::string title = name.substr(0, name.rfind('.'));
+        const RomDatabase::Entry* known = database.find(slot.hash);
+        if (known != nullptr) {
+            slot.profile = (uint8_t) known->profile;
+            slot.hz = known->hz;
+            if (!known->name.empty()) {
+                title = known->name;
+            }
+        }
+        strncpy(slot.title, title.c_str(), TITLE_SIZE - 1);
+        roms.push_back(slot);
+    }
+
+    Header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.slots = 16;
+    while (header.slots < roms.size() * 2) {
+        header.slots *= 2;
+    }
+
+    std::vector<Slot> table(header.slots);
+    uint32_t tableMask = header.slots - 1;
+    for (const Slot& rom: roms) {
+        uint32_t i = rom.hash & tableMask;
+        while (table[i].used && table[i].hash != rom.hash) {
+            i = (i + 1) & tableMask;
+        }
+        // a copy of a ROM already indexed keeps the first one's slot
+        if (!table[i].used) {
+            table[i] = rom;
+            header.count++;
+        }
+    }
+
+    // written beside the old index and renamed over it, so readers mapping
+    // it never see half a file
+    std::string temporary = std::string(path) + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (out == NULL) {
+        throw std::runtime_error(std::string("ROM INDEX WRITE FAILED: ") + path);
+    }
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1
+        && fwrite(table.data(), sizeof(Slot), table.size(), out) == table.size();
+    written = (fclose(out) == 0) && written;
+    if (!written || rename(temporary.c_str(), path) != 0) {
+        remove(temporary.c_str());
+        throw std::runtime_error(std::string("ROM INDEX WRITE FAILED: ") + path);
+    }
+    return header.count;
+}
+
+bool settingsFor(uint64_t hash, const RomIndex& index, const RomDatabase& database, Profile& profile, uint32_t& hz, std::string* title) {
+    if (index.count() > 0) {
+        const RomIndex::Slot* slot = index.find(hash);
+        if (slot == nullptr) {
+            return false;
+        }
+        profile = (Profile) slot->profile;
+        if (slot->hz != 0) {
+            hz = slot->hz;
+        }
+        if (title != nullptr) {
+            *title = slot->title;
+        }
+        return true;
+    }
+
+    const RomDatabase::Entry* entry = database.find(hash);
+    if (entry == nullptr) {
+        return false;
+    }
+    profile = entry->profile;
+    if (entry->hz != 0) {
+        hz = entry->hz;
+    }
+    if (title != nullptr) {
+        *title = entry->name;
+    }
+    return true;
+}
+
+void openLibrary(const char* indexPath, const char* databasePath, RomIndex& index, RomDatabase& database) {
+    if (indexPath == NULL) {
+        database.load(databasePath);
+    } else if (!index.open(indexPath)) {
+        throw std::runtime_error(std::string("ROM INDEX OPEN FAILED: ") + indexPath);
+    }
+}
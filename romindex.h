@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <string>
+
+#include "quirks.h"
+#include "romdb.h"
+
+// A ROM library index: size, title, quirk profile and speed of every ROM in
+// a directory, keyed by the FNV-1a hash of its image (RomDatabase::hashRom).
+// It is a binary file in host byte order, mapped read-only and looked up in
+// place, so opening it reads nothing and a lookup touches one or two slots:
+//
+//   Header                      magic, version, slot count, ROM count
+//   Slot[slots]                 open addressing, linear probing, half full
+//                               at most
+//
+// build() writes it from a directory and the text ROM database; ROMs the
+// database doesn't list get the default profile and their file name.
+class RomIndex {
+    public:
+        static const int TITLE_SIZE = 46;
+
+        struct Slot {
+            uint64_t hash;
+            uint32_t size;
+            // instructions per second, 0 when not known
+            uint32_t hz;
+            uint8_t profile;
+            uint8_t used;
+            // null terminated, cut to fit
+            char title[TITLE_SIZE];
+        };
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            // a power of two
+            uint32_t slots;
+            uint64_t count;
+        };
+
+    private:
+        void* mapped = nullptr;
+        size_t length = 0;
+        const Slot* slots = nullptr;
+        uint32_t mask = 0;
+
+    public:
+        RomIndex() = default;
+        RomIndex(const RomIndex&) = delete;
+        RomIndex& operator=(const RomIndex&) = delete;
+        ~RomIndex() {
+            close();
+        }
+
+        // false when the file can't be read; a file that isn't an index is
+        // an error
+        bool open(const char* path);
+        void close();
+
+        // the ROM's slot, null when it isn't indexed
+        const Slot* find(uint64_t hash) const;
+
+        size_t count() const {
+            return mapped ? ((const Header*) mapped)->count : 0;
+        }
+        // the slots in table order, unused ones included
+        uint32_t capacity() const {
+            return slots ? mask + 1 : 0;
+        }
+        const Slot& slot(uint32_t i) const {
+            return slots[i];
+        }
+
+        // indexes the regular files in directory that fit in memory, writes
+        // the index to path and returns the number of ROMs in it
+        static size_t build(const char* directory, const RomDatabase& database, const char* path);
+};
+
+// What the library lists for a ROM: the index when one with ROMs in it is
+// open, else the database. Sets profile, hz (unless listed as unknown) and
+// title if given; returns false and changes nothing when the ROM isn't
+// listed.
+bool settingsFor(uint64_t hash, const RomIndex& index, const RomDatabase& database, Profile& profile, uint32_t& hz, std::string* title = nullptr);
+
+// Opens the library a tool looks ROMs up in: the index at indexPath when one
+// is named (throws when it can't be read), else the database at databasePath
+// if there is one.
+void openLibrary(const char* indexPath, const char* databasePath, RomIndex& index, RomDatabase& database);
@@ -0,0 +1,78 @@
+#include <thread>
+
+#include "scheduler.h"
+
+// instructions run between clock checks when the speed is unlimited
+static const uint64_t UNLIMITED_SLICE = 1024;
+
+Scheduler::Scheduler(Cpu& cpu, uint32_t hz) : cpu(cpu), hz(hz) {}
+
+uint64_t Scheduler::frameInstructions(uint64_t frame, uint32_t hz) {
+    return ((frame + 1) * hz) / FRAME_RATE - (frame * hz) / FRAME_RATE;
+}
+
+uint64_t Scheduler::runFrame(Clock::time_point deadline, uint64_t limit) {
+    uint64_t executed = 0;
+    bool complete = true;
+
+    if (hz == 0) {
+        while (Clock::now() < deadline) {
+            uint64_t count = UNLIMITED_SLICE;
+            if (limit != 0 && limit - executed <= count) {
+                count = limit - executed;
+                complete = false;
+            }
+            executed += cpu.run(count);
+            if (!complete) {
+                break;
+            }
+        }
+    } else {
+        uint64_t count = frameInstructions();
+        if (limit != 0 && limit < count) {
+            count = limit;
+            complete = false;
+        }
+        executed = cpu.run(count);
+    }
+
+    instructions += executed;
+    if (complete) {
+        cpu.tickTimers();
+        frames++;
+    }
+    return executed;
+}
+
+FramePacer::FramePacer() {
+    reset();
+}
+
+void FramePacer::reset() {
+    anchor = Clock::now();
+    frame = 0;
+}
+
+void FramePacer::setSpeed(uint32_t multiple) {
+    speed = (multiple != 0) ? multiple : 1;
+    reset();
+}
+
+Clock::time_point FramePacer::deadline() const {
+    return anchor + std::chrono::nanoseconds(((frame + 1) * 1000000000ull) / ((uint64_t) Scheduler::FRAME_RATE * speed));
+}
+
+void FramePacer::wait() {
+    Clock::time_point next = deadline();
+    Clock::time_point now = Clock::now();
+
+    if (now < next) {
+        std::this_thread::sleep_until(next);
+        frame++;
+    } else if (now - next > std::chrono::nanoseconds((MAX_LAG * 1000000000ull) / ((uint64_t) Scheduler::FRAME_RATE * speed))) {
+        reset();
+    } else {
+        // slightly late: skip the sleep and let the next frames catch up
+        frame++;
+    }
+}
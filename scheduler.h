@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cinttypes>
+#include <chrono>
+
+#include "cpu.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// Drives the core in 60 Hz frames of emulated time: a frame runs the
+// instructions the configured CPU speed allots to it, then ticks the timers
+// once, so timers run at exactly 60 Hz whatever the instruction rate.
+class Scheduler {
+    private:
+        Cpu& cpu;
+
+    public:
+        static const int FRAME_RATE = 60;
+
+        // instructions per second of emulated time, 0 runs every frame flat
+        // out until its wall-clock deadline
+        uint32_t hz;
+
+        uint64_t frames = 0;
+        uint64_t instructions = 0;
+
+        Scheduler(Cpu& cpu, uint32_t hz);
+
+        // instructions the next frame is allotted; speeds that aren't a
+        // multiple of 60 are spread so that frames * hz / 60 is exact
+        uint64_t frameInstructions() const {
+            return frameInstructions(frames, hz);
+        }
+        // the same for frame `frame` at any speed, for hosts that drive
+        // something other than a single Cpu
+        static uint64_t frameInstructions(uint64_t frame, uint32_t hz);
+
+        // runs one frame, never more than `limit` instructions (0: no limit).
+        // The timers only tick when the whole frame ran. Returns the number
+        // of instructions executed.
+        uint64_t runFrame(Clock::time_point deadline, uint64_t limit = 0);
+};
+
+// Paces frames against the host clock. Deadlines are computed from the frame
+// count since the last anchor rather than accumulated, so they never drift;
+// falling far behind (a stall, a debugger) re-anchors instead of racing to
+// catch up.
+class FramePacer {
+    private:
+        Clock::time_point anchor;
+        uint64_t frame;
+        // multiple of real time
+        uint32_t speed = 1;
+
+    public:
+        // frames of lag tolerated before re-anchoring
+        static const int MAX_LAG = 5;
+
+        FramePacer();
+
+        void reset();
+
+        // paces at `speed` times real time from now on, at least 1
+        void setSpeed(uint32_t speed);
+
+        // end of the frame currently being emulated
+        Clock::time_point deadline() const;
+
+        // sleeps until the current frame's deadline, then moves to the next
+        void wait();
+};
@@ -0,0 +1,145 @@
+// Runs ROMs in real time and serves them to local clients over a Unix domain
+// socket (see streamserver.h for the protocol):
+//
+//   serve [--threads n] [--hz n] [--seed n] [--copies n]
+//         [--engine interpreter|cache|jit] [--quirks default|chip8|schip|xochip]
+//         [--romdb file] [--romindex file] [--frames n] socket rom ...
+//
+// Every ROM runs --copies times (default 1), copy i with seed --seed + i, as
+// instances numbered in that order. A ROM runs with the profile and speed the
+// ROM index (or without one the ROM database) lists for it, unless --quirks
+// or --hz force them. The instances are printed as JSON once the socket is
+// up; then it serves until killed, or for --frames frames.
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "json.h"
+#include "romdb.h"
+#include "romfile.h"
+#include "romindex.h"
+#include "streamserver.h"
+#include "workpool.h"
+
+struct Rom {
+    std::string path;
+    RomFile file;
+    Profile profile = Profile::Default;
+    uint32_t hz = 0;
+};
+
+int main(int argc, char *argv[]) {
+    unsigned threads = 0;
+    uint32_t hz = 700;
+    bool hzForced = false;
+    uint64_t seed = 1;
+    unsigned copies = 1;
+    uint64_t frames = 0;
+    Engine engine = Engine::Jit;
+    bool profileForced = false;
+    Profile profile = Profile::Default;
+    const char* romdbPath = "roms.txt";
+    const char* romindexPath = NULL;
+    const char* socketPath = NULL;
+    std::vector<std::unique_ptr<Rom>> roms;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                threads = std::stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+                hz = std::stoul(argv[++i]);
+                hzForced = true;
+            } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                seed = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--copies") == 0 && i + 1 < argc) {
+                copies = std::stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+                frames = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc) {
+                romdbPath = argv[++i];
+            } else if (strcmp(argv[i], "--romindex") == 0 && i + 1 < argc) {
+                romindexPath = argv[++i];
+            } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+                i++;
+                if (!parseProfile(argv[i], profile)) {
+                    throw std::runtime_error(std::string("UNKNOWN QUIRKS: ") + argv[i]);
+                }
+                profileForced = true;
+            } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+                i++;
+                if (!parseEngine(argv[i], engine)) {
+                    throw std::runtime_error(std::string("UNKNOWN ENGINE: ") + argv[i]);
+                }
+            } else if (socketPath == NULL) {
+                socketPath = argv[i];
+            } else {
+                roms.emplace_back(new Rom());
+                roms.back()->path = argv[i];
+            }
+        }
+
+        if (roms.empty() || copies == 0) {
+            printf("usage: %s [--threads n] [--hz n] [--seed n] [--copies n] [--engine interpreter|cache|jit] [--quirks default|chip8|schip|xochip] [--romdb file] [--romindex file] [--frames n] socket rom ...\n", argv[0]);
+            return -1;
+        }
+        if (hz == 0) {
+            throw std::runtime_error("STREAMING NEEDS A FIXED SPEED.");
+        }
+
+        RomIndex index;
+        RomDatabase database;
+        openLibrary(romindexPath, romdbPath, index, database);
+
+        StreamServer server;
+        std::vector<std::unique_ptr<Cpu>> cpus;
+        printf("{\n  \"socket\": \"%s\",\n  \"instances\": [", jsonEscape(socketPath).c_str());
+        for (std::unique_ptr<Rom>& rom: roms) {
+            rom->file.open(rom->path.c_str());
+            uint64_t hash = RomDatabase::hashRom(rom->file.data(), rom->file.size());
+
+            Profile listed = Profile::Default;
+            uint32_t listedHz = hz;
+            settingsFor(hash, index, database, listed, listedHz);
+            rom->profile = profileForced ? profile : listed;
+            rom->hz = hzForced ? hz : listedHz;
+
+            for (unsigned copy = 0; copy < copies; copy++) {
+                cpus.emplace_back(new Cpu());
+                Cpu& cpu = *cpus.back();
+                cpu.init();
+                cpu.loadProgram(rom->file.data(), rom->file.size());
+                cpu.setProfile(rom->profile);
+                cpu.engine = engine;
+                cpu.seed(seed + copy);
+
+                uint16_t instance = server.add(cpu, rom->hz);
+                printf("%s\n    {\"instance\": %u, \"rom\": \"%s\", \"seed\": %" PRIu64 ", \"quirks\": \"%s\", \"hz\": %u}",
+                    instance == 0 ? "" : ",", instance, jsonEscape(rom->path).c_str(), seed + copy, profileName(rom->profile), rom->hz);
+            }
+        }
+        printf("\n  ]\n}\n");
+
+        server.open(socketPath);
+        fflush(stdout);
+
+        WorkPool pool(threads);
+        server.run(pool, frames);
+        server.close();
+
+        for (std::unique_ptr<Cpu>& cpu: cpus) {
+            cpu->deinit();
+        }
+    } catch (const std::runtime_error& error) {
+        fprintf(stderr, "%s\n", error.what());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+
+class Cpu;
+
+// Interfaces between the emulation core and whatever hosts it. The core only
+// ever talks to an AudioSink; video and input are driven by the host loop.
+class AudioSink {
+    public:
+        virtual ~AudioSink() {}
+
+        // tick is the number of 60 Hz timer ticks since the machine started,
+        // sinks can use it to place the change at the exact sample
+        virtual void play(uint64_t tick) = 0;
+        virtual void stop(uint64_t tick) = 0;
+
+        // silences the sink while the host runs faster than real time; play
+        // and stop still count, the beeper resumes in the state they left
+        virtual void setMuted(bool muted) {}
+};
+
+class VideoSink {
+    public:
+        virtual ~VideoSink() {}
+
+        // called at most once per frame, only when something was drawn;
+        // bit y of dirtyRows is set when row y changed since the last call
+        virtual void present(const Cpu& cpu, uint64_t dirtyRows) = 0;
+};
+
+class InputSource {
+    public:
+        virtual ~InputSource() {}
+
+        // updates the 16 key states, returns false once the host wants to quit
+        virtual bool poll(uint8_t keys[16]) = 0;
+
+        // whether the host wants to step back in time instead of running
+        virtual bool rewinding() const { return false; }
+
+        // whether the host wants to run faster than real time
+        virtual bool fastForward() const { return false; }
+
+        // blocks until there may be new input to poll, for a machine that
+        // can't do anything without it
+        virtual void wait() {}
+};
+
+// Null sinks for headless runs: no device, no window, no keys pressed.
+class NullAudioSink : public AudioSink {
+    public:
+        void play(uint64_t tick) override {}
+        void stop(uint64_t tick) override {}
+};
+
+class NullVideoSink : public VideoSink {
+    public:
+        void present(const Cpu& cpu, uint64_t dirtyRows) override {}
+};
+
+class NullInputSource : public InputSource {
+    public:
+        bool poll(uint8_t keys[16]) override { return true; }
+};
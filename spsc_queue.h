@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Bounded single-producer single-consumer queue. One thread only pushes, one
+// thread only pops; neither ever blocks or allocates. Capacity must be a
+// power of two.
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    private:
+        T items[Capacity];
+
+        // each index is written by one side only, keep them on their own lines
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+
+    public:
+        // producer side, false when the queue is full
+        bool push(const T& item) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == Capacity) {
+                return false;
+            }
+            items[t & (Capacity - 1)] = item;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // consumer side, the oldest item or null when the queue is empty
+        const T* front() {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            return &items[h & (Capacity - 1)];
+        }
+
+        // consumer side, drops the item returned by front()
+        void pop() {
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // consumer side, moves up to max items out at once
+        size_t pop(T* out, size_t max) {
+            size_t h = head.load(std::memory_order_relaxed);
+            size_t available = tail.load(std::memory_order_acquire) - h;
+            size_t n = available < max ? available : max;
+            for (size_t i = 0; i < n; i++) {
+                out[i] = items[(h + i) & (Capacity - 1)];
+            }
+            head.store(h + n, std::memory_order_release);
+            return n;
+        }
+
+        bool pop(T& item) {
+            const T* first = front();
+            if (first == nullptr) {
+                return false;
+            }
+            item = *first;
+            pop();
+            return true;
+        }
+};
@@ -0,0 +1,83 @@
+#include "statehash.h"
+
+#include <cstddef>
+
+#include "hash.h"
+
+// splitmix64 finalizer, so the sum of parts doesn't cancel out similar ones
+static uint64_t mix(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+    return value ^ (value >> 31);
+}
+
+// each part starts from its own basis, equal pages at two addresses differ
+static uint64_t basis(int part) {
+    return 0xCBF29CE484222325ull + (uint64_t) part * 0x9E3779B97F4A7C15ull;
+}
+
+uint64_t StateHasher::hashPage(const MachineState& state, int page) {
+    return mix(fnv1a(state.memory + page * MEMORY_PAGE, MEMORY_PAGE, basis(page)));
+}
+
+uint64_t StateHasher::hashRow(const MachineState& state, int y) {
+    uint64_t value = basis(MEMORY_PAGES + y);
+    for (int plane = 0; plane < PLANES; plane++) {
+        value = fnv1a((const uint8_t*) state.graphics[plane][y], sizeof(state.graphics[plane][y]), value);
+    }
+    return mix(value);
+}
+
+// everything after the screen: registers, timers, stack, keys and the rest
+uint64_t StateHasher::hashRest(const MachineState& state) {
+    size_t start = offsetof(MachineState, hires);
+    return fnv1a((const uint8_t*) &state + start, sizeof(MachineState) - start);
+}
+
+uint64_t StateHasher::reset(Cpu& cpu) {
+    parts = 0;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        pages[page] = hashPage(cpu, page);
+        parts += pages[page];
+    }
+    for (int y = 0; y < MAX_HEIGHT; y++) {
+        rows[y] = hashRow(cpu, y);
+        parts += rows[y];
+    }
+    cpu.writtenPages = 0;
+    cpu.dirtyRows = 0;
+
+    current = parts ^ hashRest(cpu);
+    return current;
+}
+
+uint64_t StateHasher::update(Cpu& cpu) {
+    for (uint64_t marks = cpu.writtenPages; marks != 0; marks &= marks - 1) {
+        int page = __builtin_ctzll(marks);
+        parts -= pages[page];
+        pages[page] = hashPage(cpu, page);
+        parts += pages[page];
+    }
+    for (uint64_t marks = cpu.dirtyRows; marks != 0; marks &= marks - 1) {
+        int y = __builtin_ctzll(marks);
+        parts -= rows[y];
+        rows[y] = hashRow(cpu, y);
+        parts += rows[y];
+    }
+    cpu.writtenPages = 0;
+    cpu.dirtyRows = 0;
+
+    current = parts ^ hashRest(cpu);
+    return current;
+}
+
+uint64_t StateHasher::of(const MachineState& state) {
+    uint64_t sum = 0;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        sum += hashPage(state, page);
+    }
+    for (int y = 0; y < MAX_HEIGHT; y++) {
+        sum += hashRow(state, y);
+    }
+    return sum ^ hashRest(state);
+}
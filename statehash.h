@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cinttypes>
+
+#include "cpu.h"
+
+// A hash of the whole machine state kept up to date from what changed, so
+// checking a running machine costs what it wrote rather than the size of its
+// state. Memory is hashed in pages and the screen in rows; update() rehashes
+// the pages and rows the Cpu marked (writtenPages, dirtyRows) since the last
+// call, plus the few bytes of registers, timers and stack. The parts are
+// summed, so replacing one costs the same however many there are.
+//
+// It owns the Cpu's marks: update() clears them.
+class StateHasher {
+    private:
+        uint64_t pages[MEMORY_PAGES];
+        uint64_t rows[MAX_HEIGHT];
+        // sum of the pages and rows
+        uint64_t parts;
+        uint64_t current;
+
+        static uint64_t hashPage(const MachineState& state, int page);
+        static uint64_t hashRow(const MachineState& state, int y);
+        static uint64_t hashRest(const MachineState& state);
+
+    public:
+        // hashes everything and clears the marks
+        uint64_t reset(Cpu& cpu);
+        // rehashes what the marks name and clears them
+        uint64_t update(Cpu& cpu);
+
+        uint64_t value() const {
+            return current;
+        }
+
+        // what reset() would return for this state, without touching any
+        // marks; differs from value() when something was written unmarked
+        static uint64_t of(const MachineState& state);
+};
@@ -0,0 +1,407 @@
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+#include "streamserver.h"
+#include "framelog.h"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define STREAM_SUPPORTED 1
+#else
+#define STREAM_SUPPORTED 0
+#endif
+
+// the largest frame delta: a hi-res keyframe with every byte of every plane set
+static const size_t MAX_DELTA = 16 + PLANES * MAX_HEIGHT * (2 + ROW_WORDS * 8);
+
+static void putInt(uint8_t* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (uint8_t) (value >> (i * 8));
+    }
+}
+
+static uint64_t getInt(const uint8_t* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t) in[i] << (i * 8);
+    }
+    return value;
+}
+
+StreamServer::~StreamServer() {
+    close();
+}
+
+uint16_t StreamServer::add(Cpu& cpu, uint32_t hz) {
+    if (instances.size() >= ALL_INSTANCES) {
+        throw std::runtime_error("TOO MANY INSTANCES.");
+    }
+    if (hz == 0) {
+        // a frame at unlimited speed never ends without a deadline
+        throw std::runtime_error("STREAMING NEEDS A FIXED SPEED.");
+    }
+    if (listener >= 0) {
+        // clients were told how many instances there are and size their
+        // subscriptions by it
+        throw std::runtime_error("INSTANCES HAVE TO BE ADDED BEFORE OPEN.");
+    }
+
+    Instance* instance = new Instance(cpu, hz);
+    instances.emplace_back(instance);
+    cpu.audio = &instance->audio;
+    memset(instance->shown, 0, sizeof(instance->shown));
+    instance->delta.reserve(MAX_DELTA);
+    instance->keyframe.reserve(MAX_DELTA);
+    // everything has to go out once
+    cpu.dirtyRows = ~(uint64_t) 0;
+    return instances.size() - 1;
+}
+
+bool StreamServer::queue(Client& client, uint8_t type, uint16_t instance, const uint8_t* payload, uint32_t size, const uint8_t* more, uint32_t moreSize) {
+    if (client.out.size() + HEADER_SIZE + size + moreSize > OUT_BYTES) {
+        return false;
+    }
+
+    uint8_t header[HEADER_SIZE];
+    header[0] = type;
+    header[1] = 0;
+    putInt(header + 2, instance, 2);
+    putInt(header + 4, size + moreSize, 4);
+    // out has OUT_BYTES reserved, none of these allocate
+    client.out.insert(client.out.end(), header, header + HEADER_SIZE);
+    client.out.insert(client.out.end(), payload, payload + size);
+    if (moreSize > 0) {
+        client.out.insert(client.out.end(), more, more + moreSize);
+    }
+    return true;
+}
+
+bool StreamServer::handle(Client& client, uint8_t type, uint16_t instance, const uint8_t* payload, uint32_t size) {
+    bool all = instance == ALL_INSTANCES;
+    if (!all && instance >= instances.size()) {
+        return false;
+    }
+
+    switch (type) {
+        case SUBSCRIBE:
+        case UNSUBSCRIBE:
+            if (size != 0) {
+                return false;
+            }
+            for (size_t i = 0; i < instances.size(); i++) {
+                if (all || i == instance) {
+                    client.subscriptions[i] = (type == SUBSCRIBE) ? RESYNC : NONE;
+                }
+            }
+            return true;
+        case KEY:
+            if (size != 2 || payload[0] >= 16) {
+                return false;
+            }
+            // frames only run between socket events, no machine is running
+            for (size_t i = 0; i < instances.size(); i++) {
+                if (all || i == instance) {
+                    instances[i]->cpu.keys[payload[0]] = payload[1] != 0;
+                }
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+void StreamServer::broadcast(uint64_t frame) {
+    uint8_t counters[16];
+    bool second = (frame + 1) % Scheduler::FRAME_RATE == 0;
+
+    for (size_t i = 0; i < instances.size(); i++) {
+        Instance& instance = *instances[i];
+        Cpu& cpu = instance.cpu;
+
+        uint8_t ticks[8];
+        putInt(ticks, cpu.ticks, 8);
+
+        // the delta from the dirty rows, shared by every client; a new
+        // resolution starts over from a keyframe
+        bool changed = false;
+        instance.delta.clear();
+        instance.keyframeBuilt = false;
+        if (cpu.frameDirty()) {
+            bool resolution = cpu.hires != instance.hires;
+            changed = encodeFrame(cpu.graphics, cpu.hires, resolution ? ~(uint64_t) 0 : cpu.dirtyRows, resolution, instance.shown, instance.delta);
+            instance.hires = cpu.hires;
+            cpu.dirtyRows = 0;
+        }
+        if (second) {
+            putInt(counters, instance.scheduler.frames, 8);
+            putInt(counters + 8, instance.scheduler.instructions, 8);
+        }
+
+        for (const std::unique_ptr<Client>& pointer: clients) {
+            Client& client = *pointer;
+            Subscription& subscription = client.subscriptions[i];
+            if (subscription == NONE) {
+                continue;
+            }
+
+            if (subscription == RESYNC) {
+                if (!instance.keyframeBuilt) {
+                    instance.keyframe.clear();
+                    encodeFrame(instance.shown, instance.hires, ~(uint64_t) 0, true, blank, instance.keyframe);
+                    instance.keyframeBuilt = true;
+                }
+                // the beeper as it is, its last change may be long gone
+                uint8_t beeper[9];
+                memcpy(beeper, ticks, sizeof(ticks));
+                beeper[8] = cpu.audioPlaying;
+                if (queue(client, FRAME, i, ticks, sizeof(ticks), instance.keyframe.data(), instance.keyframe.size())) {
+                    queue(client, AUDIO, i, beeper, sizeof(beeper));
+                    subscription = SUBSCRIBED;
+                }
+            } else if (changed && !queue(client, FRAME, i, ticks, sizeof(ticks), instance.delta.data(), instance.delta.size())) {
+                subscription = RESYNC;
+            }
+
+            for (int e = 0; e < instance.audio.count; e++) {
+                uint8_t event[9];
+                putInt(event, instance.audio.events[e].tick, 8);
+                event[8] = instance.audio.events[e].on;
+                queue(client, AUDIO, i, event, sizeof(event));
+            }
+            if (second) {
+                queue(client, COUNTERS, i, counters, sizeof(counters));
+            }
+        }
+        instance.audio.count = 0;
+    }
+}
+
+#if STREAM_SUPPORTED
+
+void StreamServer::open(const char* socketPath) {
+    close();
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        throw std::runtime_error(std::string("SOCKET PATH TOO LONG: ") + socketPath);
+    }
+    strcpy(address.sun_path, socketPath);
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        throw std::runtime_error("SOCKET CREATION FAILED.");
+    }
+    unlink(socketPath);
+    if (bind(listener, (sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        close();
+        throw std::runtime_error(std::string("SOCKET BIND FAILED: ") + socketPath);
+    }
+    path = socketPath;
+
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    // clients carry their Client, the listener nothing
+    event.data.ptr = nullptr;
+    if (epoll < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event) != 0) {
+        close();
+        throw std::runtime_error("EPOLL CREATION FAILED.");
+    }
+}
+
+void StreamServer::close() {
+    while (!clients.empty()) {
+        drop(clients.size() - 1);
+    }
+    if (listener >= 0) {
+        ::close(listener);
+        listener = -1;
+    }
+    if (epoll >= 0) {
+        ::close(epoll);
+        epoll = -1;
+    }
+    if (!path.empty()) {
+        unlink(path.c_str());
+        path.clear();
+    }
+}
+
+void StreamServer::accept() {
+    int fd;
+    while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        Client* client = new Client();
+        client->fd = fd;
+        client->in.resize(IN_BYTES);
+        client->out.reserve(OUT_BYTES);
+        client->subscriptions.assign(instances.size(), NONE);
+        clients.emplace_back(client);
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        uint8_t hello[8];
+        putInt(hello, instances.size(), 4);
+        putInt(hello + 4, Scheduler::FRAME_RATE, 4);
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) != 0 || !queue(*client, HELLO, 0, hello, sizeof(hello)) || !flush(*client)) {
+            drop(clients.size() - 1);
+        }
+    }
+}
+
+bool StreamServer::receive(Client& client) {
+    ssize_t count = recv(client.fd, client.in.data() + client.received, IN_BYTES - client.received, 0);
+    if (count == 0) {
+        return false;
+    }
+    if (count < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    client.received += count;
+
+    size_t at = 0;
+    while (client.received - at >= HEADER_SIZE) {
+        const uint8_t* header = client.in.data() + at;
+        uint32_t size = (uint32_t) getInt(header + 4, 4);
+        if (size > IN_BYTES - HEADER_SIZE) {
+            return false;
+        }
+        if (client.received - at < HEADER_SIZE + size) {
+            break;
+        }
+        if (!handle(client, header[0], (uint16_t) getInt(header + 2, 2), header + HEADER_SIZE, size)) {
+            return false;
+        }
+        at += HEADER_SIZE + size;
+    }
+    memmove(client.in.data(), client.in.data() + at, client.received - at);
+    client.received -= at;
+    return true;
+}
+
+bool StreamServer::flush(Client& client) {
+    if (!client.out.empty()) {
+        ssize_t sent = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return false;
+            }
+            sent = 0;
+        }
+        client.out.erase(client.out.begin(), client.out.begin() + sent);
+    }
+
+    // only ask for EPOLLOUT while there is something left to send
+    bool blocked = !client.out.empty();
+    if (blocked != client.blocked) {
+        epoll_event event = {};
+        event.events = blocked ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.ptr = &client;
+        if (epoll_ctl(epoll, EPOLL_CTL_MOD, client.fd, &event) != 0) {
+            return false;
+        }
+        client.blocked = blocked;
+    }
+    return true;
+}
+
+void StreamServer::drop(size_t index) {
+    Client& client = *clients[index];
+    epoll_ctl(epoll, EPOLL_CTL_DEL, client.fd, NULL);
+    ::close(client.fd);
+    clients.erase(clients.begin() + index);
+}
+
+void StreamServer::poll(Clock::time_point deadline) {
+    const int EVENTS = 64;
+    epoll_event events[EVENTS];
+
+    while (true) {
+        Clock::time_point now = Clock::now();
+        int timeout = 0;
+        if (now < deadline) {
+            // rounded up, waking early would only loop
+            timeout = (int) std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now + std::chrono::microseconds(999)).count();
+        }
+
+        int count = epoll_wait(epoll, events, EVENTS, timeout);
+        if (count < 0 && errno != EINTR) {
+            throw std::runtime_error("EPOLL WAIT FAILED.");
+        }
+        for (int e = 0; e < count; e++) {
+            Client* client = (Client*) events[e].data.ptr;
+            if (client == nullptr) {
+                accept();
+                continue;
+            }
+
+            bool keep = (events[e].events & (EPOLLERR | EPOLLHUP)) == 0;
+            if (keep && (events[e].events & EPOLLIN) != 0) {
+                keep = receive(*client);
+            }
+            if (keep && (events[e].events & EPOLLOUT) != 0) {
+                keep = flush(*client);
+            }
+            if (!keep) {
+                for (size_t c = 0; c < clients.size(); c++) {
+                    if (clients[c].get() == client) {
+                        drop(c);
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (Clock::now() >= deadline) {
+            return;
+        }
+    }
+}
+
+void StreamServer::run(WorkPool& pool, uint64_t frames) {
+    if (listener < 0) {
+        throw std::runtime_error("STREAM SERVER NOT OPEN.");
+    }
+
+    // built once, pool.run would otherwise wrap a new one every frame
+    std::function<void(size_t, unsigned)> step = [this](size_t i, unsigned worker) {
+        instances[i]->scheduler.runFrame(Clock::time_point::max());
+    };
+
+    FramePacer pacer;
+    for (uint64_t frame = 0; frames == 0 || frame < frames; frame++) {
+        pool.run(instances.size(), step);
+        broadcast(frame);
+
+        // one write per client for everything this frame produced; blocked
+        // clients continue when epoll says they can
+        for (size_t c = clients.size(); c > 0; c--) {
+            if (!clients[c - 1]->blocked && !flush(*clients[c - 1])) {
+                drop(c - 1);
+            }
+        }
+
+        poll(pacer.deadline());
+        pacer.wait();
+    }
+}
+
+#else
+
+void StreamServer::open(const char* socketPath) {
+    throw std::runtime_error("STREAMING NEEDS LINUX.");
+}
+
+void StreamServer::close() {}
+
+void StreamServer::run(WorkPool& pool, uint64_t frames) {
+    throw std::runtime_error("STREAMING NEEDS LINUX.");
+}
+
+#endif
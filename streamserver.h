@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cinttypes>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "scheduler.h"
+#include "sinks.h"
+#include "workpool.h"
+
+// Serves running machines over a Unix domain socket, for dashboards on the
+// same host: any number of clients watch and drive any number of instances
+// in one process. Every 60 Hz frame runs each instance for one frame (on a
+// work pool), then sends every client what its instances did, all of it in
+// one write per client. Sockets are handled in an epoll loop between frames.
+//
+// Messages, both ways, are an 8-byte header and a payload, little endian:
+//   type (1 byte), 0 (1 byte), instance (2 bytes), payload size (4 bytes)
+// To clients:
+//   HELLO     on connect: instances (4 bytes), frame rate (4 bytes)
+//   FRAME     frame (8 bytes, the machine's timer ticks), then a frame
+//             delta (see framelog.h), sent when the screen changed
+//   AUDIO     tick (8 bytes), beeper on (1 byte)
+//   COUNTERS  once a second: frames (8 bytes), instructions (8 bytes)
+// From clients:
+//   SUBSCRIBE    start getting an instance's messages, ALL_INSTANCES for
+//                every one; the first frame is a keyframe, followed by
+//                the beeper's state
+//   UNSUBSCRIBE  stop
+//   KEY          key (1 byte), down (1 byte)
+// A client that can't keep up loses frames, then gets a keyframe once its
+// buffer has room again. A malformed message drops the client.
+//
+// Linux only; elsewhere open() throws.
+class StreamServer {
+    public:
+        enum Type : uint8_t {
+            HELLO = 1,
+            FRAME = 2,
+            AUDIO = 3,
+            COUNTERS = 4,
+            SUBSCRIBE = 16,
+            UNSUBSCRIBE = 17,
+            KEY = 18
+        };
+        static const uint16_t ALL_INSTANCES = 0xFFFF;
+        static const size_t HEADER_SIZE = 8;
+
+    private:
+        // beeper changes during one frame; past that only the last one is
+        // kept, so the beeper still ends up right
+        static const int AUDIO_EVENTS = 16;
+
+        class Audio : public AudioSink {
+            public:
+                struct Event {
+                    uint64_t tick;
+                    bool on;
+                };
+                Event events[AUDIO_EVENTS];
+                int count = 0;
+
+                void play(uint64_t tick) override {
+                    add(tick, true);
+                }
+                void stop(uint64_t tick) override {
+                    add(tick, false);
+                }
+                void add(uint64_t tick, bool on) {
+                    if (count == AUDIO_EVENTS) {
+                        count--;
+                    }
+                    events[count++] = Event{ tick, on };
+                }
+        };
+
+        struct Instance {
+            Cpu& cpu;
+            Scheduler scheduler;
+            Audio audio;
+            // the screen as the last FRAME had it
+            uint64_t shown[PLANES][MAX_HEIGHT][ROW_WORDS];
+            // this frame's delta and keyframe, built once for every client
+            std::vector<uint8_t> delta;
+            std::vector<uint8_t> keyframe;
+            bool keyframeBuilt = false;
+            uint8_t hires = 0;
+
+            Instance(Cpu& cpu, uint32_t hz) : cpu(cpu), scheduler(cpu, hz) {}
+        };
+
+        enum Subscription : uint8_t {
+            NONE,
+            SUBSCRIBED,
+            // subscribed, the next frame has to be a keyframe
+            RESYNC
+        };
+
+        struct Client {
+            int fd;
+            // bytes received but not parsed yet, the first `received` of in
+            std::vector<uint8_t> in;
+            size_t received = 0;
+            // bytes to send, up to OUT_BYTES
+            std::vector<uint8_t> out;
+            // waiting for the socket to take more
+            bool blocked = false;
+            // by instance
+            std::vector<Subscription> subscriptions;
+        };
+
+        static const size_t IN_BYTES = 4096;
+        static const size_t OUT_BYTES = 1 << 20;
+
+        std::string path;
+        int listener = -1;
+        int epoll = -1;
+        std::vector<std::unique_ptr<Instance>> instances;
+        std::vector<std::unique_ptr<Client>> clients;
+        // scratch for keyframes
+        uint64_t blank[PLANES][MAX_HEIGHT][ROW_WORDS];
+
+        void accept();
+        // false when the client has to go
+        bool receive(Client& client);
+        bool handle(Client& client, uint8_t type, uint16_t instance, const uint8_t* payload, uint32_t size);
+        // queues a message if it fits
+        bool queue(Client& client, uint8_t type, uint16_t instance, const uint8_t* payload, uint32_t size, const uint8_t* more = nullptr, uint32_t moreSize = 0);
+        bool flush(Client& client);
+        void drop(size_t client);
+        void broadcast(uint64_t frame);
+        // handles socket events until the deadline
+        void poll(Clock::time_point deadline);
+
+    public:
+        ~StreamServer();
+
+        // listens on path, replacing whatever socket was there
+        void open(const char* path);
+        void close();
+
+        // serves a machine that is ready to run (program loaded, profile,
+        // engine and seed set) at hz instructions per second; its audio sink
+        // is replaced. Only before open. Returns its instance number.
+        uint16_t add(Cpu& cpu, uint32_t hz);
+
+        // runs every instance in real time for `frames` frames (0: forever),
+        // spreading them over pool
+        void run(WorkPool& pool, uint64_t frames = 0);
+};
@@ -0,0 +1,218 @@
+// Seed sweep: runs one ROM with many RNG seeds, Lockstep::LANES seeds at a
+// time on the lock-step engine (see lockstep.h), and prints every seed's
+// final state hash as JSON:
+//
+//   sweep [--frames n] [--hz n] [--quirks default|chip8|schip|xochip]
+//         [--romdb file] [--romindex file] [--log file] [--verify]
+//         rom first count
+//
+// The ROM runs with the profile and speed the ROM index (or without one the
+// ROM database) lists for it, unless --quirks or --hz force them. Every seed
+// runs --frames frames (default 600) with no keys pressed, or with the keys
+// of an input log, which then also sets the speed and the quirk profile. --verify runs every seed again on a plain Cpu and checks
+// that the hashes agree.
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "lockstep.h"
+#include "scheduler.h"
+#include "inputlog.h"
+#include "romdb.h"
+#include "romfile.h"
+#include "romindex.h"
+
+struct Sweep {
+    RomFile rom;
+    Profile profile = Profile::Default;
+    uint32_t hz = 700;
+    uint64_t frames = 600;
+    // empty for no keys
+    std::string log;
+};
+
+// the keys of frame after frame, the same for every seed
+static std::vector<uint16_t> readKeys(Sweep& sweep) {
+    std::vector<uint16_t> masks;
+    if (sweep.log.empty()) {
+        masks.assign(sweep.frames, 0);
+        return masks;
+    }
+
+    InputReplay replay;
+    replay.open(sweep.log.c_str());
+    sweep.hz = replay.hz;
+    sweep.profile = replay.profile;
+
+    uint8_t keys[16] = {};
+    bool keepOpen = true;
+    while (keepOpen) {
+        keepOpen = replay.poll(keys);
+        uint16_t mask = 0;
+        for (int k = 0; k < 16; k++) {
+            mask |= (keys[k] != 0) << k;
+        }
+        masks.push_back(mask);
+    }
+    sweep.frames = masks.size();
+    return masks;
+}
+
+static void setKeys(uint8_t keys[16], uint16_t mask) {
+    for (int k = 0; k < 16; k++) {
+        keys[k] = (mask >> k) & 1;
+    }
+}
+
+static uint64_t runScalar(Cpu& cpu, const Sweep& sweep, const std::vector<uint16_t>& keys, uint64_t seed) {
+    cpu.init();
+    cpu.loadProgram(sweep.rom.data(), sweep.rom.size());
+    cpu.setProfile(sweep.profile);
+    cpu.engine = Engine::DecodeCache;
+    cpu.seed(seed);
+
+    Scheduler scheduler(cpu, sweep.hz);
+    for (uint64_t frame = 0; frame < sweep.frames; frame++) {
+        setKeys(cpu.keys, keys[frame]);
+        scheduler.runFrame(Clock::time_point::max());
+    }
+
+    uint64_t hash = cpu.hash();
+    cpu.deinit();
+    return hash;
+}
+
+int main(int argc, char *argv[]) {
+    const char* romdbPath = "roms.txt";
+    const char* romindexPath = NULL;
+    const char* romPath = NULL;
+    uint64_t first = 0;
+    uint64_t count = 0;
+    int positional = 0;
+    bool profileForced = false;
+    bool hzForced = false;
+    bool verify = false;
+    Sweep sweep;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+                sweep.frames = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+                sweep.hz = std::stoul(argv[++i]);
+                hzForced = true;
+            } else if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc) {
+                romdbPath = argv[++i];
+            } else if (strcmp(argv[i], "--romindex") == 0 && i + 1 < argc) {
+                romindexPath = argv[++i];
+            } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+                sweep.log = argv[++i];
+            } else if (strcmp(argv[i], "--verify") == 0) {
+                verify = true;
+            } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+                i++;
+                if (!parseProfile(argv[i], sweep.profile)) {
+                    throw std::runtime_error(std::string("UNKNOWN QUIRKS: ") + argv[i]);
+                }
+                profileForced = true;
+            } else if (positional == 0) {
+                romPath = argv[i];
+                positional++;
+            } else if (positional == 1) {
+                first = std::stoull(argv[i]);
+                positional++;
+            } else {
+                count = std::stoull(argv[i]);
+                positional++;
+            }
+        }
+
+        if (positional != 3) {
+            printf("usage: %s [--frames n] [--hz n] [--quirks default|chip8|schip|xochip] [--romdb file] [--romindex file] [--log file] [--verify] rom first count\n", argv[0]);
+            return -1;
+        }
+
+        sweep.rom.open(romPath);
+
+        RomIndex index;
+        RomDatabase database;
+        openLibrary(romindexPath, romdbPath, index, database);
+        Profile listed = Profile::Default;
+        uint32_t listedHz = sweep.hz;
+        settingsFor(RomDatabase::hashRom(sweep.rom.data(), sweep.rom.size()), index, database, listed, listedHz);
+        if (!profileForced) {
+            sweep.profile = listed;
+        }
+        if (!hzForced) {
+            sweep.hz = listedHz;
+        }
+        std::vector<uint16_t> keys = readKeys(sweep);
+        if (sweep.hz == 0) {
+            // unlimited speed depends on the host clock, seeds wouldn't repeat
+            throw std::runtime_error("SWEEPS NEED A FIXED SPEED.");
+        }
+
+        std::vector<uint64_t> hashes(count);
+        static Lockstep group;
+        uint64_t steps = 0;
+        uint64_t instructions = 0;
+
+        Clock::time_point start = Clock::now();
+        for (uint64_t base = 0; base < count; base += Lockstep::LANES) {
+            // a short last group still fills every lane, the extras are dropped
+            uint64_t seeds[Lockstep::LANES];
+            for (int lane = 0; lane < Lockstep::LANES; lane++) {
+                seeds[lane] = first + base + lane;
+            }
+            group.init(sweep.rom.data(), sweep.rom.size(), sweep.profile, seeds);
+
+            for (uint64_t frame = 0; frame < sweep.frames; frame++) {
+                for (int lane = 0; lane < Lockstep::LANES; lane++) {
+                    setKeys(group.lane(lane).keys, keys[frame]);
+                }
+                group.run(Scheduler::frameInstructions(frame, sweep.hz));
+                group.tickTimers();
+            }
+
+            group.sync();
+            for (int lane = 0; lane < Lockstep::LANES && base + lane < count; lane++) {
+                hashes[base + lane] = group.lane(lane).hash();
+            }
+            steps += group.steps;
+            instructions += group.instructions;
+            group.deinit();
+        }
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+
+        printf("{\n  \"lanes\": %d,\n  \"hz\": %" PRIu32 ",\n  \"frames\": %" PRIu64 ",\n  \"seconds\": %.6f,\n", Lockstep::LANES, sweep.hz, sweep.frames, elapsed.count());
+        printf("  \"instructions_per_second\": %.0f,\n  \"lanes_per_step\": %.2f,\n  \"results\": [", instructions / elapsed.count(), steps ? (double) instructions / steps : 0.0);
+
+        static Cpu cpu;
+        bool allMatch = true;
+        for (uint64_t i = 0; i < count; i++) {
+            printf("%s\n    {\"seed\": %" PRIu64 ", \"state\": \"%.16" PRIX64 "\"", i == 0 ? "" : ",", first + i, hashes[i]);
+            if (verify) {
+                bool match = runScalar(cpu, sweep, keys, first + i) == hashes[i];
+                allMatch = allMatch && match;
+                printf(", \"matches_cpu\": %s", match ? "true" : "false");
+            }
+            printf("}");
+        }
+        printf("\n  ]\n}\n");
+
+        if (!allMatch) {
+            return 1;
+        }
+    } catch (const std::runtime_error& error) {
+        fprintf(stderr, "%s\n", error.what());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+
+#include "trace.h"
+
+// records moved out of the ring per write
+static const size_t BATCH_RECORDS = 4096;
+
+void Tracer::open(const char* path) {
+    file = fopen(path, "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("TRACE FILE CREATION FAILED.");
+    }
+
+    TraceHeader header = { { 'E', '8', 'T', 'R' }, 1, sizeof(TraceRecord), { 0, 0 } };
+    fwrite(&header, sizeof(header), 1, file);
+
+    running = true;
+    writer = std::thread(&Tracer::drain, this);
+}
+
+void Tracer::close() {
+    if (file == nullptr) {
+        return;
+    }
+
+    running = false;
+    writer.join();
+
+    fclose(file);
+    file = nullptr;
+}
+
+void Tracer::drain() {
+    std::vector<TraceRecord> batch(BATCH_RECORDS);
+
+    while (true) {
+        // read the flag first: once it is down nothing more gets pushed, so
+        // an empty ring after that means everything was written
+        bool more = running;
+        size_t n = ring.pop(batch.data(), BATCH_RECORDS);
+        if (n > 0) {
+            fwrite(batch.data(), sizeof(TraceRecord), n, file);
+        } else if (!more) {
+            break;
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
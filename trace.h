@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <thread>
+
+#include "cpu.h"
+#include "spsc_queue.h"
+
+// One executed instruction: the machine as it was right before it ran.
+// Fixed size so a trace file is just a header followed by an array of these.
+struct TraceRecord {
+    uint32_t tick;          // low bits of Cpu::ticks, the 60 Hz frame
+    uint16_t programCounter;
+    uint16_t opcode;
+    uint16_t index;
+    uint8_t stackPointer;
+    uint8_t delayTimer;
+    uint8_t soundTimer;
+    uint8_t reserved[3];
+    uint8_t registers[16];
+};
+
+static_assert(sizeof(TraceRecord) == 32, "trace records are 32 bytes");
+
+// File header, followed by the records.
+struct TraceHeader {
+    char magic[4];          // "E8TR"
+    uint8_t version;
+    uint8_t recordSize;
+    uint8_t reserved[2];
+};
+
+// Records instructions into a lock-free ring that a writer thread drains to
+// a file, so the emulation thread never touches the disk. When the writer
+// falls behind the emulation waits for it rather than dropping records.
+class Tracer {
+    private:
+        static const size_t RING_RECORDS = 1 << 16;
+
+        SpscQueue<TraceRecord, RING_RECORDS> ring;
+
+        FILE* file = nullptr;
+        std::thread writer;
+        std::atomic<bool> running{false};
+
+        void drain();
+
+    public:
+        void open(const char* path);
+        // writes out whatever is still queued
+        void close();
+
+        void record(const Cpu& cpu) {
+            TraceRecord r;
+            r.tick = (uint32_t) cpu.ticks;
+            r.programCounter = cpu.programCounter;
+            r.opcode = (cpu.memory[cpu.programCounter & 0xFFF] << 8) | cpu.memory[(cpu.programCounter + 1) & 0xFFF];
+            r.index = cpu.index;
+            r.stackPointer = (uint8_t) cpu.stackPointer;
+            r.delayTimer = cpu.delayTimer;
+            r.soundTimer = cpu.soundTimer;
+            r.reserved[0] = r.reserved[1] = r.reserved[2] = 0;
+            for (int i = 0; i < 16; i++) {
+                r.registers[i] = cpu.registers[i];
+            }
+
+            while (!ring.push(r)) {
+                std::this_thread::yield();
+            }
+        }
+};
+
+// Run loop policies, see Cpu::runWith. A policy that steps sees every
+// instruction before it executes, which rules out the JIT's whole blocks;
+// one that doesn't compiles to nothing.
+struct NoHooks {
+    static constexpr bool stepping = false;
+    static void before(Cpu& cpu) {}
+};
+
+struct TraceHooks {
+    static constexpr bool stepping = true;
+    static void before(Cpu& cpu) {
+        cpu.tracer->record(cpu);
+    }
+};
+
+// runs two policies, steps when either does
+template <typename First, typename Second>
+struct BothHooks {
+    static constexpr bool stepping = First::stepping || Second::stepping;
+    static void before(Cpu& cpu) {
+        First::before(cpu);
+        Second::before(cpu);
+    }
+};
@@ -0,0 +1,59 @@
+// Prints a binary trace written with --trace (see trace.h) as text, one
+// executed instruction per line:
+//
+//   tracedump trace [first [count]]
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "trace.h"
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: %s trace [first [count]]\n", argv[0]);
+        return -1;
+    }
+
+    uint64_t first = (argc > 2) ? std::stoull(argv[2]) : 0;
+    uint64_t count = (argc > 3) ? std::stoull(argv[3]) : UINT64_MAX;
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == nullptr) {
+        printf("Can't open %s.\n", argv[1]);
+        return -1;
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "E8TR", 4) != 0) {
+        printf("%s is not a trace.\n", argv[1]);
+        return -1;
+    }
+    if (header.version != 1 || header.recordSize != sizeof(TraceRecord)) {
+        printf("Unsupported trace version %d.\n", header.version);
+        return -1;
+    }
+
+    if (first > 0 && fseek(file, (long) (first * sizeof(TraceRecord)), SEEK_CUR) != 0) {
+        return 0;
+    }
+
+    TraceRecord records[4096];
+    uint64_t n = first;
+    size_t read;
+    while (count > 0 && (read = fread(records, sizeof(TraceRecord), 4096, file)) > 0) {
+        for (size_t i = 0; i < read && count > 0; i++, count--) {
+            const TraceRecord& r = records[i];
+            printf("%" PRIu64 " tick: %u pc: %.4X opcode: %.4X sp: %.2X i: %.4X regs: ", n++, r.tick, r.programCounter, r.opcode, r.stackPointer, r.index);
+            for (int v = 0; v < 16; v++) {
+                printf("%.2X ", r.registers[v]);
+            }
+            printf("delay: %X sound: %X\n", r.delayTimer, r.soundTimer);
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
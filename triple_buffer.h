@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free triple buffer: one thread writes values, another reads the newest
+// one whenever it likes. The writer fills the back slot and publishes it by
+// swapping it with the middle one; the reader swaps the middle one for its
+// front slot when something new is there. Neither side ever waits, and the
+// reader skips whatever values it was too slow for.
+template <typename T>
+class TripleBuffer {
+    private:
+        // set on the middle index while the reader hasn't taken it
+        static const uint8_t FRESH = 4;
+
+        T slots[3];
+
+        alignas(64) std::atomic<uint8_t> middle{1};
+        // writer side
+        alignas(64) uint8_t back = 0;
+        // reader side
+        alignas(64) uint8_t front = 2;
+
+    public:
+        // writer side, the slot to fill next
+        T& write() {
+            return slots[back];
+        }
+
+        // writer side, makes the filled slot the newest value
+        void publish() {
+            back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+        }
+
+        // reader side, moves to the newest value; false when there is none
+        // since the last call
+        bool update() {
+            if ((middle.load(std::memory_order_relaxed) & FRESH) == 0) {
+                return false;
+            }
+            front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+            return true;
+        }
+
+        // reader side, the value update() last moved to
+        const T& read() const {
+            return slots[front];
+        }
+};
@@ -0,0 +1,548 @@
+// Differential verification: runs every ROM on the reference interpreter and
+// on an accelerated engine side by side, with the same seed and keys, checks
+// that the two machines stay equal, and prints the results as JSON:
+//
+//   verify [--threads n] [--frames n] [--hz n] [--seed n] [--interval n]
+//          [--full n] [--engine cache|cache-unfused|jit]
+//          [--quirks default|chip8|schip|xochip] [--romdb file]
+//          [--romindex file] rom[:log] ...
+//
+// A ROM given with an input log replays it, which also decides the seed,
+// speed and quirk profile; otherwise it runs --frames frames (default 600)
+// with no keys pressed. Every engine is checked unless --engine picks one.
+//
+// The machines are compared every --interval instructions (default 1000)
+// by incremental state hashes (see statehash.h), and every --full checks
+// (default 64) and at the end byte for byte, which also catches writes the
+// hashes weren't told about. When they differ, both are rewound to the last
+// equal check to find the first instruction that makes them differ; the
+// output shows it with both machines' state after it.
+// Exits with 1 when any engine diverged.
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "scheduler.h"
+#include "inputlog.h"
+#include "json.h"
+#include "romdb.h"
+#include "romfile.h"
+#include "romindex.h"
+#include "statehash.h"
+#include "workpool.h"
+
+// an engine checked against the interpreter
+struct Target {
+    const char* name;
+    Engine engine;
+    bool fusion;
+};
+
+static const Target targets[] = {
+    { "cache-unfused", Engine::DecodeCache, false },
+    { "cache", Engine::DecodeCache, true },
+    { "jit", Engine::Jit, false }
+};
+
+// a ROM and everything its run depends on, settled before the workers start
+struct Rom {
+    std::string path;
+    std::string log;
+    RomFile file;
+    Profile profile = Profile::Default;
+    uint32_t hz = 0;
+    uint64_t seed = 0;
+    // the keys of frame after frame
+    std::vector<uint16_t> keys;
+};
+
+struct Result {
+    uint64_t frames = 0;
+    uint64_t instructions = 0;
+    uint64_t checks = 0;
+    double seconds = 0;
+    uint64_t hash = 0;
+
+    bool diverged = false;
+    // false when running again from the last equal check didn't diverge:
+    // the engine depends on where runs are cut
+    bool reproduced = false;
+    // the first instruction after which the machines differ, counted from 1
+    uint64_t instruction = 0;
+    uint64_t frame = 0;
+    uint16_t programCounter = 0;
+    uint16_t opcode = 0;
+    // JSON objects of both machines after it
+    std::string reference;
+    std::string engine;
+    std::vector<std::string> differences;
+
+    // set when a machine's memory or screen changed without being marked,
+    // which the decode cache and the JIT would miss as well
+    std::string untracked;
+    // set when the job failed, the rest is then meaningless
+    std::string error;
+};
+
+struct Settings {
+    uint64_t frames = 600;
+    uint32_t hz = 700;
+    bool hzForced = false;
+    uint64_t seed = 1;
+    bool profileForced = false;
+    Profile profile = Profile::Default;
+    uint64_t interval = 1000;
+    uint64_t full = 64;
+};
+
+// where a run is: its frame, the instructions run in that frame and in all
+struct Position {
+    uint64_t frame = 0;
+    uint64_t into = 0;
+    uint64_t instructions = 0;
+};
+
+static std::string format(const char* pattern, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, pattern);
+    vsnprintf(buffer, sizeof(buffer), pattern, args);
+    va_end(args);
+    return buffer;
+}
+
+static void setKeys(uint8_t keys[16], uint16_t mask) {
+    for (int k = 0; k < 16; k++) {
+        keys[k] = (mask >> k) & 1;
+    }
+}
+
+// maps the ROM, settles its profile, speed and seed and reads its keys
+static void loadRom(Rom& rom, const Settings& settings, const RomIndex& index, const RomDatabase& database) {
+    rom.file.open(rom.path.c_str());
+    uint64_t hash = RomDatabase::hashRom(rom.file.data(), rom.file.size());
+
+    Profile listed = Profile::Default;
+    uint32_t listedHz = settings.hz;
+    settingsFor(hash, index, database, listed, listedHz);
+    rom.profile = settings.profileForced ? settings.profile : listed;
+    rom.hz = settings.hzForced ? settings.hz : listedHz;
+    rom.seed = settings.seed;
+
+    if (rom.log.empty()) {
+        rom.keys.assign(settings.frames, 0);
+        return;
+    }
+
+    InputReplay replay;
+    replay.open(rom.log.c_str());
+    rom.seed = replay.seed;
+    rom.hz = replay.hz;
+    rom.profile = replay.profile;
+
+    uint8_t keys[16] = {};
+    bool keepOpen = true;
+    while (keepOpen) {
+        keepOpen = replay.poll(keys);
+        uint16_t mask = 0;
+        for (int k = 0; k < 16; k++) {
+            mask |= (keys[k] != 0) << k;
+        }
+        rom.keys.push_back(mask);
+    }
+}
+
+static void start(Cpu& cpu, const Rom& rom, Engine engine, bool fusion) {
+    cpu.init();
+    cpu.loadProgram(rom.file.data(), rom.file.size());
+    cpu.setProfile(rom.profile);
+    cpu.engine = engine;
+    cpu.setFusion(fusion);
+    cpu.seed(rom.seed);
+}
+
+// runs both machines `count` more instructions, in the same frames the
+// scheduler would cut, and returns how many ran before the keys ran out
+static uint64_t advance(Cpu& reference, Cpu& cpu, const Rom& rom, Position& position, uint64_t count) {
+    uint64_t executed = 0;
+    while (executed < count && position.frame < rom.keys.size()) {
+        if (position.into == 0) {
+            setKeys(reference.keys, rom.keys[position.frame]);
+            setKeys(cpu.keys, rom.keys[position.frame]);
+        }
+
+        uint64_t slice = std::min(Scheduler::frameInstructions(position.frame, rom.hz) - position.into, count - executed);
+        reference.run(slice);
+        cpu.run(slice);
+        position.into += slice;
+        position.instructions += slice;
+        executed += slice;
+
+        if (position.into == Scheduler::frameInstructions(position.frame, rom.hz)) {
+            reference.tickTimers();
+            cpu.tickTimers();
+            position.frame++;
+            position.into = 0;
+        }
+    }
+    return executed;
+}
+
+static bool equal(const MachineState& a, const MachineState& b) {
+    return memcmp(&a, &b, sizeof(MachineState)) == 0;
+}
+
+static std::string describeState(const MachineState& state) {
+    std::string out = format("{\"pc\": \"%.3X\", \"index\": \"%.3X\", \"registers\": \"", state.programCounter, state.index);
+    for (int r = 0; r < 16; r++) {
+        out += format("%s%.2X", r == 0 ? "" : " ", state.registers[r]);
+    }
+    out += "\", \"stack\": [";
+    for (int i = 0; i < state.stackPointer && i < 16; i++) {
+        out += format("%s\"%.3X\"", i == 0 ? "" : ", ", state.stack[i]);
+    }
+    out += format("], \"sp\": %u, \"delay\": %u, \"sound\": %u, \"hires\": %u, \"planes\": %u, \"rng\": \"%.16" PRIX64 "\"}",
+        state.stackPointer, state.delayTimer, state.soundTimer, state.hires, state.planes, state.rng);
+    return out;
+}
+
+// what differs between the machines, at most a handful of memory bytes and
+// screen rows
+static std::vector<std::string> describeDifferences(const MachineState& a, const MachineState& b) {
+    const int SHOWN = 16;
+    std::vector<std::string> out;
+
+    if (a.programCounter != b.programCounter) {
+        out.push_back(format("pc %.3X, %.3X", a.programCounter, b.programCounter));
+    }
+    if (a.index != b.index) {
+        out.push_back(format("I %.3X, %.3X", a.index, b.index));
+    }
+    for (int r = 0; r < 16; r++) {
+        if (a.registers[r] != b.registers[r]) {
+            out.push_back(format("V%X %.2X, %.2X", r, a.registers[r], b.registers[r]));
+        }
+    }
+    if (a.stackPointer != b.stackPointer) {
+        out.push_back(format("sp %u, %u", a.stackPointer, b.stackPointer));
+    }
+    for (int i = 0; i < 16; i++) {
+        if (a.stack[i] != b.stack[i]) {
+            out.push_back(format("stack[%d] %.3X, %.3X", i, a.stack[i], b.stack[i]));
+        }
+    }
+    if (a.delayTimer != b.delayTimer) {
+        out.push_back(format("delay %u, %u", a.delayTimer, b.delayTimer));
+    }
+    if (a.soundTimer != b.soundTimer) {
+        out.push_back(format("sound %u, %u", a.soundTimer, b.soundTimer));
+    }
+    if (a.ticks != b.ticks) {
+        out.push_back(format("ticks %" PRIu64 ", %" PRIu64, a.ticks, b.ticks));
+    }
+    if (a.hires != b.hires) {
+        out.push_back(format("hires %u, %u", a.hires, b.hires));
+    }
+    if (a.planes != b.planes) {
+        out.push_back(format("planes %u, %u", a.planes, b.planes));
+    }
+    if (memcmp(a.keys, b.keys, sizeof(a.keys)) != 0) {
+        out.push_back("keys");
+    }
+    if (a.rng != b.rng) {
+        out.push_back(format("rng %.16" PRIX64 ", %.16" PRIX64, a.rng, b.rng));
+    }
+
+    int bytes = 0;
+    for (int address = 0; address < 4096; address++) {
+        if (a.memory[address] != b.memory[address] && bytes++ < SHOWN) {
+            out.push_back(format("memory[%.3X] %.2X, %.2X", address, a.memory[address], b.memory[address]));
+        }
+    }
+    if (bytes > SHOWN) {
+        out.push_back(format("%d more memory bytes", bytes - SHOWN));
+    }
+
+    int rows = 0;
+    for (int y = 0; y < MAX_HEIGHT; y++) {
+        bool differs = false;
+        for (int plane = 0; plane < PLANES; plane++) {
+            differs = differs || memcmp(a.graphics[plane][y], b.graphics[plane][y], sizeof(a.graphics[plane][y])) != 0;
+        }
+        if (differs && rows++ < SHOWN) {
+            out.push_back(format("screen row %d", y));
+        }
+    }
+    if (rows > SHOWN) {
+        out.push_back(format("%d more screen rows", rows - SHOWN));
+    }
+    return out;
+}
+
+// The machines were equal at `good` and differ `span` instructions later:
+// finds the first instruction after which they differ. Every try restarts
+// both machines from the snapshot and runs them one instruction further, so
+// the engine still runs whole blocks and superinstructions where they fit; a
+// bisection could land on a later divergence when the machines differ for a
+// while and then agree again.
+static void findDivergence(Cpu& reference, Cpu& cpu, const Rom& rom, const MachineState& good, const Position& goodPosition, uint64_t span, Result& result) {
+    auto rerun = [&](uint64_t count) {
+        reference.loadState(good);
+        cpu.loadState(good);
+        Position position = goodPosition;
+        advance(reference, cpu, rom, position, count);
+        return position;
+    };
+
+    rerun(span);
+    result.reproduced = !equal(reference, cpu);
+    if (!result.reproduced) {
+        return;
+    }
+
+    uint64_t first = 1;
+    while (first < span) {
+        rerun(first);
+        if (!equal(reference, cpu)) {
+            break;
+        }
+        first++;
+    }
+
+    Position position = rerun(first - 1);
+    result.frame = position.frame;
+    result.programCounter = reference.programCounter;
+    result.opcode = (reference.memory[reference.programCounter & 0xFFF] << 8) | reference.memory[(reference.programCounter + 1) & 0xFFF];
+    position = rerun(first);
+    result.instruction = position.instructions;
+
+    result.reference = describeState(reference);
+    result.engine = describeState(cpu);
+    result.differences = describeDifferences(reference, cpu);
+}
+
+static void verifyRom(Cpu& reference, Cpu& cpu, MachineState& good, const Rom& rom, const Target& target, const Settings& settings, Result& result) {
+    start(reference, rom, Engine::Interpreter, false);
+    start(cpu, rom, target.engine, target.fusion);
+
+    StateHasher referenceHash;
+    StateHasher cpuHash;
+    referenceHash.reset(reference);
+    cpuHash.reset(cpu);
+
+    Position position;
+    Position goodPosition;
+    reference.saveState(good);
+
+    Clock::time_point begin = Clock::now();
+    while (position.frame < rom.keys.size()) {
+        uint64_t span = advance(reference, cpu, rom, position, settings.interval);
+        result.checks++;
+
+        bool same = referenceHash.update(reference) == cpuHash.update(cpu);
+        bool last = position.frame == rom.keys.size();
+        if (!same || last || (settings.full != 0 && result.checks % settings.full == 0)) {
+            // equal machines with different hashes: one hash missed a write
+            same = equal(reference, cpu);
+            if (same && referenceHash.value() != StateHasher::of(reference)) {
+                result.untracked = format("interpreter, by instruction %" PRIu64, position.instructions);
+            } else if (same && cpuHash.value() != StateHasher::of(cpu)) {
+                result.untracked = format("%s, by instruction %" PRIu64, target.name, position.instructions);
+            }
+            if (!result.untracked.empty()) {
+                break;
+            }
+        }
+
+        if (!same) {
+            result.diverged = true;
+            findDivergence(reference, cpu, rom, good, goodPosition, span, result);
+            break;
+        }
+        reference.saveState(good);
+        goodPosition = position;
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - begin;
+
+    result.frames = position.frame;
+    result.instructions = position.instructions;
+    result.seconds = elapsed.count();
+    result.hash = reference.hash();
+
+    reference.deinit();
+    cpu.deinit();
+}
+
+static void printResult(const Result& result) {
+    if (!result.error.empty()) {
+        printf("\"error\": \"%s\"}", jsonEscape(result.error).c_str());
+        return;
+    }
+    printf("\"frames\": %" PRIu64 ", \"instructions\": %" PRIu64 ", \"checks\": %" PRIu64 ", \"seconds\": %.6f, ",
+        result.frames, result.instructions, result.checks, result.seconds);
+    if (!result.untracked.empty()) {
+        printf("\"matches\": false, \"untracked_write\": \"%s\"}", jsonEscape(result.untracked).c_str());
+        return;
+    }
+    if (!result.diverged) {
+        printf("\"matches\": true, \"state\": \"%.16" PRIX64 "\"}", result.hash);
+        return;
+    }
+
+    printf("\"matches\": false, \"reproduced\": %s", result.reproduced ? "true" : "false");
+    if (result.reproduced) {
+        printf(",\n      \"instruction\": %" PRIu64 ", \"frame\": %" PRIu64 ", \"pc\": \"%.3X\", \"opcode\": \"%.4X\",\n",
+            result.instruction, result.frame, result.programCounter, result.opcode);
+        printf("      \"interpreter\": %s,\n      \"engine\": %s,\n      \"differences\": [", result.reference.c_str(), result.engine.c_str());
+        for (size_t i = 0; i < result.differences.size(); i++) {
+            printf("%s\"%s\"", i == 0 ? "" : ", ", result.differences[i].c_str());
+        }
+        printf("]");
+    }
+    printf("}");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned threads = 0;
+    const char* romdbPath = "roms.txt";
+    const char* romindexPath = NULL;
+    std::vector<const Target*> checked;
+    std::vector<std::unique_ptr<Rom>> roms;
+    Settings settings;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+                threads = std::stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+                settings.frames = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+                settings.hz = std::stoul(argv[++i]);
+                settings.hzForced = true;
+            } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                settings.seed = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+                settings.interval = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--full") == 0 && i + 1 < argc) {
+                settings.full = std::stoull(argv[++i]);
+            } else if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc) {
+                romdbPath = argv[++i];
+            } else if (strcmp(argv[i], "--romindex") == 0 && i + 1 < argc) {
+                romindexPath = argv[++i];
+            } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+                i++;
+                if (!parseProfile(argv[i], settings.profile)) {
+                    throw std::runtime_error(std::string("UNKNOWN QUIRKS: ") + argv[i]);
+                }
+                settings.profileForced = true;
+            } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+                i++;
+                const Target* found = NULL;
+                for (const Target& target: targets) {
+                    if (strcmp(argv[i], target.name) == 0) {
+                        found = &target;
+                    }
+                }
+                if (found == NULL) {
+                    throw std::runtime_error(std::string("UNKNOWN ENGINE: ") + argv[i]);
+                }
+                checked.push_back(found);
+            } else {
+                std::string arg = argv[i];
+                size_t colon = arg.find(':');
+                roms.emplace_back(new Rom());
+                roms.back()->path = arg.substr(0, colon);
+                if (colon != std::string::npos) {
+                    roms.back()->log = arg.substr(colon + 1);
+                }
+            }
+        }
+
+        if (roms.empty()) {
+            printf("usage: %s [--threads n] [--frames n] [--hz n] [--seed n] [--interval n] [--full n] [--engine cache|cache-unfused|jit] [--quirks default|chip8|schip|xochip] [--romdb file] [--romindex file] rom[:log] ...\n", argv[0]);
+            return -1;
+        }
+        if (settings.hz == 0) {
+            // unlimited speed depends on the host clock, runs wouldn't repeat
+            throw std::runtime_error("VERIFICATION NEEDS A FIXED SPEED.");
+        }
+        if (settings.interval == 0) {
+            throw std::runtime_error("INTERVAL MUST BE AT LEAST 1.");
+        }
+        if (checked.empty()) {
+            for (const Target& target: targets) {
+                checked.push_back(&target);
+            }
+        }
+
+        RomIndex index;
+        RomDatabase database;
+        openLibrary(romindexPath, romdbPath, index, database);
+        for (std::unique_ptr<Rom>& rom: roms) {
+            loadRom(*rom, settings, index, database);
+            if (rom->hz == 0) {
+                throw std::runtime_error("VERIFICATION NEEDS A FIXED SPEED: " + rom->path);
+            }
+        }
+
+        // one job per ROM and engine; every worker keeps both machines and a
+        // snapshot, reused from job to job
+        WorkPool pool(threads);
+        std::vector<std::unique_ptr<Cpu>> references;
+        std::vector<std::unique_ptr<Cpu>> cpus;
+        std::vector<MachineState> snapshots(pool.threads());
+        for (unsigned w = 0; w < pool.threads(); w++) {
+            references.emplace_back(new Cpu());
+            cpus.emplace_back(new Cpu());
+        }
+        size_t jobs = roms.size() * checked.size();
+        std::vector<Result> results(jobs);
+
+        Clock::time_point begin = Clock::now();
+        pool.run(jobs, [&](size_t job, unsigned worker) {
+            try {
+                verifyRom(*references[worker], *cpus[worker], snapshots[worker], *roms[job / checked.size()], *checked[job % checked.size()], settings, results[job]);
+            } catch (const std::exception& error) {
+                results[job].error = error.what();
+                references[worker]->deinit();
+                cpus[worker]->deinit();
+            }
+        });
+        std::chrono::duration<double> elapsed = Clock::now() - begin;
+
+        uint64_t instructions = 0;
+        bool allMatch = true;
+        for (const Result& result: results) {
+            instructions += result.instructions;
+            allMatch = allMatch && result.error.empty() && result.untracked.empty() && !result.diverged;
+        }
+
+        printf("{\n  \"threads\": %u,\n  \"interval\": %" PRIu64 ",\n  \"seconds\": %.6f,\n  \"instructions_per_second\": %.0f,\n  \"results\": [",
+            pool.threads(), settings.interval, elapsed.count(), instructions / elapsed.count());
+        for (size_t job = 0; job < jobs; job++) {
+            const Rom& rom = *roms[job / checked.size()];
+            printf("%s\n    {\"rom\": \"%s\", \"log\": \"%s\", \"engine\": \"%s\", ", job == 0 ? "" : ",",
+                jsonEscape(rom.path).c_str(), jsonEscape(rom.log).c_str(), checked[job % checked.size()]->name);
+            printResult(results[job]);
+        }
+        printf("\n  ]\n}\n");
+
+        if (!allMatch) {
+            return 1;
+        }
+    } catch (const std::runtime_error& error) {
+        fprintf(stderr, "%s\n", error.what());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <algorithm>
+
+#include "workpool.h"
+
+WorkPool::WorkPool(unsigned threads) {
+    count = (threads != 0) ? threads : std::max(1u, std::thread::hardware_concurrency());
+    shares.reset(new Share[count]);
+    for (unsigned w = 0; w < count; w++) {
+        shares[w].next = 0;
+        shares[w].end = 0;
+    }
+    for (unsigned w = 1; w < count; w++) {
+        helpers.emplace_back(&WorkPool::serve, this, w);
+    }
+}
+
+WorkPool::~WorkPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quitting = true;
+    }
+    wake.notify_all();
+    for (std::thread& helper: helpers) {
+        helper.join();
+    }
+}
+
+void WorkPool::drain(unsigned worker) {
+    // own share first, then the others'; a claim past the end of a share
+    // just means it is used up
+    for (unsigned i = 0; i < count; i++) {
+        Share& share = shares[(worker + i) % count];
+        size_t job;
+        while ((job = share.next.fetch_add(1, std::memory_order_relaxed)) < share.end) {
+            (*work)(job, worker);
+        }
+    }
+}
+
+void WorkPool::serve(unsigned worker) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        wake.wait(guard, [&] { return quitting || generation != seen; });
+        if (quitting) {
+            return;
+        }
+        seen = generation;
+
+        guard.unlock();
+        drain(worker);
+        guard.lock();
+
+        if (--busy == 0) {
+            finished.notify_one();
+        }
+    }
+}
+
+void WorkPool::run(size_t jobs, const std::function<void(size_t job, unsigned worker)>& work) {
+    std::unique_lock<std::mutex> guard(lock);
+    for (unsigned w = 0; w < count; w++) {
+        shares[w].next = jobs * w / count;
+        shares[w].end = jobs * (w + 1) / count;
+    }
+    this->work = &work;
+    busy = helpers.size();
+    generation++;
+    guard.unlock();
+    wake.notify_all();
+
+    drain(0);
+
+    guard.lock();
+    finished.wait(guard, [&] { return busy == 0; });
+}
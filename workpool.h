@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs sets of independent jobs on a pool of threads that live as long as
+// the pool. Each worker starts on its own contiguous share of the jobs; one
+// that runs dry steals from the others' shares, so long jobs on one thread
+// don't leave the rest idle. Shares are claimed with an atomic counter, a
+// run takes no lock per job and allocates nothing.
+class WorkPool {
+    private:
+        struct alignas(64) Share {
+            std::atomic<size_t> next;
+            size_t end;
+        };
+
+        unsigned count;
+        std::unique_ptr<Share[]> shares;
+        std::vector<std::thread> helpers;
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable finished;
+        // bumped by every run, helpers wait for it to change
+        uint64_t generation = 0;
+        unsigned busy = 0;
+        bool quitting = false;
+        const std::function<void(size_t job, unsigned worker)>* work = nullptr;
+
+        void serve(unsigned worker);
+        void drain(unsigned worker);
+
+    public:
+        // 0 threads: one per hardware thread
+        explicit WorkPool(unsigned threads = 0);
+        ~WorkPool();
+
+        unsigned threads() const {
+            return count;
+        }
+
+        // calls work(job, worker) once for every job in [0, jobs) and returns
+        // when all of them are done. worker is the index of the calling
+        // thread, for per-thread state; the caller's thread is worker 0
+        void run(size_t jobs, const std::function<void(size_t job, unsigned worker)>& work);
+};